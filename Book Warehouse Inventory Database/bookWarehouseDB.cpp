@@ -29,8 +29,9 @@
 //			a back-order. A value of 0 indicates that
 //			there are no available copies of that book.
 //				
-// This data is stored in an array of records in alphabetic order based
-// on the author's last name field, which is called the key field.
+// This data is kept in alphabetic order based on the author's last
+// name field, which is called the key field; books by the same author
+// are ordered by inventory number.
 // The data is read from a user-specified file at the start of the program
 // and is written to a user-specified file as the program terminates.
 // The program is menu-driven and the user is allowed to work with the
@@ -39,6 +40,54 @@
 // whereas selection of an invalid choice results in an appropriate error
 // message.
 //
+// The records live in a vector of slots in no particular order. The
+// key order is given by an ordered index from (author_name, inventory
+// number) to slot, and a hash index finds a slot by inventory number.
+// Inserting or removing a record therefore touches only the indexes
+// and one slot; a removed slot is put on a free list for reuse.
+//
+// A slot holds a packed Record rather than an Entry. Author names and
+// comments repeat heavily, so each distinct one is stored once in a
+// string pool and a record holds its 32 bit id; two records have the
+// same author exactly when their ids are equal. A pooled string is
+// counted by the records that use it; once none does it is freed and
+// its id used again for the next new string, so the pool holds only
+// what the records do. Titles are packed end to end in one arena and
+// a record holds an offset and length. An Entry is unpacked from a
+// slot whenever a whole record is needed.
+//
+// The inventory is split into shards, one per core, by a hash of the
+// inventory number. Each shard keeps its own slots, string pool, title
+// arena and indexes along with a reader/writer lock, so that several
+// clients (pick stations, receiving) may work on the same store at
+// once. Listing and searching take the shared locks and run side by
+// side; changes take the locks of the shards they touch exclusively,
+// and only while they are applied - never while waiting on the user.
+// No lock is held while output is written: a full listing, export or
+// save copies its entries a few thousand at a time under the shared
+// locks and writes each batch after letting them go, so a change
+// waits at most for one batch to be copied. Changes to records in
+// different shards go ahead in parallel. A lookup by inventory number
+// goes to one shard; a query by name, location or words goes to every
+// shard, shared out with a pool of worker threads when the shards are
+// large, and their sorted answers are merged. Such a query, like the
+// totals, locks only one shard at a time, and a name or location
+// query only for a few thousand records at a time, so it never holds
+// up changes to the other shards. Each shard also keeps
+// Bloom filters of its inventory numbers and of every leading part of
+// its author names, so that most lookups of a number, and most FINDs
+// of a name, that a shard does not have are answered without
+// searching its indexes.
+//
+// Changes are made through mutations (insert, update one field, adjust
+// the quantity, remove) grouped into a transaction. A transaction is
+// applied under the write locks of its shards, taken together: a
+// listing or export sees all of it or none of it, and if any mutation
+// fails the ones before it are undone. A query that reads one shard at
+// a time may see a transaction over several shards on some of them
+// only. Adjusting a quantity also takes its shard's write lock, as the
+// shard's stock totals and the change stream move along with it.
+//
 // The allowable operations on the inventory database are:
 //
 //    LIST ALL  	- displays all inventory entries
@@ -46,20 +95,278 @@
 //			  that match author's last name
 //    REMOVE		- allows the user to delete an existing entry in the
 //                        inventory based on a book id.
+//    SEARCH		- lists the entries whose title, comment or author
+//			  name best match some words, allowing for
+//			  partial words and typing mistakes
+//    LIST BY LOCATION	- displays the entries in one bin, a whole shelf
+//			  or a range of bins on a shelf, in the order a
+//			  picker walks past them
+//    EXPORT		- writes every entry to a file as CSV, JSON lines,
+//			  fixed width columns, tab separated lines, the
+//			  inventory file layout or the displayed layout
+//    TOTALS		- displays the books, copies on hand, books out of
+//			  stock, books back-ordered and copies owed, by
+//			  category (comment), author or shelf, or for the
+//			  whole inventory; these are kept up to date as
+//			  each record changes, so nothing is scanned
+//    STATS		- displays the metrics described below
 //    QUIT    	        - to exit the program
 //
+// Batch and server modes:
+//
+//    bookWarehouseDB -batch <inventory file> [<change file>]
+//        reads commands from standard input, one per line, and writes
+//        the replies to standard output.
+//    bookWarehouseDB -serve <inventory file> <socket path> [<change file>]
+//        listens on a Unix domain socket and serves any number of
+//        clients at once, each on its own thread.
+//
+// Neither mode prompts, and neither saves on exit; use SAVE. The
+// commands are:
+//
+//    LIST                - every entry
+//    FIND <name prefix>  - entries whose author_name starts with prefix;
+//                          the prefix is the rest of the line
+//    GET <inventory no>  - the entry with that inventory number
+//    SEARCH <words>      - the best matches for the words; see SEARCH
+//    LOC <bins>          - entries in a bin (h-03), on a shelf (g), or in
+//                          a range of bins on a shelf (g 70 79), in walk
+//                          order
+//    REMOVE <inventory no> - delete that entry (no confirmation)
+//    ADD <fields>        - insert an entry; the fields are given as in a
+//                          record line of a reply
+//    SET <inventory no> <field> <value>
+//                        - change one field of an entry; the field is one
+//                          of author, initial, location, title, comment or
+//                          quantity, and the value runs to end of line
+//    ADJ <inventory no> <delta>
+//                        - add delta (which may be negative) to quantity
+//    BEGIN               - hold back REMOVE, ADD, SET and ADJ
+//    COMMIT              - apply the held back changes as one transaction
+//    ABORT               - discard the held back changes
+//    TOTALS <category | author | shelf | all> [<name>]
+//                        - stock totals of every group, or of the named
+//                          one; see TOTALS above. Each is a line of the
+//                          group name, books, on hand, out of stock,
+//                          back orders and copies owed
+//    CHANGES <sequence no> [<limit>]
+//                        - the changes made after that one, oldest first;
+//                          see the change stream below
+//    STATS [text | json] - the metrics below, a "name<tab>value" line
+//                          each, or all on one JSON line
+//    STATS on | off      - start or stop recording metrics
+//    STATS every <seconds> <file> [text | json]
+//                        - append the metrics to a file every so often;
+//                          STATS every 0 stops
+//    SAVE <file>         - write the inventory to a file
+//    EXPORT <format> <file>
+//                        - write the inventory to a file as csv, json,
+//                          fixed, tab, inventory or report
+//    QUIT                - close this session
+//    SHUTDOWN            - close this session and stop the server
+//
+// Each reply is zero or more record lines, with the fields of an entry
+// separated by tabs in the order listed above, followed by a status
+// line "OK <count>" or "ERR <reason>". The count is the number of
+// records listed or changed; a change held back by BEGIN reports 0 and
+// COMMIT reports the number of changes applied. Requests may be pipelined: a
+// client may send any number of commands without waiting, and the
+// replies come back in order. Replies to every command found in one
+// read are gathered and sent with a single write. A server client's
+// line may be at most 1024 characters; a longer one is answered with
+// an error and the connection closed.
+//
+// Change stream:
+//
+// Every change made is given the next sequence number and published,
+// so that downstream systems (reordering, reporting) can follow the
+// inventory instead of comparing whole saved files. A change is a line
+// of the sequence number, INSERT, UPDATE, ADJUST or REMOVE, and the
+// record's fields - as they are after the change, or for REMOVE as
+// they were - separated by tabs. The changes of one transaction are
+// numbered together. Since each line carries the whole record,
+// applying a change twice does no harm.
+//
+// The last 65536 changes are kept in a ring in memory, which any
+// number of readers follow without locking and without holding up
+// the writers; CHANGES reads it. If a change file is named, every
+// change is also appended to it as it is made, for tools that tail
+// the file; the numbering carries on from the end of the file.
+//
+// Metrics:
+//
+// Every thread counts and times what it does in a block of its own,
+// with no locks, and STATS adds the blocks up. For each operation
+// (load, scan, find, get, search, location, totals, commit, remove,
+// compact) there is a count and the mean, 50th, 90th, 99th and 99.9th
+// percentile and largest latency, in microseconds, from a histogram
+// with 12.5% wide buckets. Quick operations are timed one in 16, so
+// reading the clock does not slow them. There are also hits and misses
+// of each index and of the page pool, failed transactions, bytes freed
+// by compaction, and an estimate of the memory each structure uses.
+//
+// Paged storage:
+//
+//    bookWarehouseDB -paged <megabytes> [<any of the above>]
+//        keeps the records themselves in a page file on disk, split
+//        into 4096 byte pages, rather than in memory. No more than the
+//        given megabytes of pages are held in memory, divided between
+//        the shards; a page is read in when one of its records is
+//        wanted, and the page used least recently (roughly: CLOCK
+//        eviction) makes room for it, written back first if it was
+//        changed. The indexes, totals and pooled author names and
+//        comments stay in memory, so lookups and queries still need no
+//        disk reads but to fetch the records they list. The page file
+//        is temporary; the inventory file is still loaded at startup
+//        and saved with SAVE, as usual.
+//
+// Sorting:
+//
+//    bookWarehouseDB -sort <inventory file> <sorted file> [<megabytes>]
+//        writes the entries of an inventory file, which may be in any
+//        order and larger than memory, to another in key field order.
+//        Pieces of the file are sorted on every processor at once and
+//        spilled to temporary files, which are then merged. Entries
+//        that repeat an inventory number already read are reported
+//        and left out, as when loading. The sort uses about 256
+//        megabytes for records unless told otherwise.
+//
+// Benchmarking:
+//
+//    bookWarehouseDB -generate <records> <inventory file>
+//        writes a synthetic inventory shaped like a real one: a few
+//        authors with many books and many with a few, about one book
+//        in ten back-ordered, and books spread over every bin.
+//    bookWarehouseDB -bench <records> [<mix> [<operations> [<clients>]]]
+//        times loading a synthetic inventory, a mix of operations run
+//        by some clients at once, and saving, and writes the rates,
+//        latency percentiles and peak memory as one line of JSON. The
+//        mix is one of lookup (GET), prefix (FIND), delete (REMOVE),
+//        mixed (70/20/10) and pick (90/9/1); mixed is the default,
+//        with 100000 operations from one client.
+//
 // *********************************************************************
 
 #include <iostream>
 #include <fstream>
 #include <iomanip>
 #include <cstring>
+#include <climits>
+#include <cerrno>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <tuple>
+#include <deque>
+#include <string_view>
+#include <cstdint>
+#include <algorithm>
+#include <cctype>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <memory>
+#include <functional>
+#include <queue>
+#include <chrono>
+#include <atomic>
+#include <condition_variable>
+#include <cmath>
+#include <cstdio>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 using namespace std;
 
 const char EOLN          = '\n';  // end of line character
+const char FIELD_SEP     = '\t';  // separates fields in a command reply
+
+const int FILE_LENGTH     = 100;  // longest file or socket name
+const int READ_CHUNK      = 65536;// bytes read from a client at a time
+const size_t COMMAND_LINE_MAX = 1024;
+                                  // longest line a client may send; far
+                                  // longer than any valid command
+const int ACCEPT_RETRY_MS = 100;  // serve's wait before accepting again
+                                  // when out of file descriptors
+const int REPLY_FLUSH     = 65536;// batch mode writes once this much is
+                                  // waiting
+const int OUTPUT_CHUNK    = 1 << 20;// listings and exports write once this
+                                  // much is waiting
+const int REPORT_LABEL_WIDTH = 20;// width of the labels of a displayed entry
+const int NUMBER_WIDTH    = 11;   // widest int, for fixed width exports
+const size_t TITLE_COMPACT_MIN = 65536;
+                                  // dead title bytes worth compacting
+
+const size_t PARALLEL_MIN_RECORDS = 65536;
+                                  // fewest records worth a sort thread
+const size_t PARALLEL_MIN_SHARD = 4096;
+                                  // fewest records a shard must have for
+                                  // fan_out to share the shards out
+const size_t LOAD_BATCH   = 65536;// records read before the shards index them
+const size_t SCAN_CHUNK   = 4096; // entries a listing copies under one
+                                  // taking of the locks
+const size_t SORT_MEMORY_MB = 256;// default memory of an external sort
+const size_t SORT_MERGE_WAYS = 64;// most runs an external sort merges at once
+const size_t SORT_IO_BUFFER = 1 << 18;
+                                  // buffer of each of a sort's run files
+const size_t CHANGE_RING_SIZE = 65536;
+                                  // changes kept for in-process readers
+const size_t CHANGE_BLOCK = CHANGE_RING_SIZE / 2;
+                                  // most changes numbered in one block
+const int CHANGE_POLL_MS  = 1;    // change file writer's wait when idle
+const int CHANGE_RETRY_MS = 100;  // and before it retries a failed write
+const int CHANGE_LINE_MAX = 256;  // longer than any line of the change file
+const int NO_SLOT         = -1;   // slot index meaning "no such record"
+const int BLOOM_BITS_PER_KEY = 10;// Bloom filter size, and bits set by a key
+const int BLOOM_HASHES    = 7;
+const size_t BLOOM_MIN_BITS = 1 << 12;
+const size_t BLOOM_STALE_SHARE = 2;// rebuild once 1 key in this many is gone
+const size_t BLOOM_BLOCK_WORDS = 8;// a key's bits all lie in one cache line
+const int NO_PAGE         = -1;   // page of a frame holding no page
+const size_t PAGE_SIZE    = 4096; // bytes of a page of a page file
+const size_t PAGE_POOL_MIN_FRAMES = 4;
+                                  // fewest pages a paged shard holds
+const int NO_BIN          = -1;   // bin of a location without a bin number
+
+const int GRAM_LENGTH     = 3;    // letters per n-gram in the text index
+const char GRAM_PAD      = '$';   // marks the ends of a word's n-grams
+const int FUZZY_ONE_LENGTH = 4;   // search words this long may be one edit
+const int FUZZY_TWO_LENGTH = 8;   // ... and this long two edits from a match
+const int MATCH_EXACT     = 4;    // search scores for a word that matches,
+const int MATCH_PREFIX    = 2;    // that a record's word starts with,
+const int MATCH_FUZZY     = 1;    // or that is within the edit distance
+const int MAX_SEARCH_RESULTS = 50;// most records a search lists
+const size_t MAX_SEARCH_WORDS = 0xFFFF / MATCH_EXACT;
+                                  // words of a search used; a record's
+                                  // score is kept in 16 bits
+const size_t POSTING_DEAD_SHARE = 2;// compact a posting list once 1 slot
+                                  // in this many is dropped
+const size_t POSTING_ADDED_SHARE = 32;
+const size_t POSTING_ADDED_MIN = 64;
+                                  // merge a list's out of order slots
+                                  // once there are more than 1 in this
+                                  // many of it, and this many at least
+
+const size_t SYNTHETIC_BOOKS_PER_AUTHOR = 20;
+                                  // average size of an author's list in a
+                                  // synthetic inventory
+const uint64_t BENCH_SEED = 1631; // seed of the benchmark's inventory
+const int BENCH_OPERATIONS = 100000;
+                                  // operations a benchmark runs by default
 
-const int MAX_RECORDS     = 50;   // string lengths
-const int MAX_AUTHOR_NAME = 12;
+const int HIST_SUB_BITS   = 3;    // latency histogram buckets per power of
+                                  // two are 2^HIST_SUB_BITS
+const int HIST_BUCKETS    = 320;  // ... up to 2^41 ns
+const size_t MAP_NODE_OVERHEAD = 32;
+                                  // bytes of a tree node besides its value
+const size_t HASH_NODE_OVERHEAD = 16;
+                                  // bytes of a hash node besides its value
+
+const int MAX_AUTHOR_NAME = 12;   // string lengths
 const int MAX_LOCATION    = 4;
 const int MAX_TITLE       = 20;
 const int MAX_COMMENT     = 24;
@@ -81,39 +388,789 @@ struct Entry
    int             quantity;
 };
 
-void readfile (Entry [], int&, bool&);
+struct SortRecord                  // an entry being sorted, and where it
+{                                  // was in the input
+   Entry           entry;
+   uint64_t        ordinal;
+};
+
+struct SortNumber                  // an inventory number being checked for
+{                                  // repeats, and where it was in the input
+   int             inventory_number;
+   uint64_t        ordinal;
+};
+
+struct StringPool
+{
+   deque<string> strings;           // id -> string; a deque never moves
+                                    // them, so the views below stay valid
+   unordered_map<string_view, uint32_t> ids;
+                                    // string -> id
+   vector<uint32_t> uses;           // id -> records that use the string
+   vector<uint32_t> free_ids;       // ids of strings no record uses
+};
+
+struct Record
+{
+   uint32_t     author_id;          // author_name, in the string pool
+   uint32_t     comment_id;         // comment, in the string pool
+   uint32_t     title_offset;       // title, in the title arena
+   int          inventory_number;
+   int          quantity;
+   char         location[MAX_LOCATION];
+                                    // not terminated if all 4 are used
+   char         author_initial;
+   uint8_t      title_length;
+};
+
+typedef pair<string_view, int> NAME_KEY;   // (author_name, inventory_number);
+                                           // the name is the pooled string
+typedef map<NAME_KEY, int> NAME_INDEX;     // key order -> slot
+typedef unordered_map<int, int> NUMBER_INDEX; // inventory_number -> slot
+typedef tuple<char, int, int> LOCATION_KEY; // (shelf, bin, inventory_number)
+typedef map<LOCATION_KEY, int> LOCATION_INDEX; // walk order -> slot
+
+struct StockTally
+{
+   int64_t      books;              // records in the group
+   int64_t      on_hand;            // copies of them in stock
+   int64_t      out_of_stock;       // records with a quantity of 0
+   int64_t      back_orders;        // records with a negative quantity
+   int64_t      back_ordered;       // copies owed on those
+};
+
+enum StockView { VIEW_CATEGORY, VIEW_AUTHOR, VIEW_SHELF, VIEW_ALL };
+
+struct Posting                     // the slots of the records with a word
+{
+   vector<int>  slots;             // in slot order; a dropped slot stays,
+                                   // as ~slot, until the list is compacted
+   vector<int>  added;             // in slot order, slots posted below the
+                                   // end of slots since the last merge
+   size_t       dead;              // dropped slots still in slots
+};
+
+struct TextIndex
+{
+   unordered_map<string, int>  word_ids;   // every word seen -> its id
+   vector<string>              words;      // id -> word
+   vector<Posting>             postings;   // id -> slots containing it
+   unordered_map<string, vector<int> > grams;
+                                           // trigram -> ids of words with
+                                           // it, ascending
+};
+
+struct BloomFilter                 // keys a shard surely does not have
+{
+   vector<uint64_t> bits;
+   size_t       keys;              // keys it holds
+   size_t       stale;             // of them, keys since dropped
+};
+
+struct PagedRecord                 // a record as kept in a page file; the
+{                                  // title is kept with it, not in an arena
+   Record       record;
+   char         title[MAX_TITLE];  // not terminated if all 20 are used
+};
+
+const size_t SLOTS_PER_PAGE = PAGE_SIZE / sizeof(PagedRecord);
+
+struct PageFrame                   // room in memory for one page
+{
+   int          page;              // the page held, or NO_PAGE
+   bool         referenced;        // used since the clock hand came by
+   bool         dirty;             // changed since it was read
+};
+
+struct PagePool                    // a shard's records, in pages of a file,
+{                                  // a bounded number of them in memory
+   int          file;              // the page file
+   size_t       slots;             // slots the file has room for
+   vector<PageFrame> frames;
+   vector<char> memory;            // PAGE_SIZE bytes for each frame
+   unordered_map<int, size_t> resident;
+                                   // page -> the frame it is held in
+   size_t       hand;              // next frame the clock looks at
+   mutex        guard;             // readers of a shard share its lock,
+                                   // but fetching a page changes the pool
+};
+
+struct Shard
+{
+   vector<Record> book;             // record slots, in no particular order
+   vector<int>   free_slots;        // slots of removed records
+   StringPool    strings;           // author names and comments
+   string        titles;            // every title, end to end
+   size_t        dead_title_bytes;  // arena bytes no record uses
+   NAME_INDEX    by_name;           // every record, in key field order
+   NUMBER_INDEX  by_number;         // every record, by inventory number
+   LOCATION_INDEX by_location;      // every record, by shelf and bin
+   TextIndex     text;              // words of author, title and comment
+   unordered_map<uint32_t, StockTally> by_category;
+   unordered_map<uint32_t, StockTally> by_author;
+   unordered_map<char, StockTally> by_shelf;
+                                    // stock totals by comment id, author id
+                                    // and shelf, kept as records change
+   BloomFilter  number_filter;      // every inventory number
+   BloomFilter  name_filter;        // every prefix of every author_name
+   unique_ptr<PagePool> pages;      // where the records are kept instead
+                                    // of book and titles, if paged
+   mutable shared_mutex guard;      // shared for readers, unique for writers
+};
+
+typedef shared_lock<shared_mutex> READ_LOCK;
+typedef unique_lock<shared_mutex> WRITE_LOCK;
+
+enum MutationKind { MUT_INSERT, MUT_UPDATE, MUT_ADJUST, MUT_REMOVE };
+
+enum EntryField { FLD_AUTHOR_NAME, FLD_AUTHOR_INITIAL, FLD_LOCATION,
+                  FLD_TITLE, FLD_COMMENT, FLD_QUANTITY, FLD_NONE };
+
+struct Mutation
+{
+   MutationKind kind;
+   int          inventory_number;   // the record to change
+   Entry        entry;              // MUT_INSERT: the new record
+   EntryField   field;              // MUT_UPDATE: the field to change
+   string       value;              // MUT_UPDATE: its new value, as text
+   int          delta;              // MUT_ADJUST: added to the quantity
+};
+
+typedef vector<Mutation> Transaction;
+
+struct ChangeEvent
+{
+   uint64_t     sequence;           // position in the change stream
+   MutationKind kind;
+   Entry        entry;              // the record after the change, or as
+                                    // it was when removed
+};
+
+struct ChangeSlot
+{
+   atomic<uint64_t> sequence;       // the change in event, 0 while it is
+                                    // being written
+   ChangeEvent  event;
+};
+
+struct ChangeLog
+{
+   unique_ptr<ChangeSlot[]> ring;   // the last CHANGE_RING_SIZE changes
+   atomic<uint64_t> last;           // last sequence number handed out
+   atomic<uint64_t> published;      // last one readers may take; all
+                                    // before it are in the ring too
+   atomic<uint64_t> appended;       // last one written to the file
+   atomic<bool> stopping;           // tells the writer to finish up
+   int          file;               // the change file, or -1 for none
+   thread       writer;             // appends changes to the file
+};
+
+struct Inventory
+{
+   vector<unique_ptr<Shard> > shards;
+                                    // records, split by inventory number
+   ChangeLog    changes;            // every change, in order
+};
+
+struct FanOutJob                    // the shards of one fan_out call
+{
+   const function<void(size_t)> *work;
+   size_t       shards;             // how many there are
+   size_t       next;               // the next one to hand out
+   size_t       running;            // handed out and not yet done
+};
+
+struct WorkerPool                   // threads that take shards of fan_out
+{                                   // calls; they last as long as the
+                                    // process
+   mutex        guard;              // for the members below and the jobs
+   condition_variable wake;         // a job has been posted
+   condition_variable done;         // a worker has finished a shard
+   deque<FanOutJob *> jobs;         // jobs with shards not handed out
+};
+
+struct Session
+{
+   bool         in_transaction;     // between BEGIN and COMMIT or ABORT
+   Transaction  pending;            // changes held back until COMMIT
+};
+
+enum CommandStatus { CMD_CONTINUE, CMD_QUIT, CMD_SHUTDOWN };
+
+struct Server                       // the clients of a socket being served
+{
+   int          listener;           // the listening socket
+   atomic<bool> stopping;           // a client has sent SHUTDOWN
+   mutex        guard;              // for the members below
+   unordered_map<int, thread> clients;
+                                    // socket -> the thread serving it
+   vector<thread> finished;         // threads of clients that have gone,
+                                    // still to be joined
+   condition_variable all_gone;     // signalled as clients go
+};
+
+enum OutputFormat { FMT_REPORT, FMT_FILE, FMT_TAB, FMT_CSV, FMT_JSON,
+                    FMT_FIXED };
+
+struct OutputBuffer
+{
+   ostream     *out;                // where the text is written
+   string       text;               // formatted but not yet written
+};
+
+struct Synthetic
+{
+   uint64_t       seed;             // picks one inventory of a size
+   vector<string> authors;          // made up surnames, most popular first
+   vector<double> weights;          // share of records by the authors up
+                                    // to and including each
+};
+
+enum BenchKind { BENCH_LOOKUP, BENCH_PREFIX, BENCH_DELETE, BENCH_KINDS };
+
+struct WorkloadMix
+{
+   const char  *name;
+   int          percent[BENCH_KINDS];
+                                    // share of each kind of operation
+};
+
+enum MetricOp { MET_LOAD, MET_SCAN, MET_FIND, MET_GET, MET_SEARCH,
+                MET_LOCATION, MET_TOTALS, MET_COMMIT, MET_REMOVE,
+                MET_COMPACT, MET_KINDS };
+
+const char *const METRIC_OP_NAMES[MET_KINDS] =
+   { "load", "scan", "find", "get", "search", "location", "totals",
+     "commit", "remove", "compact" };
+
+const uint64_t METRIC_SAMPLING[MET_KINDS] = { 1, 1, 16, 16, 16, 16, 16, 16,
+                                              16, 1 };
+                                   // time one operation in so many, a
+                                   // power of two; reading the clock is a
+                                   // good part of a quick lookup
+
+enum MetricCounter { CNT_NUMBER_HIT, CNT_NUMBER_MISS, CNT_NAME_HIT,
+                     CNT_NAME_MISS, CNT_LOCATION_HIT, CNT_LOCATION_MISS,
+                     CNT_TEXT_HIT, CNT_TEXT_MISS, CNT_COMMIT_FAILED,
+                     CNT_COMPACTED_BYTES, CNT_PAGE_HIT, CNT_PAGE_MISS,
+                     CNT_PAGE_WRITE, CNT_NUMBER_FILTERED,
+                     CNT_NAME_FILTERED, CNT_FILTER_FALSE, CNT_KINDS };
+
+const char *const METRIC_COUNTER_NAMES[CNT_KINDS] =
+   { "index.number.hits", "index.number.misses", "index.name.hits",
+     "index.name.misses", "index.location.hits", "index.location.misses",
+     "index.text.hits", "index.text.misses", "commit.failed",
+     "compaction.bytes_freed", "pages.hits", "pages.misses",
+     "pages.written", "filter.number.skipped", "filter.name.skipped",
+     "filter.false_positives" };
+
+enum MemoryStructure { MEM_RECORDS, MEM_TITLES, MEM_DEAD_TITLES,
+                       MEM_STRINGS, MEM_NAME_INDEX, MEM_NUMBER_INDEX,
+                       MEM_LOCATION_INDEX, MEM_TEXT_INDEX, MEM_TOTALS,
+                       MEM_CHANGE_RING, MEM_PAGE_POOL, MEM_FILTERS,
+                       MEM_KINDS };
+
+const char *const STRUCTURE_NAMES[MEM_KINDS] =
+   { "records", "titles", "dead_titles", "string_pool", "name_index",
+     "number_index", "location_index", "text_index", "totals",
+     "change_ring", "page_pool", "filters" };
+
+struct ThreadMetrics               // one thread's; only it writes them
+{
+   atomic<uint64_t> operations[MET_KINDS];
+   atomic<uint64_t> timed[MET_KINDS];
+                                    // the sample of them that was timed
+   atomic<uint64_t> total_ns[MET_KINDS];
+   atomic<uint64_t> max_ns[MET_KINDS];
+   atomic<uint64_t> latency[MET_KINDS][HIST_BUCKETS];
+                                    // operations by latency bucket
+   atomic<uint64_t> counters[CNT_KINDS];
+};
+
+struct MetricsHandle               // a thread's block, given back when
+{                                  // the thread ends
+   ThreadMetrics *block;
+   ~MetricsHandle ();
+};
+
+struct Metrics
+{
+   mutex        guard;              // for adding and summing blocks
+   deque<ThreadMetrics> blocks;     // a deque never moves them
+   vector<ThreadMetrics *> idle;    // blocks of threads that have ended
+   atomic<bool> enabled { true };   // whether to record anything
+   mutex        dump_guard;
+   recursive_mutex dump_control;    // one start or stop at a time
+   condition_variable dump_cv;      // wakes the dumper to stop
+   bool         dump_stop;
+   int          dump_seconds;       // time between dumps
+   string       dump_file;          // file the dumps are appended to
+   bool         dump_json;
+   thread       dumper;             // appends the metrics every so often
+};
+
+struct TimedOp                     // times its scope as an operation
+{
+   TimedOp (MetricOp);
+   ~TimedOp ();
+   MetricOp     op;
+   bool         timing;
+   chrono::steady_clock::time_point start;
+};
+
+Metrics metrics;                   // every thread's counts and timings
+thread_local MetricsHandle own_metrics;
+                                   // the calling thread's block
+thread_local vector<uint32_t> search_marks;
+                                   // slot -> (search word last scored,
+                                   // counting from 1) << 16 | score; all
+                                   // 0 between searches
+
+const WorkloadMix WORKLOAD_MIXES[] =
+{
+   { "lookup", { 100,   0,   0 } },
+   { "prefix", {   0, 100,   0 } },
+   { "delete", {   0,   0, 100 } },
+   { "mixed",  {  70,  20,  10 } },
+   { "pick",   {  90,   9,   1 } }  // a pick station: mostly scans of
+                                    // single books
+};
+
+void readfile (Inventory&, bool&);
                                   // reads the inventory database in from the
                                   // master file into an array
+bool load_inventory (Inventory&, const char filename[]);
+                                  // readfile without the prompt
+bool read_entry (istream&, Entry&, size_t &line, const char *&error);
+                                  // the next entry of an inventory file
+bool sort_order (const SortRecord&, const SortRecord&);
+bool number_order (const SortNumber&, const SortNumber&);
+                                  // orders of an external sort's runs
+FILE *open_spill ();              // a temporary file for a sort run
+void spill_run (SortRecord records[], size_t count, FILE *&entries,
+                FILE *&numbers);  // sort part of the input and write it out
+template <class RECORD>
+void merge_runs (vector<FILE *> &runs,
+                 bool (*before)(const RECORD&, const RECORD&),
+                 const function<void(const RECORD&)> &take);
+                                  // k-way merge of sorted run files
+template <class RECORD>
+FILE *merge_to_spill (vector<FILE *> &runs,
+                      bool (*before)(const RECORD&, const RECORD&));
+                                  // merge runs into one longer run
+template <class RECORD>
+bool add_run (vector<vector<FILE *> > &tiers, FILE *run,
+              bool (*before)(const RECORD&, const RECORD&));
+                                  // keep a run, merging full tiers
+template <class RECORD>
+bool merge_spills (vector<FILE *> &runs,
+                   bool (*before)(const RECORD&, const RECORD&),
+                   const function<void(const RECORD&)> &visit);
+                                  // merge any number of runs, in passes
+bool sort_inventory (const char input[], const char output[], size_t memory,
+                     ostream &report);
+                                  // sort an inventory file larger than
+                                  // memory into key field order
 void process_menu (char&);        // display the menu and read user's choice
-void list_all (const Entry [], int);    // print all entries in the database
-void list_by_name (const Entry [], int);// find and display the entry for anyone
+void list_all (const Inventory&); // print all entries in the database
+void list_by_name (const Inventory&);// find and display the entry for anyone
                                   // matching a specified author_name or name
 				  // portion
 
-void remove (Entry [], int&);     // find and remove a specifed book based on
+void open_inventory (Inventory&, size_t shards);
+                                  // split an empty inventory into shards
+bool page_inventory (Inventory&, size_t memory);
+                                  // keep every shard's records in a page
+                                  // file, with a bounded memory for pages
+size_t shard_index (const Inventory&, int inv_num);
+Shard &shard_for (const Inventory&, int inv_num);
+                                  // the shard an inventory number is kept in
+void clear_shard (Shard&);        // empty a shard; caller must hold its
+                                  // write lock
+void lock_all (const Inventory&, vector<READ_LOCK> &locks);
+                                  // take every shard's read lock, in order
+size_t total_entries (const Inventory&);
+                                  // records in all shards; caller must hold
+                                  // every lock
+void fan_out (const Inventory&, size_t records,
+              const function<void(size_t)> &work);
+                                  // do work on every shard, shared with the
+                                  // worker pool if there is enough of it
+WorkerPool &worker_pool ();       // the pool, started on first use
+void pool_worker (WorkerPool&);   // a worker thread: take shards and do them
+bool claim_shard (WorkerPool&, FanOutJob&, size_t &shard);
+                                  // hand out a job's next shard; caller
+                                  // must hold the pool's guard
+bool key_order (const Entry&, const Entry&);
+bool walk_order (const Entry&, const Entry&);
+                                  // orders of merged shard results
+void merge_runs (vector<vector<Entry> > &runs,
+                 bool (*before)(const Entry&, const Entry&),
+                 vector<Entry> &entries);
+                                  // merge the sorted results of each shard
+bool get_entry (const Inventory&, int inv_num, Entry&);
+                                  // fetch one entry by inventory number
+void query_by_name (const Inventory&, const char prefix[], vector<Entry>&);
+void query_by_location (const Inventory&, char shelf, int first, int last,
+                        vector<Entry>&);
+void query_text (const Inventory&, const char query[], size_t limit,
+                 vector<Entry>&);
+                                  // ask every shard and merge the answers
+void for_each_in_order (const Inventory&,
+                        const function<void(const Entry&)> &visit);
+                                  // every entry, in key field order
+
+int find_entry (const Shard&, int inv_num);
+                                  // slot of a book by inventory id, or
+                                  // NO_SLOT; caller must hold the lock
+uint64_t number_hash (int inv_num);
+void prefix_hashes (const char name[], vector<uint64_t> &hashes);
+                                  // hashes of the Bloom filters' keys
+void bloom_reset (BloomFilter&, size_t keys);
+bool bloom_add (BloomFilter&, uint64_t hash);
+bool bloom_test (const BloomFilter&, uint64_t hash);
+                                  // empty, add to and ask a Bloom filter
+void filter_record (Shard&, const Entry&, bool renamed = false);
+void unfilter_record (Shard&, const Entry&, bool renamed = false);
+                                  // keep a shard's filters current; caller
+                                  // must hold the write lock
+void rebuild_number_filter (Shard&);
+void rebuild_name_filter (Shard&);// a filter afresh from the shard
+int add_record (Shard&, const Entry&);
+                                  // store and index a record; caller must
+                                  // hold the write lock
+void drop_record (Shard&, int slot);
+                                  // unindex and free a slot; caller must
+                                  // hold the write lock
+void replace_record (Shard&, int slot, const Entry&);
+                                  // overwrite a slot, reindexing if the key
+                                  // changed; caller must hold the write lock
+uint32_t intern_string (StringPool&, const char text[]);
+void release_string (StringPool&, uint32_t id);
+                                  // count a use of a pooled string, adding
+                                  // it if new, and end one, freeing it if
+                                  // it was the last
+bool open_pages (Shard&, size_t frames);
+                                  // keep a shard's records in a page file
+void clear_pages (PagePool&);     // empty a page file
+void page_failed (const char action[]);
+                                  // give up on an unusable page file
+char *fetch_page (PagePool&, int page);
+                                  // bring a page into memory, evicting the
+                                  // one least recently used, roughly
+void read_paged (const Shard&, int slot, PagedRecord&);
+void write_paged (Shard&, int slot, const PagedRecord&, bool with_title);
+                                  // copy a record out of or into its page
+Record record_at (const Shard&, int slot);
+void store_record (Shard&, int slot, const Record&);
+                                  // a record's packed fields, wherever it
+                                  // is kept; caller must hold the lock
+const string &author_of (const Shard&, int slot);
+                                  // pooled author_name of a record
+Entry entry_at (const Shard&, int slot);
+                                  // unpack a record; caller must hold the
+                                  // lock
+void pack_record (Shard&, int slot, const Entry&, bool had_title);
+void retire_title (Shard&, size_t length);
+                                  // store a record packed, compacting the
+                                  // title arena when due; caller must hold
+                                  // the write lock
+void index_text (TextIndex&, const Entry&, int slot);
+void unindex_text (TextIndex&, const Entry&, int slot);
+                                  // post or unpost a record's words; caller
+                                  // must hold the write lock
+bool posted_before (int posted, int slot);
+                                  // order of a posting list's entries
+void post_slot (Posting&, int slot);
+void unpost_slot (Posting&, int slot);
+                                  // add a slot to or drop it from a word's
+                                  // posting list
+void match_words (const TextIndex&, const string &wanted,
+                  vector<pair<int, int> > &matched);
+                                  // dictionary words matching a search word
+void search_text (const Shard&, const char query[], size_t limit,
+                  vector<pair<int, int> > &hits);
+                                  // ranked, typo tolerant word search;
+                                  // caller must hold the read lock
+void search_entries (const Inventory&);
+                                  // prompt for words and list the matches
+LOCATION_KEY location_key (const Entry&);
+                                  // shelf, bin and number of an entry
+bool parse_bin_range (const char text[], char &shelf, int &first, int &last);
+                                  // read "h-03", "g" or "g 70 79"
+void find_by_location (const Shard&, char shelf, int first, int last,
+                       const LOCATION_KEY *after, size_t most,
+                       vector<int> &slots);
+                                  // records in a range of bins, in walk
+                                  // order; caller must hold the read lock
+void list_by_location (const Inventory&);
+                                  // prompt for bins and list their contents
+void tally_record (Shard&, int slot, int sign);
+                                  // count a record into or out of its
+                                  // shard's stock totals; caller must hold
+                                  // the write lock
+void add_tally (StockTally &sum, const StockTally&);
+bool view_named (const char name[], StockView&);
+                                  // the grouping a TOTALS command names
+void query_totals (const Inventory&, StockView, const char name[],
+                   map<string, StockTally> &totals);
+                                  // stock totals by group, without a scan
+void format_totals (string &text, const string &name, const StockTally&);
+                                  // a group's totals as a line of text
+void show_totals (const Inventory&);
+                                  // prompt for a grouping and show totals
+void remove (Inventory&);         // find and remove a specifed book based on
                                   // inventory id
+bool remove_entry (Inventory&, int inv_num);
+                                  // remove without the confirmation prompt
               
-void writefile (Entry book[], int);
+void writefile (const Inventory&);
                                   // writes the entire inventory out to a
                                   // file specified by the user
+bool save_inventory (const Inventory&, const char filename[]);
+                                  // writefile without the prompt
+
+EntryField field_named (const char name[]);
+                                  // the field a SET command names
+bool set_field (Entry&, EntryField, const char value[]);
+                                  // store a field given as text, if valid
+bool parse_number (const char text[], int &value);
+                                  // read a whole string as an integer
+bool next_word (const char *&text, char word[], size_t size);
+bool next_number (const char *&text, int &value);
+bool next_sequence (const char *&text, uint64_t &value);
+                                  // read the next word of a command, as
+                                  // is, as an integer or as a change's
+                                  // sequence number
+bool parse_entry (const char line[], Entry&);
+                                  // read a tab separated record line
+bool apply_mutation (Shard&, const Mutation&, string &error);
+                                  // make one change; caller must hold the
+                                  // write lock
+bool commit_transaction (Inventory&, const Transaction&, string &error);
+                                  // make all of the changes or none
+
+bool open_changes (ChangeLog&, const char filename[]);
+void close_changes (ChangeLog&);  // start and stop the change stream, and
+                                  // the change file if one is named
+void publish_changes (ChangeLog&, const vector<ChangeEvent>&);
+                                  // number and publish some changes; caller
+                                  // must hold their shards' write locks
+bool read_changes (const ChangeLog&, uint64_t after, size_t limit,
+                   vector<ChangeEvent>&);
+                                  // the changes after a sequence number
+void format_change (string &text, const ChangeEvent&);
+                                  // a change as a line of text
+void append_changes (ChangeLog&); // write changes to the file as they come
 
-void write_entry(const Entry [], int index); 	  // display a single record 
-                                                  //from database 
+CommandStatus execute_command (Inventory&, Session&, const char line[],
+                               string &reply);
+                                  // run one protocol command, appending the
+                                  // reply
+void run_batch (Inventory&, istream&, ostream&);
+                                  // run commands from a stream
+bool serve (Inventory&, const char path[]);
+                                  // accept clients on a Unix domain socket
+void serve_client (Inventory&, Server&, int client);
+                                  // run one client's commands to completion
 
+void write_entry(const Entry&);   // display a single record from database
+void put_number (string &text, long long number);
+                                  // append an integer
+void format_entry (string &text, const Entry&, OutputFormat, int ordinal);
+                                  // append a record in some format
+bool format_named (const char name[], OutputFormat&);
+                                  // the format an EXPORT command names
+void start_output (OutputBuffer&, ostream&);
+void put_entry (OutputBuffer&, const Entry&, OutputFormat, int ordinal);
+bool flush_output (OutputBuffer&);
+                                  // gather records and write them in chunks
+bool export_inventory (const Inventory&, const char filename[], OutputFormat,
+                       int *written = NULL);
+                                  // write every record in some format
+void export_file (const Inventory&);
+                                  // prompt for a format and file and export
 
+uint64_t next_random (uint64_t &state);
+                                  // pseudo-random numbers for test data
+void open_synthetic (Synthetic&, size_t records, uint64_t seed);
+                                  // pick the authors of a synthetic inventory
+int synthetic_number (size_t index);
+size_t synthetic_author (const Synthetic&, uint64_t &state);
+void synthetic_entry (const Synthetic&, size_t index, Entry&);
+                                  // make the record at some position
+bool generate_inventory (const Synthetic&, size_t records,
+                         const char filename[]);
+                                  // write a synthetic inventory file
+const WorkloadMix *mix_named (const char name[]);
+                                  // the mix a benchmark names
+void run_workload (Inventory&, const Synthetic&, size_t records,
+                   const WorkloadMix&, size_t operations, uint64_t seed,
+                   vector<uint64_t> latencies[]);
+                                  // one client's timed operations
+void put_latencies (string &text, vector<uint64_t> &latencies,
+                    double seconds);
+                                  // rate and percentiles as JSON
+bool run_benchmark (Inventory&, size_t records, const WorkloadMix&,
+                    size_t operations, int clients, ostream&);
+                                  // time a load, a mix and a save
 
-int main ()
+ThreadMetrics &thread_metrics (); // the calling thread's metrics block
+void bump (atomic<uint64_t> &value, uint64_t amount);
+void count_metric (MetricCounter, uint64_t amount = 1);
+                                  // add to a metric, without locking
+int latency_bucket (uint64_t nanoseconds);
+uint64_t bucket_ceiling (int bucket);
+                                  // latency histogram buckets
+void structure_bytes (const Inventory&, uint64_t sizes[]);
+                                  // memory used by each structure
+int format_stats (const Inventory&, bool json, string &text);
+                                  // every metric, as text or JSON
+void dump_stats (const Inventory&);
+void start_stats_dump (const Inventory&, int seconds, const char filename[],
+                       bool json);
+void stop_stats_dump ();          // append the metrics to a file now and
+                                  // then
+void show_stats (const Inventory&);
+                                  // display the metrics
+
+
+
+int main (int argc, char *argv[])
 {
-   Entry inventory[MAX_RECORDS];  // the array for the database
-   int no_entries;                // number of entries in the database
+   static Inventory inventory;    // the database, split into shards
    char choice;                   // menu selection
    bool success;                  // reading data success flag
 
-   readfile (inventory, no_entries, success);
+   open_inventory (inventory, thread::hardware_concurrency ());
+   if (argc > 2 && strcmp (argv[1], "-paged") == 0)
+   {
+       int megabytes;
+
+       if (!parse_number (argv[2], megabytes) || megabytes <= 0)
+       {
+           cerr << "usage: " << argv[0] << " -paged <megabytes> ..." << endl;
+           return 2;
+       }
+       if (!page_inventory (inventory, (size_t) megabytes << 20))
+       {
+           cerr << "unable to make a page file" << endl;
+           return 1;
+       }
+       argv[2] = argv[0];         // the options as if -paged were not given
+       argv += 2;
+       argc -= 2;
+   }
+   if (argc > 1)
+   {
+       bool batch = ((argc == 3 || argc == 4) &&
+                     strcmp (argv[1], "-batch") == 0);
+       bool server = ((argc == 4 || argc == 5) &&
+                      strcmp (argv[1], "-serve") == 0);
+       const char *change_file = ((batch && argc == 4) ||
+                                  (server && argc == 5)) ? argv[argc - 1]
+                                                         : NULL;
+       bool generate = (argc == 4 && strcmp (argv[1], "-generate") == 0);
+       bool bench = (argc >= 3 && argc <= 6 &&
+                     strcmp (argv[1], "-bench") == 0);
+       bool sorting = ((argc == 4 || argc == 5) &&
+                       strcmp (argv[1], "-sort") == 0);
+       int megabytes = SORT_MEMORY_MB;
+       int records = 0;
+       int operations = BENCH_OPERATIONS;
+       int clients = 1;
+       const WorkloadMix *mix = mix_named ("mixed");
+
+       if ((generate || bench) &&
+           (!parse_number (argv[2], records) || records <= 0 ||
+            (argc > 3 && bench && (mix = mix_named (argv[3])) == NULL) ||
+            (argc > 4 && bench && (!parse_number (argv[4], operations) ||
+                                   operations < 0)) ||
+            (argc > 5 && bench && (!parse_number (argv[5], clients) ||
+                                   clients <= 0))))
+       {
+           generate = bench = false;
+       }
+       if (sorting && argc == 5 &&
+           (!parse_number (argv[4], megabytes) || megabytes <= 0))
+       {
+           sorting = false;
+       }
+       if (!batch && !server && !generate && !bench && !sorting)
+       {
+           cerr << "usage: " << argv[0] << " [-batch <inventory file> "
+                << "[<change file>] | -serve <inventory file> <socket path> "
+                << "[<change file>] | "
+                << "-generate <records> <inventory file> | "
+                << "-bench <records> [lookup | prefix | delete | mixed | "
+                << "pick] [<operations>] [<clients>] | "
+                << "-sort <inventory file> <sorted file> [<megabytes>]]"
+                << endl;
+           return 2;
+       }
+       if (sorting)
+       {
+           if (!sort_inventory (argv[2], argv[3],
+                                (size_t) megabytes << 20, cerr))
+           {
+               cerr << "unable to sort " << argv[2] << " into " << argv[3]
+                    << endl;
+               return 1;
+           }
+           return 0;
+       }
+       if (!open_changes (inventory.changes, change_file))
+       {
+           cerr << "unable to open change file " << change_file << endl;
+           return 1;
+       }
+       if (generate)
+       {
+           Synthetic shape;
+
+           open_synthetic (shape, records, BENCH_SEED);
+           if (!generate_inventory (shape, records, argv[3]))
+           {
+               cerr << "unable to write " << argv[3] << endl;
+               return 1;
+           }
+           return 0;
+       }
+       if (bench)
+       {
+           if (!run_benchmark (inventory, records, *mix, operations,
+                               clients, cout))
+           {
+               cerr << "unable to write temporary files" << endl;
+               return 1;
+           }
+           return 0;
+       }
+       if (!load_inventory (inventory, argv[2]))
+       {
+           cerr << "unable to load inventory file " << argv[2] << endl;
+           close_changes (inventory.changes);
+           return 1;
+       }
+       if (batch)
+       {
+           run_batch (inventory, cin, cout);
+           stop_stats_dump ();
+           close_changes (inventory.changes);
+           return 0;
+       }
+       success = serve (inventory, argv[3]);
+       stop_stats_dump ();
+       close_changes (inventory.changes);
+       return success ? 0 : 1;
+   }
+
+   open_changes (inventory.changes, NULL);
+   readfile (inventory, success);
 
    if (!success)
    {
-     cout << "unable to open inventory file -- program terminating " << endl;
+     cout << "unable to load inventory file -- program terminating " << endl;
    }
    else
    {
@@ -122,18 +1179,28 @@ int main ()
        {
            switch (choice)
            {
-             case '1' : list_all (inventory, no_entries);
+             case '1' : list_all (inventory);
+                        break;
+             case '2' : list_by_name (inventory);
                         break;
-             case '2' : list_by_name (inventory, no_entries);
+             case '3' : remove (inventory);
                         break;
-             case '3' : remove (inventory, no_entries);
+             case '5' : search_entries (inventory);
+                        break;
+             case '6' : list_by_location (inventory);
+                        break;
+             case '7' : export_file (inventory);
+                        break;
+             case '8' : show_totals (inventory);
+                        break;
+             case '9' : show_stats (inventory);
                         break;
              default  : cout << "Illegal menu choice--try again" << endl;
                         break;
            }
            process_menu (choice);
        }
-       writefile (inventory, no_entries);
+       writefile (inventory);
    }
 
    return 0;
@@ -162,288 +1229,6424 @@ int main ()
 //            will read an empty line. This is the reason for the two 
 //            reads involving the junk variable.
 //
-// Assumptions:
-//            It is assumed that the file contains complete entries
-//            and that the data in the file is in alphabetical order.
+//            The whole load is done under the write locks of every
+//            shard so no reader can observe a partially loaded array.
+//
+//            The entries may be in any order; the name index puts them
+//            in key field order. An entry whose inventory number has
+//            already been read is skipped and counted. Entries are
+//            read in batches of LOAD_BATCH, split by shard, and each
+//            shard indexes its part of a batch on its own thread.
+//
+//            A malformed entry - a field too long, a number that is
+//            not a number, an entry cut short - stops the load with
+//            the line it is on, and success is set to false.
 // Inputs:    none
-// Outputs:   inventory - the loaded inventory database
-//            no_entries - the number of entries that are loaded
+// Outputs:   inventory - the loaded inventory database and the number
+//                        of entries that are loaded
 //            success - whether or not the array was successfully loaded
 //
 //*********************************************************************
 
-void readfile (Entry inventory [], int &no_entries, bool &success)
+void readfile (Inventory &store, bool &success)
 {
-   const int FILE_LENGTH = 100;
-   ifstream inp;
    char filename[FILE_LENGTH];
-   char junk;
 
-   success = false;
    cout << "Enter the name of the inventory file: ";
    cin >> filename;
-   inp.open (filename);
-   if (!inp.fail ())
-   {
-       success = true;
-       no_entries = 0;
-       inp.getline (inventory[no_entries].author_name, MAX_AUTHOR_NAME+1);
-       while (!inp.eof () && no_entries < MAX_RECORDS)
-       {
-           inp.get (inventory[no_entries].author_initial);
-           inp >> inventory[no_entries].inventory_number;
-           inp.get (junk);   // needed to eliminate the unread newline
-           inp.getline (inventory[no_entries].location, MAX_LOCATION+1);
-           inp.getline (inventory[no_entries].title, MAX_TITLE+1);
-           inp.getline (inventory[no_entries].comment, MAX_COMMENT+1);
-           inp >> inventory[no_entries].quantity;
-           inp.get (junk);  // needed to eliminate the unread newline
-           no_entries++;
-           inp.getline (inventory[no_entries].author_name, MAX_AUTHOR_NAME+1);
-       }
-       inp.close ();
-   }
+   success = load_inventory (store, filename);
    return;
 }
 
 //*********************************************************************
-// Function:  process_menu
-// Purpose:   displays a menu listing the allowable operation choices,
-//            prompts for user input and reads input until the end of
-//            line is encountered.
-// Details:   Returns the first non-whitespace character encountered.
-//            Any non-whitespace between the menu choice and the 
-//            end of line is eliminated.
-// Inputs:    none
-// Outputs:   choice - the first non-whitespace character
+// Function:  load_inventory
+// Purpose:   Loads a inventory database from a named file.
+// Details:   The non-interactive half of readfile, shared with the
+//            batch and server modes. See readfile for the file layout.
+//            A malformed entry stops the load: its line is reported
+//            and the inventory is left empty.
+// Inputs:    filename - the inventory file to read
+// Outputs:   inventory - the loaded inventory database
+//            returns whether or not the whole file could be loaded
+//
 //*********************************************************************
 
-void process_menu (char &choice)
+bool load_inventory (Inventory &store, const char filename[])
 {
-  char junk;
+   ifstream inp;
+   Entry record;
+   vector<vector<Entry> > batch (store.shards.size ());
+   vector<int> repeated (store.shards.size (), 0);
+   size_t batched = 0;
+   size_t line = 0;
+   const char *error = NULL;
+   int skipped = 0;
+   bool success = false;
+   TimedOp timer (MET_LOAD);
 
-   cout << "********************************************************" << endl
-        << "*                                                      *" << endl
-        << "*               1631 Book Inventory DB                 *" << endl
-        << "*                                                      *" << endl
-        << "*    1 - list ALL entries                              *" << endl
-        << "*    2 - list all entries matching author_name portion *" << endl
-        << "*    3 - remove an entry by inventory number           *" << endl
-        << "*    4 - to exit the program                           *" << endl
-        << "*                                                      *" << endl
-        << "********************************************************" << endl
-        << endl
-        << "Enter menu choice:  ";
+   // adds the batched entries, each shard on its own thread
+   auto add_batch = [&] (size_t index)
+   {
+       for (size_t entry = 0; entry < batch[index].size (); entry++)
+       {
+           if (add_record (*store.shards[index], batch[index][entry])
+               == NO_SLOT)
+           {
+               repeated[index]++;
+           }
+       }
+       batch[index].clear ();
+   };
 
-   cin >> choice;
-   do
+   inp.open (filename);
+   if (!inp.fail ())
    {
-     cin.get (junk);
-   } while (junk != EOLN);
+       vector<WRITE_LOCK> locks;
 
-   return;
+       for (size_t shard = 0; shard < store.shards.size (); shard++)
+       {
+           locks.push_back (WRITE_LOCK (store.shards[shard]->guard));
+           clear_shard (*store.shards[shard]);
+       }
+       while (read_entry (inp, record, line, error))
+       {
+           batch[shard_index (store, record.inventory_number)]
+               .push_back (record);
+           if (++batched == LOAD_BATCH)
+           {
+               fan_out (store, batched, add_batch);
+               batched = 0;
+           }
+       }
+       inp.close ();
+       if (error != NULL)
+       {
+           cerr << filename << ", line " << line << ": " << error << endl;
+           for (size_t shard = 0; shard < store.shards.size (); shard++)
+           {
+               clear_shard (*store.shards[shard]);
+           }
+           return false;
+       }
+       fan_out (store, batched, add_batch);
+       success = true;
+       for (size_t shard = 0; shard < repeated.size (); shard++)
+       {
+           skipped += repeated[shard];
+       }
+       if (skipped > 0)
+       {
+           cerr << skipped << " entries with a repeated inventory number "
+                << "were skipped" << endl;
+       }
+   }
+   return success;
 }
 
 //*********************************************************************
-// Function:  list_all
-// Purpose:   list all the entries in the inventory
+// Function:  read_entry
+// Purpose:   to read the next entry of an inventory file
 //
-// Details:   loops write_entry for each value in the inventory array
-//            for how many entries there are based on no_entries
-// Inputs:    inventory - the database array
-//            no_entries - the number of entries 
+// Details:   See readfile for the file layout. Every field is checked
+//            as it is read: a field longer than its limit, a number
+//            with anything after it on its line, or a file that ends
+//            partway through an entry is an error. A stream in the
+//            fail state reads nothing more, so reading on past such a
+//            field would return the same broken entry forever.
+//            A blank line at the very end of the file is allowed.
+// Inputs:    inp - the open file
+//            line - the number of lines read before this entry
+// Outputs:   record - the entry read
+//            line - the number of lines read, or on an error the
+//                   line of the bad field
+//            error - what is wrong with the entry, or NULL
+//            returns false at the end of the file or on an error
 //
 //*********************************************************************
 
-void list_all (const Entry inventory[], int no_entries)
+bool read_entry (istream &inp, Entry &record, size_t &line,
+                 const char *&error)
 {
-    int loop = 0, count = 1;
-    while(loop < no_entries)
-    {
-	cout << "# " << count << endl;
-	write_entry(inventory, loop);
-	count++;
-	loop++;
-    }
-    return;
-}
-
-//*********************************************************************
-// Function:  list_by_name
-// Purpose:   to find any entries with the matching last name the user
-//            is looking for and print them out
-// Details:   compares the entered last name with the last name of every
-//            entry until a successful comparison is found. Loop also ends
-//            if the value of strcmp exceeds 0, which indicates that the
-//            value is higher than the inputted last name
-// Inputs:    inventory - the database array
-//            no_entries - the number of entries 
-//
-//*********************************************************************
+   char junk;
 
-void list_by_name (const Entry inventory[], int no_entries)
-{
+   error = NULL;
+   inp.getline (record.author_name, MAX_AUTHOR_NAME+1);
+   if (inp.eof () && inp.gcount () == 0)
+   {
+       return false;
+   }
+   line++;
+   if (inp.fail ())
+   {
+       error = "author name too long";
+       return false;
+   }
+   if (record.author_name[0] == '\0' && inp.peek () == EOF)
+   {
+       return false;
+   }
+   inp.get (record.author_initial);
+   line++;
+   inp >> record.inventory_number;
+   line++;
+   if (inp.fail () || !inp.get (junk) || junk != '\n')
+   {
+       error = "inventory number is not a number";
+       return false;
+   }
+   inp.getline (record.location, MAX_LOCATION+1);
+   line++;
+   if (inp.fail ())
+   {
+       error = "location too long or missing";
+       return false;
+   }
+   inp.getline (record.title, MAX_TITLE+1);
+   line++;
+   if (inp.fail ())
+   {
+       error = "title too long or missing";
+       return false;
+   }
+   inp.getline (record.comment, MAX_COMMENT+1);
+   line++;
+   if (inp.fail ())
+   {
+       error = "comment too long or missing";
+       return false;
+   }
+   inp >> record.quantity;
+   line++;
+   if (inp.fail () || (inp.get (junk) && junk != '\n'))
+   {
+       error = "quantity is not a number";
+       return false;
+   }
+   inp.clear (inp.rdstate () & ~ios::failbit);
+                     // the last newline may be missing at the end
+   return true;
+}
+
+//*********************************************************************
+// Function:  sort_order, number_order
+// Purpose:   to order the records of a sort run
+//
+// Details:   sort_order is key field order, and number_order is by
+//            inventory number; either way, records that compare
+//            equal are taken in the order they were read.
+// Inputs:    a, b - the records
+// Outputs:   returns whether a comes before b
+//
+//*********************************************************************
+
+bool sort_order (const SortRecord &a, const SortRecord &b)
+{
+    if(key_order(a.entry, b.entry))
+    {
+	return true;
+    }
+    if(key_order(b.entry, a.entry))
+    {
+	return false;
+    }
+    return a.ordinal < b.ordinal;
+}
+
+bool number_order (const SortNumber &a, const SortNumber &b)
+{
+    if(a.inventory_number != b.inventory_number)
+    {
+	return a.inventory_number < b.inventory_number;
+    }
+    return a.ordinal < b.ordinal;
+}
+
+//*********************************************************************
+// Function:  open_spill
+// Purpose:   to make a temporary file for a sort run
+//
+// Details:   the file is deleted when it is closed, or if the
+//            program ends first. It is buffered in SORT_IO_BUFFER
+//            pieces, as runs are only ever read and written through.
+// Outputs:   returns the file, or NULL if none could be made
+//
+//*********************************************************************
+
+FILE *open_spill ()
+{
+    FILE *spill = tmpfile();
+
+    if(spill != NULL)
+    {
+	setvbuf(spill, NULL, _IOFBF, SORT_IO_BUFFER);
+    }
+    return spill;
+}
+
+//*********************************************************************
+// Function:  spill_run
+// Purpose:   to sort part of the input and write it out as two runs
+//
+// Details:   The records are sorted into key field order and written
+//            to one file; their inventory numbers, with the position
+//            each was read at, are sorted into number order and
+//            written to another. Both are rewound, ready to merge.
+// Inputs:    records - the part of the input
+//            count - the records in it
+// Outputs:   records - sorted
+//            entries, numbers - the runs, or NULL if either could not
+//                               be written
+//
+//*********************************************************************
+
+void spill_run (SortRecord records[], size_t count, FILE *&entries,
+                FILE *&numbers)
+{
+    vector<SortNumber> keys(count);
+
+    sort(records, records + count, sort_order);
+    for(size_t record = 0; record < count; record++)
+    {
+	keys[record].inventory_number = records[record].entry.inventory_number;
+	keys[record].ordinal = records[record].ordinal;
+    }
+    sort(keys.begin(), keys.end(), number_order);
+
+    entries = open_spill();
+    numbers = open_spill();
+    if(entries == NULL || numbers == NULL ||
+       fwrite(records, sizeof(SortRecord), count, entries) != count ||
+       fwrite(keys.data(), sizeof(SortNumber), keys.size(), numbers)
+	   != keys.size() ||
+       fflush(entries) != 0 || fflush(numbers) != 0)
+    {
+	if(entries != NULL)
+	{
+	    fclose(entries);
+	}
+	if(numbers != NULL)
+	{
+	    fclose(numbers);
+	}
+	entries = numbers = NULL;
+	return;
+    }
+    rewind(entries);
+    rewind(numbers);
+    return;
+}
+
+//*********************************************************************
+// Function:  merge_runs
+// Purpose:   to merge sorted runs back into one sorted sequence
+//
+// Details:   A k-way merge: a heap holds the next record of each run
+//            and the least is taken each time. The runs are closed,
+//            and so deleted, once they are used up.
+// Inputs:    runs - the runs, each sorted and rewound
+//            before - the order they are sorted in
+//            take - called with each record in turn
+// Outputs:   runs - empty
+//
+//*********************************************************************
+
+template <class RECORD>
+void merge_runs (vector<FILE *> &runs,
+                 bool (*before)(const RECORD&, const RECORD&),
+                 const function<void(const RECORD&)> &take)
+{
+    typedef pair<RECORD, size_t> HEAD;  // next record of a run, and which
+    auto later = [before](const HEAD &a, const HEAD &b)
+		 {
+		     return before(b.first, a.first);
+		 };
+    priority_queue<HEAD, vector<HEAD>, decltype(later)> next(later);
+    HEAD least;
+
+    for(size_t run = 0; run < runs.size(); run++)
+    {
+	if(fread(&least.first, sizeof(RECORD), 1, runs[run]) == 1)
+	{
+	    least.second = run;
+	    next.push(least);
+	}
+    }
+    while(!next.empty())
+    {
+	least = next.top();
+	next.pop();
+	take(least.first);
+	if(fread(&least.first, sizeof(RECORD), 1, runs[least.second]) == 1)
+	{
+	    next.push(least);
+	}
+    }
+    for(size_t run = 0; run < runs.size(); run++)
+    {
+	fclose(runs[run]);
+    }
+    runs.clear();
+    return;
+}
+
+//*********************************************************************
+// Function:  merge_to_spill
+// Purpose:   to merge sorted runs into one longer run
+//
+// Details:   see merge_runs. The runs are closed whether or not the
+//            longer run could be written.
+// Inputs:    runs - the runs, each sorted and rewound
+//            before - the order they are sorted in
+// Outputs:   runs - empty
+//            returns the longer run, rewound, or NULL if it could not
+//            be written
+//
+//*********************************************************************
+
+template <class RECORD>
+FILE *merge_to_spill (vector<FILE *> &runs,
+                      bool (*before)(const RECORD&, const RECORD&))
+{
+    FILE *merged = open_spill();
+
+    if(merged == NULL)
+    {
+	for(size_t run = 0; run < runs.size(); run++)
+	{
+	    fclose(runs[run]);
+	}
+	runs.clear();
+	return NULL;
+    }
+    merge_runs<RECORD>(runs, before, [merged](const RECORD &record)
+		       {
+			   fwrite(&record, sizeof(RECORD), 1, merged);
+		       });
+    if(fflush(merged) != 0 || ferror(merged))
+    {
+	fclose(merged);
+	return NULL;
+    }
+    rewind(merged);
+    return merged;
+}
+
+//*********************************************************************
+// Function:  add_run
+// Purpose:   to keep a new sorted run without holding a file open for
+//            every run an external sort makes
+//
+// Details:   Runs are kept in tiers: a new run goes in the first, and
+//            whenever a tier has SORT_MERGE_WAYS runs they are merged
+//            into one run in the next tier up. So no tier ever holds
+//            more than SORT_MERGE_WAYS - 1 runs, the files open grow
+//            only with the number of tiers, and each record is
+//            rewritten once per tier, as with merging in passes at
+//            the end.
+// Inputs:    tiers - the runs kept so far
+//            run - the new run, sorted and rewound
+//            before - the order the runs are sorted in
+// Outputs:   tiers - with the run added
+//            returns false if a longer run could not be written
+//
+//*********************************************************************
+
+template <class RECORD>
+bool add_run (vector<vector<FILE *> > &tiers, FILE *run,
+              bool (*before)(const RECORD&, const RECORD&))
+{
+    if(tiers.empty())
+    {
+	tiers.resize(1);
+    }
+    tiers[0].push_back(run);
+    for(size_t tier = 0; tier < tiers.size(); tier++)
+    {
+	if(tiers[tier].size() < SORT_MERGE_WAYS)
+	{
+	    break;
+	}
+
+	FILE *merged = merge_to_spill<RECORD>(tiers[tier], before);
+
+	if(merged == NULL)
+	{
+	    return false;
+	}
+	if(tier + 1 == tiers.size())
+	{
+	    tiers.resize(tier + 2);
+	}
+	tiers[tier + 1].push_back(merged);
+    }
+    return true;
+}
+
+//*********************************************************************
+// Function:  merge_spills
+// Purpose:   to merge sorted runs back into one sorted sequence
+//
+// Details:   see merge_runs. At most SORT_MERGE_WAYS runs are merged
+//            at once, to stay well inside the open file limit; if
+//            there are more, groups of them are first merged into
+//            longer runs, as many times as it takes.
+// Inputs:    runs - the runs, each sorted and rewound
+//            before - the order they are sorted in
+//            visit - called with each record in turn
+// Outputs:   runs - empty
+//            returns false if a temporary file could not be written
+//
+//*********************************************************************
+
+template <class RECORD>
+bool merge_spills (vector<FILE *> &runs,
+                   bool (*before)(const RECORD&, const RECORD&),
+                   const function<void(const RECORD&)> &visit)
+{
+    bool success = true;
+
+    while(runs.size() > SORT_MERGE_WAYS && success)
+    {
+	vector<FILE *> longer;
+
+	for(size_t first = 0; first < runs.size(); first += SORT_MERGE_WAYS)
+	{
+	    vector<FILE *> group(runs.begin() + first,
+				 runs.begin() + min(first + SORT_MERGE_WAYS,
+						    runs.size()));
+
+	    if(!success)
+	    {
+		longer.insert(longer.end(), group.begin(), group.end());
+		continue;
+	    }
+
+	    FILE *merged = merge_to_spill<RECORD>(group, before);
+
+	    if(merged == NULL)
+	    {
+		success = false;
+		continue;
+	    }
+	    longer.push_back(merged);
+	}
+	runs.swap(longer);
+    }
+    if(success)
+    {
+	merge_runs<RECORD>(runs, before, visit);
+    }
+    for(size_t run = 0; run < runs.size(); run++)
+    {
+	fclose(runs[run]);
+    }
+    runs.clear();
+    return success;
+}
+
+//*********************************************************************
+// Function:  sort_inventory
+// Purpose:   to sort an inventory file of any size into key field
+//            order
+//
+// Details:   A parallel external merge sort. The input is read a
+//            memory budget at a time; each budgetful is split into a
+//            run per processor, and the runs are sorted and written
+//            to temporary files on threads of their own (see
+//            spill_run). Runs are merged as they build up, so only a
+//            few dozen files per tier of runs are open at once (see
+//            add_run). When the whole input has been read, the runs
+//            of inventory numbers are merged first: a number that
+//            comes up more than once is reported, and every entry
+//            with it except the first one read is skipped, as
+//            load_inventory does. Then the runs of entries are merged
+//            (see merge_spills) and written, in key field order, as
+//            an inventory file. No more than the budget and a buffer
+//            per run is held at any time, however large the input.
+//            A malformed entry (see read_entry) stops the sort before
+//            anything is written.
+// Inputs:    input - the inventory file to sort, in any order
+//            output - the file to write
+//            memory - bytes of records to sort in memory at a time
+//            report - where to list the repeated inventory numbers
+//                     and a malformed entry's line
+// Outputs:   the sorted inventory file
+//            returns false if a file could not be read or written,
+//            or the input has a malformed entry
+//
+//*********************************************************************
+
+bool sort_inventory (const char input[], const char output[], size_t memory,
+                     ostream &report)
+{
+    ifstream inp(input);
+    ofstream outp;
+    OutputBuffer buffer;
+    size_t budget = max(memory / sizeof(SortRecord), (size_t)1);
+    size_t pieces = max(thread::hardware_concurrency(), 1u);
+                                     // runs sorted at once
+    vector<SortRecord> block;
+    vector<vector<FILE *> > entry_tiers, number_tiers;
+                                     // runs as they are spilled; see add_run
+    vector<FILE *> entry_runs, number_runs;
+    vector<uint64_t> skipped;        // input positions of repeated numbers
+    SortNumber previous;
+    SortRecord record;
+    uint64_t read = 0;
+    int written = 0;
+    size_t line = 0;
+    const char *error = NULL;
+    bool success = true;
+
+    if(inp.fail())
+    {
+	return false;
+    }
+    block.reserve(budget);
+    while(success)
+    {
+	block.clear();
+	while(block.size() < budget && read_entry(inp, record.entry, line, error))
+	{
+	    record.ordinal = read++;
+	    block.push_back(record);
+	}
+	if(error != NULL)
+	{
+	    report << input << ", line " << line << ": " << error << endl;
+	    success = false;
+	    break;
+	}
+	if(block.empty())
+	{
+	    break;
+	}
+
+	size_t count = min(pieces, (block.size() + PARALLEL_MIN_RECORDS - 1) /
+				   PARALLEL_MIN_RECORDS);
+	vector<size_t> start(count + 1);
+	vector<FILE *> entries(count), numbers(count);
+	vector<thread> workers;
+
+	for(size_t run = 0; run <= count; run++)
+	{
+	    start[run] = block.size() * run / count;
+	}
+	for(size_t run = 1; run < count; run++)
+	{
+	    workers.push_back(thread(spill_run, &block[start[run]],
+				     start[run + 1] - start[run],
+				     ref(entries[run]), ref(numbers[run])));
+	}
+	spill_run(&block[0], start[1], entries[0], numbers[0]);
+	for(size_t worker = 0; worker < workers.size(); worker++)
+	{
+	    workers[worker].join();
+	}
+	for(size_t run = 0; run < count; run++)
+	{
+	    if(entries[run] == NULL)
+	    {
+		success = false;
+		continue;
+	    }
+
+	    bool kept = add_run<SortRecord>(entry_tiers, entries[run],
+					    sort_order);
+
+	    kept = add_run<SortNumber>(number_tiers, numbers[run],
+				       number_order) && kept;
+	    success = success && kept;
+	}
+    }
+    for(size_t tier = 0; tier < entry_tiers.size(); tier++)
+    {
+	entry_runs.insert(entry_runs.end(), entry_tiers[tier].begin(),
+			  entry_tiers[tier].end());
+    }
+    for(size_t tier = 0; tier < number_tiers.size(); tier++)
+    {
+	number_runs.insert(number_runs.end(), number_tiers[tier].begin(),
+			   number_tiers[tier].end());
+    }
+
+    previous.inventory_number = 0;
+    previous.ordinal = UINT64_MAX;
+    success = success &&
+	      merge_spills<SortNumber>(number_runs, number_order,
+				       [&](const SortNumber &key)
+	{
+	    if(previous.ordinal != UINT64_MAX &&
+	       key.inventory_number == previous.inventory_number)
+	    {
+		report << "inventory number " << key.inventory_number
+		       << " of entry " << key.ordinal + 1
+		       << " was already used by entry "
+		       << previous.ordinal + 1 << "; skipped" << endl;
+		skipped.push_back(key.ordinal);
+		return;
+	    }
+	    previous = key;
+	});
+    sort(skipped.begin(), skipped.end());
+
+    if(success)
+    {
+	outp.open(output, ios::out | ios::binary);
+	success = !outp.fail();
+    }
+    if(success)
+    {
+	start_output(buffer, outp);
+	success = merge_spills<SortRecord>(entry_runs, sort_order,
+					   [&](const SortRecord &sorted)
+	{
+	    if(!binary_search(skipped.begin(), skipped.end(),
+			      sorted.ordinal))
+	    {
+		put_entry(buffer, sorted.entry, FMT_FILE, ++written);
+	    }
+	}) && flush_output(buffer);
+    }
+    for(size_t run = 0; run < entry_runs.size(); run++)
+    {
+	fclose(entry_runs[run]);
+    }
+    for(size_t run = 0; run < number_runs.size(); run++)
+    {
+	fclose(number_runs[run]);
+    }
+    if(success && !skipped.empty())
+    {
+	report << skipped.size() << " entries with a repeated inventory "
+	       << "number were skipped" << endl;
+    }
+    return success;
+}
+
+//*********************************************************************
+// Function:  process_menu
+// Purpose:   displays a menu listing the allowable operation choices,
+//            prompts for user input and reads input until the end of
+//            line is encountered.
+// Details:   Returns the first non-whitespace character encountered.
+//            Any non-whitespace between the menu choice and the 
+//            end of line is eliminated.
+// Inputs:    none
+// Outputs:   choice - the first non-whitespace character
+//*********************************************************************
+
+void process_menu (char &choice)
+{
+  char junk;
+
+   cout << "********************************************************" << endl
+        << "*                                                      *" << endl
+        << "*               1631 Book Inventory DB                 *" << endl
+        << "*                                                      *" << endl
+        << "*    1 - list ALL entries                              *" << endl
+        << "*    2 - list all entries matching author_name portion *" << endl
+        << "*    3 - remove an entry by inventory number           *" << endl
+        << "*    5 - search titles, comments and author names      *" << endl
+        << "*    6 - list entries by shelf and bin, in walk order  *" << endl
+        << "*    7 - export entries as csv, json or fixed width    *" << endl
+        << "*    8 - stock totals by category, author or shelf     *" << endl
+        << "*    9 - show timings, index hit rates and memory use  *" << endl
+        << "*    4 - to exit the program                           *" << endl
+        << "*                                                      *" << endl
+        << "********************************************************" << endl
+        << endl
+        << "Enter menu choice:  ";
+
+   cin >> choice;
+   do
+   {
+     cin.get (junk);
+   } while (junk != EOLN);
+
+   return;
+}
+
+//*********************************************************************
+// Function:  open_inventory
+// Purpose:   to split an empty inventory into shards
+//
+// Details:   Each shard has its own slots, indexes and lock, so
+//            changes to records in different shards do not wait for
+//            one another. One shard per core is a good default.
+// Inputs:    count - the number of shards; at least one is made
+// Outputs:   inventory - with count empty shards
+//
+//*********************************************************************
+
+void open_inventory (Inventory &inventory, size_t count)
+{
+    inventory.shards.clear();
+    for(size_t shard = 0; shard < max(count, (size_t)1); shard++)
+    {
+	inventory.shards.push_back(unique_ptr<Shard>(new Shard()));
+	rebuild_number_filter(*inventory.shards.back());
+	rebuild_name_filter(*inventory.shards.back());
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  page_inventory
+// Purpose:   to keep the records of an empty inventory in page files
+//
+// Details:   each shard has a page file and an equal share of the
+//            memory for pages; see open_pages.
+// Inputs:    inventory - the database, with no records yet
+//            memory - bytes of pages to hold in memory, in all
+// Outputs:   inventory - paged
+//            returns false if a page file could not be made
+//
+//*********************************************************************
+
+bool page_inventory (Inventory &inventory, size_t memory)
+{
+    size_t frames = memory / PAGE_SIZE / inventory.shards.size();
+
+    for(size_t shard = 0; shard < inventory.shards.size(); shard++)
+    {
+	if(!open_pages(*inventory.shards[shard], frames))
+	{
+	    return false;
+	}
+    }
+    return true;
+}
+
+//*********************************************************************
+// Function:  shard_index
+// Purpose:   to find which shard holds an inventory number
+//
+// Details:   a multiplicative (Fibonacci) hash, so that runs of
+//            consecutive inventory numbers are spread over the shards
+//            rather than landing in one.
+// Inputs:    inventory - the database
+//            inv_num - the inventory number
+// Outputs:   returns the index of its shard
+//
+//*********************************************************************
+
+size_t shard_index (const Inventory &inventory, int inv_num)
+{
+    uint64_t hash = (uint32_t)inv_num * 0x9E3779B97F4A7C15ull;
+
+    return (hash >> 32) % inventory.shards.size();
+}
+
+//*********************************************************************
+// Function:  shard_for
+// Purpose:   to find the shard that holds an inventory number
+//
+// Inputs:    inventory - the database
+//            inv_num - the inventory number
+// Outputs:   returns its shard
+//
+//*********************************************************************
+
+Shard &shard_for (const Inventory &inventory, int inv_num)
+{
+    return *inventory.shards[shard_index(inventory, inv_num)];
+}
+
+//*********************************************************************
+// Function:  clear_shard
+// Purpose:   to empty a shard of records
+//
+// Details:   The caller must hold the write lock.
+// Inputs:    shard - the shard
+// Outputs:   shard - with no records, slots or pooled strings
+//
+//*********************************************************************
+
+void clear_shard (Shard &shard)
+{
+    shard.book.clear();
+    if(shard.pages)
+    {
+	clear_pages(*shard.pages);
+    }
+    shard.strings = StringPool();
+    shard.titles.clear();
+    shard.dead_title_bytes = 0;
+    shard.free_slots.clear();
+    shard.by_name.clear();
+    shard.by_number.clear();
+    shard.by_location.clear();
+    shard.text = TextIndex();
+    shard.by_category.clear();
+    shard.by_author.clear();
+    shard.by_shelf.clear();
+    rebuild_number_filter(shard);
+    rebuild_name_filter(shard);
+    return;
+}
+
+//*********************************************************************
+// Function:  lock_all
+// Purpose:   to take the read lock of every shard
+//
+// Details:   The locks are always taken in shard order, as
+//            commit_transaction takes its write locks, so that the two
+//            cannot deadlock. Holding them all gives a view of the
+//            whole inventory in which any transaction is either wholly
+//            made or not made at all; only for_each_in_order takes
+//            them, and then for one chunk at a time.
+// Inputs:    inventory - the database
+// Outputs:   locks - the held locks, released when it is destroyed
+//
+//*********************************************************************
+
+void lock_all (const Inventory &inventory, vector<READ_LOCK> &locks)
+{
+    locks.reserve(inventory.shards.size());
+    for(size_t shard = 0; shard < inventory.shards.size(); shard++)
+    {
+	locks.push_back(READ_LOCK(inventory.shards[shard]->guard));
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  total_entries
+// Purpose:   to count the records in every shard
+//
+// Details:   Each shard's read lock is taken in turn, so the caller
+//            must hold none of them. Another client may change a shard
+//            counted already, so the count is only a snapshot.
+// Inputs:    inventory - the database
+// Outputs:   returns the number of records
+//
+//*********************************************************************
+
+size_t total_entries (const Inventory &inventory)
+{
+    size_t count = 0;
+
+    for(size_t shard = 0; shard < inventory.shards.size(); shard++)
+    {
+	READ_LOCK lock(inventory.shards[shard]->guard);
+
+	count += inventory.shards[shard]->by_number.size();
+    }
+    return count;
+}
+
+//*********************************************************************
+// Function:  fan_out
+// Purpose:   to do some work on every shard at once
+//
+// Details:   The calling thread posts the shards as a job to the
+//            worker pool and then takes shards itself, one at a time,
+//            until none are left, while any idle workers take the
+//            others; it returns once the workers' shards are done too.
+//            No thread is started, and a busy pool only means the
+//            caller does more of the shards itself, so fan_out never
+//            waits for a worker to come free and may be called from
+//            any number of threads at once. Waking a worker still
+//            costs about as much as looking through a few thousand
+//            records, so with one shard, or fewer than
+//            PARALLEL_MIN_SHARD records for each shard to go through,
+//            the shards are simply done in turn. Each call must touch
+//            only its own shard and its own results.
+// Inputs:    inventory - the database
+//            records - about how many records the work looks at
+//            work - the work, given a shard index
+//
+//*********************************************************************
+
+void fan_out (const Inventory &inventory, size_t records,
+              const function<void(size_t)> &work)
+{
+    size_t count = inventory.shards.size();
+    FanOutJob job = { &work, count, 0, 0 };
+    size_t shard;
+
+    if(count == 1 || records / count < PARALLEL_MIN_SHARD)
+    {
+	for(shard = 0; shard < count; shard++)
+	{
+	    work(shard);
+	}
+	return;
+    }
+
+    WorkerPool &pool = worker_pool();
+    unique_lock<mutex> lock(pool.guard);
+
+    pool.jobs.push_back(&job);
+    pool.wake.notify_all();
+    while(claim_shard(pool, job, shard))
+    {
+	lock.unlock();
+	work(shard);
+	lock.lock();
+	job.running--;
+    }
+    while(job.running > 0)
+    {
+	pool.done.wait(lock);
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  worker_pool, pool_worker, claim_shard
+// Purpose:   to keep the threads that fan_out shares shards with
+//
+// Details:   The pool has one thread fewer than the processors, as
+//            the caller of fan_out works too, but at least one. It is
+//            started the first time it is wanted and never stopped:
+//            its threads are detached and wait for jobs until the
+//            process ends, so the pool itself is never destroyed
+//            under them. A worker takes the next shard of the oldest
+//            job, and a job leaves the queue once its last shard has
+//            been handed out.
+// Inputs:    pool - the pool
+//            job - a posted job
+// Outputs:   shard - the shard handed out
+//            returns, for claim_shard, false if every shard of the
+//            job has been handed out already
+//
+//*********************************************************************
+
+WorkerPool &worker_pool ()
+{
+    static WorkerPool *pool = NULL;
+    static once_flag started;
+
+    call_once(started, []()
+    {
+	unsigned helpers = max(thread::hardware_concurrency(), 2u) - 1;
+
+	pool = new WorkerPool();
+	for(unsigned helper = 0; helper < helpers; helper++)
+	{
+	    thread(pool_worker, ref(*pool)).detach();
+	}
+    });
+    return *pool;
+}
+
+void pool_worker (WorkerPool &pool)
+{
+    unique_lock<mutex> lock(pool.guard);
+    size_t shard;
+
+    for(;;)
+    {
+	while(pool.jobs.empty())
+	{
+	    pool.wake.wait(lock);
+	}
+
+	FanOutJob &job = *pool.jobs.front();
+
+	claim_shard(pool, job, shard);
+	lock.unlock();
+	(*job.work)(shard);
+	lock.lock();
+	if(--job.running == 0)
+	{
+	    pool.done.notify_all();
+	}
+    }
+}
+
+bool claim_shard (WorkerPool &pool, FanOutJob &job, size_t &shard)
+{
+    if(job.next == job.shards)
+    {
+	return false;
+    }
+    shard = job.next++;
+    job.running++;
+    if(job.next == job.shards)
+    {
+	pool.jobs.erase(find(pool.jobs.begin(), pool.jobs.end(), &job));
+    }
+    return true;
+}
+
+//*********************************************************************
+// Function:  key_order, walk_order
+// Purpose:   to compare entries by key field, or in walk order
+//
+// Inputs:    a, b - the entries
+// Outputs:   returns whether a comes before b
+//
+//*********************************************************************
+
+bool key_order (const Entry &a, const Entry &b)
+{
+    int names = strcmp(a.author_name, b.author_name);
+
+    if(names != 0)
+    {
+	return names < 0;
+    }
+    return a.inventory_number < b.inventory_number;
+}
+
+bool walk_order (const Entry &a, const Entry &b)
+{
+    return location_key(a) < location_key(b);
+}
+
+//*********************************************************************
+// Function:  merge_runs
+// Purpose:   to merge the sorted results of each shard into one list
+//
+// Details:   The runs are laid end to end and merged in pairs, each
+//            round halving the number of runs, so n results from k
+//            shards are merged in O(n log k).
+// Inputs:    runs - the results of each shard, each sorted by before
+//            before - the order of the results
+// Outputs:   entries - every result, sorted
+//
+//*********************************************************************
+
+void merge_runs (vector<vector<Entry> > &runs,
+                 bool (*before)(const Entry&, const Entry&),
+                 vector<Entry> &entries)
+{
+    vector<size_t> bounds(1, 0);     // where each run starts, and the end
+
+    entries.clear();
+    for(size_t run = 0; run < runs.size(); run++)
+    {
+	entries.insert(entries.end(), runs[run].begin(), runs[run].end());
+	bounds.push_back(entries.size());
+    }
+    while(bounds.size() > 2)
+    {
+	vector<size_t> merged(1, 0);
+
+	for(size_t run = 0; run + 1 < bounds.size(); run += 2)
+	{
+	    if(run + 2 < bounds.size())
+	    {
+		inplace_merge(entries.begin() + bounds[run],
+			      entries.begin() + bounds[run + 1],
+			      entries.begin() + bounds[run + 2], before);
+		merged.push_back(bounds[run + 2]);
+	    }
+	    else
+	    {
+		merged.push_back(bounds[run + 1]);
+	    }
+	}
+	bounds.swap(merged);
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  get_entry
+// Purpose:   to fetch one entry by inventory number
+//
+// Details:   only the shard holding the number is locked.
+// Inputs:    inventory - the database
+//            inv_num - the inventory number
+// Outputs:   entry - the entry, if found
+//            returns whether or not it was found
+//
+//*********************************************************************
+
+bool get_entry (const Inventory &inventory, int inv_num, Entry &entry)
+{
+    TimedOp timer(MET_GET);
+    const Shard &shard = shard_for(inventory, inv_num);
+    READ_LOCK lock(shard.guard);
+    int slot = find_entry(shard, inv_num);
+
+    if(slot == NO_SLOT)
+    {
+	count_metric(CNT_NUMBER_MISS);
+	return false;
+    }
+    count_metric(CNT_NUMBER_HIT);
+    entry = entry_at(shard, slot);
+    return true;
+}
+
+//*********************************************************************
+// Function:  query_by_name
+// Purpose:   to find the entries whose author_name starts with a
+//            prefix
+//
+// Details:   Any shard may hold any author, so each shard's name index
+//            is scanned from the prefix, shared with the worker pool
+//            when there are many records (see fan_out), and the
+//            results merged into key order. A
+//            shard whose name filter shows that no author_name there
+//            starts with the prefix is passed over. Each shard is
+//            scanned SCAN_CHUNK entries at a time under its own read
+//            lock, resuming after the key of the last one, so a change
+//            waits at most for one chunk of one shard, as with
+//            for_each_in_order. Each chunk is a consistent view of its
+//            records, but a transaction over several shards may be
+//            seen on one and not yet on another.
+// Inputs:    inventory - the database
+//            prefix - the start of the author_name
+// Outputs:   entries - the matching entries, in key field order
+//
+//*********************************************************************
+
+void query_by_name (const Inventory &inventory, const char prefix[],
+                    vector<Entry> &entries)
+{
+    TimedOp timer(MET_FIND);
+    vector<vector<Entry> > runs(inventory.shards.size());
+    vector<uint64_t> hashes;
+    size_t length = strlen(prefix);
+
+    prefix_hashes(prefix, hashes);
+    fan_out(inventory, total_entries(inventory),
+	    [&](size_t index)
+	    {
+		const Shard &shard = *inventory.shards[index];
+		vector<Entry> &found = runs[index];
+		size_t copied;
+
+		do
+		{
+		    READ_LOCK lock(shard.guard);
+		    NAME_INDEX::const_iterator loop;
+
+		    if(found.empty() && length > 0 &&
+		       !bloom_test(shard.name_filter, hashes.back()))
+		    {
+			count_metric(CNT_NAME_FILTERED);
+			return;
+		    }
+		    loop = found.empty() ?
+			shard.by_name.lower_bound(NAME_KEY(prefix, INT_MIN)) :
+			shard.by_name.upper_bound(
+			    NAME_KEY(found.back().author_name,
+				     found.back().inventory_number));
+		    for(copied = 0;
+			copied < SCAN_CHUNK && loop != shard.by_name.end() &&
+			    strncmp(loop->first.first.data(), prefix,
+				    length) == 0;
+			copied++, loop++)
+		    {
+			found.push_back(entry_at(shard, loop->second));
+		    }
+		} while(copied == SCAN_CHUNK);
+	    });
+    merge_runs(runs, key_order, entries);
+    count_metric(entries.empty() ? CNT_NAME_MISS : CNT_NAME_HIT);
+    return;
+}
+
+//*********************************************************************
+// Function:  query_by_location
+// Purpose:   to find the entries in a range of bins on one shelf
+//
+// Details:   as query_by_name, but over each shard's location index,
+//            chunk by chunk in the same way; see find_by_location.
+// Inputs:    inventory - the database
+//            shelf - the shelf letter, in lower case
+//            first, last - the bins wanted, inclusive
+// Outputs:   entries - the entries found, in walk order
+//
+//*********************************************************************
+
+void query_by_location (const Inventory &inventory, char shelf, int first,
+                        int last, vector<Entry> &entries)
+{
+    TimedOp timer(MET_LOCATION);
+    vector<vector<Entry> > runs(inventory.shards.size());
+
+    fan_out(inventory, total_entries(inventory),
+	    [&](size_t index)
+	    {
+		const Shard &shard = *inventory.shards[index];
+		vector<Entry> &found = runs[index];
+		LOCATION_KEY after;
+		vector<int> slots;
+
+		do
+		{
+		    READ_LOCK lock(shard.guard);
+
+		    slots.clear();
+		    if(!found.empty())
+		    {
+			after = location_key(found.back());
+		    }
+		    find_by_location(shard, shelf, first, last,
+				     found.empty() ? NULL : &after, SCAN_CHUNK,
+				     slots);
+		    for(size_t hit = 0; hit < slots.size(); hit++)
+		    {
+			found.push_back(entry_at(shard, slots[hit]));
+		    }
+		} while(slots.size() == SCAN_CHUNK);
+	    });
+    merge_runs(runs, walk_order, entries);
+    count_metric(entries.empty() ? CNT_LOCATION_MISS : CNT_LOCATION_HIT);
+    return;
+}
+
+//*********************************************************************
+// Function:  query_text
+// Purpose:   to find the entries best matching some search words
+//
+// Details:   Each shard gives its own best limit matches; the overall
+//            best are among these. They are ranked together by score,
+//            then in key field order, and the best limit kept. See
+//            search_text. A shard's scores are only comparable within
+//            one pass over its index, so each shard is searched whole
+//            under its own read lock, but no other shard is locked
+//            meanwhile.
+// Inputs:    inventory - the database
+//            query - the search words
+//            limit - the most results wanted
+// Outputs:   entries - the matching entries, best first
+//
+//*********************************************************************
+
+void query_text (const Inventory &inventory, const char query[],
+                 size_t limit, vector<Entry> &entries)
+{
+    TimedOp timer(MET_SEARCH);
+    typedef pair<int, Entry> SCORED;
+    vector<vector<SCORED> > runs(inventory.shards.size());
+    vector<SCORED> ranked;
+
+    fan_out(inventory, total_entries(inventory),
+	    [&](size_t index)
+	    {
+		const Shard &shard = *inventory.shards[index];
+		READ_LOCK lock(shard.guard);
+		vector<pair<int, int> > hits;
+
+		search_text(shard, query, limit, hits);
+		for(size_t hit = 0; hit < hits.size(); hit++)
+		{
+		    runs[index].push_back(SCORED(hits[hit].first,
+						 entry_at(shard,
+							  hits[hit].second)));
+		}
+	    });
+    for(size_t run = 0; run < runs.size(); run++)
+    {
+	ranked.insert(ranked.end(), runs[run].begin(), runs[run].end());
+    }
+    limit = min(limit, ranked.size());
+    partial_sort(ranked.begin(), ranked.begin() + limit, ranked.end(),
+		 [](const SCORED &a, const SCORED &b)
+		 {
+		     if(a.first != b.first)
+		     {
+			 return a.first > b.first;
+		     }
+		     return key_order(a.second, b.second);
+		 });
+    entries.clear();
+    for(size_t hit = 0; hit < limit; hit++)
+    {
+	entries.push_back(ranked[hit].second);
+    }
+    count_metric(entries.empty() ? CNT_TEXT_MISS : CNT_TEXT_HIT);
+    return;
+}
+
+//*********************************************************************
+// Function:  for_each_in_order
+// Purpose:   to visit every entry of the inventory in key field order
+//
+// Details:   Every shard's name index is already in key order, so the
+//            shards are merged as they are walked: a heap holds the
+//            next record of each shard and the least is taken each
+//            time. The entries are copied out SCAN_CHUNK at a time
+//            under the read locks, and the locks are let go before
+//            they are visited, so a change waits only for a chunk to
+//            be copied, never for a listing to be written. The next
+//            chunk starts after the key of the last one. Each chunk
+//            is a consistent view of its records; a change made
+//            between chunks is seen if it is to a record not yet
+//            reached. A full listing or export needs no more memory
+//            than one chunk.
+// Inputs:    inventory - the database
+//            visit - called with each entry in turn
+//
+//*********************************************************************
+
+void for_each_in_order (const Inventory &inventory,
+                        const function<void(const Entry&)> &visit)
+{
+    typedef pair<NAME_INDEX::const_iterator, size_t> CURSOR;
+                                     // next record of a shard, and which
+    TimedOp timer(MET_SCAN);
+    auto later = [](const CURSOR &a, const CURSOR &b)
+		 {
+		     return b.first->first < a.first->first;
+		 };
+    vector<Entry> chunk;
+    string last_name;                // key of the last entry copied
+    int last_number = 0;
+
+    chunk.reserve(SCAN_CHUNK);
+    do
+    {
+	vector<READ_LOCK> locks;
+	priority_queue<CURSOR, vector<CURSOR>, decltype(later)> next(later);
+	bool resume = !chunk.empty();
+
+	chunk.clear();
+	lock_all(inventory, locks);
+	for(size_t shard = 0; shard < inventory.shards.size(); shard++)
+	{
+	    const NAME_INDEX &names = inventory.shards[shard]->by_name;
+	    NAME_INDEX::const_iterator first =
+		resume ? names.upper_bound(NAME_KEY(last_name, last_number))
+		       : names.begin();
+
+	    if(first != names.end())
+	    {
+		next.push(CURSOR(first, shard));
+	    }
+	}
+	while(!next.empty() && chunk.size() < SCAN_CHUNK)
+	{
+	    CURSOR least = next.top();
+	    const Shard &shard = *inventory.shards[least.second];
+
+	    next.pop();
+	    chunk.push_back(entry_at(shard, least.first->second));
+	    if(++least.first != shard.by_name.end())
+	    {
+		next.push(least);
+	    }
+	}
+	locks.clear();
+
+	if(!chunk.empty())
+	{
+	    last_name = chunk.back().author_name;
+	    last_number = chunk.back().inventory_number;
+	}
+	for(size_t entry = 0; entry < chunk.size(); entry++)
+	{
+	    visit(chunk[entry]);
+	}
+    } while(chunk.size() == SCAN_CHUNK);
+    return;
+}
+
+//*********************************************************************
+// Function:  list_all
+// Purpose:   list all the entries in the inventory
+//
+// Details:   formats each entry, in key field order, into an output
+//            buffer, so the listing is written in large pieces rather
+//            than a line at a time. No lock is held while the
+//            listing is written; see for_each_in_order.
+// Inputs:    inventory - the database
+//
+//*********************************************************************
+
+void list_all (const Inventory &inventory)
+{
+    OutputBuffer output;
+    int count = 1;
+
+    start_output(output, cout);
+    for_each_in_order(inventory, [&](const Entry &entry)
+    {
+	put_entry(output, entry, FMT_REPORT, count);
+	count++;
+    });
+    flush_output(output);
+    return;
+}
+
+//*********************************************************************
+// Function:  list_by_name
+// Purpose:   to find any entries with the matching last name the user
+//            is looking for and print them out
+// Details:   lists the entries whose author_name begins with the
+//            entered last name, in key field order; see query_by_name.
+//            The read locks are taken only after the name has been
+//            entered.
+// Inputs:    inventory - the database
+//
+//*********************************************************************
+
+void list_by_name (const Inventory &store)
+{
     char lastName[MAX_AUTHOR_NAME];
-    int loop = 0, count = 1;
-    int compare;
+    int count = 1;
     bool found = false;
+    vector<Entry> entries;
+    OutputBuffer output;
     cout << "Please enter the last name of the author" <<
              "you wish to search for : ";
     cin >> lastName;
-    
-    while(loop < no_entries)
+
+    start_output(output, cout);
+    query_by_name(store, lastName, entries);
+    for(size_t loop = 0; loop < entries.size(); loop++)
+    {
+	put_entry(output, entries[loop], FMT_REPORT, count);
+	count++;
+	found = true;
+    }
+    flush_output(output);
+
+    if(!found)
+    {
+	cout << endl << lastName << " not found in inventory." << endl;
+    }
+
+    return;
+}
+
+//*********************************************************************
+// Function:  find_entry
+// Purpose:   to locate a book by its inventory number
+//
+// Details:   a lookup in the inventory number index, unless the
+//            shard's number filter shows the number is not there.
+//            The caller must hold the shard lock (either kind).
+// Inputs:    shard - the shard
+//            inv_num - the inventory number to look for
+// Outputs:   returns the slot of the entry, or NO_SLOT if not present
+//
+//*********************************************************************
+
+int find_entry (const Shard &shard, int inv_num)
+{
+    if(!bloom_test(shard.number_filter, number_hash(inv_num)))
+    {
+	count_metric(CNT_NUMBER_FILTERED);
+	return NO_SLOT;
+    }
+    NUMBER_INDEX::const_iterator found = shard.by_number.find(inv_num);
+    if(found == shard.by_number.end())
+    {
+	count_metric(CNT_FILTER_FALSE);
+	return NO_SLOT;
+    }
+    return found->second;
+}
+
+//*********************************************************************
+// Function:  number_hash, prefix_hashes
+// Purpose:   to hash the keys of a shard's Bloom filters
+//
+// Details:   prefix_hashes gives the hash of every leading part of a
+//            name, from the first letter to the whole name; FNV-1a
+//            goes a letter at a time, so each is one step on from
+//            the last. Both finish with the splitmix64 mixer, as the
+//            filter picks a block from the low bits alone.
+// Inputs:    inv_num - an inventory number
+//            name - an author_name or prefix of one
+// Outputs:   returns the hash of the number
+//            hashes - the hash of each prefix of the name, shortest
+//                     first
+//
+//*********************************************************************
+
+uint64_t number_hash (int inv_num)
+{
+    uint64_t state = (uint32_t)inv_num;
+
+    return next_random(state);
+}
+
+void prefix_hashes (const char name[], vector<uint64_t> &hashes)
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+
+    hashes.clear();
+    for(const char *letter = name; *letter != '\0'; letter++)
+    {
+	uint64_t state;
+
+	hash = (hash ^ (unsigned char)*letter) * 0x100000001B3ull;
+	state = hash;
+	hashes.push_back(next_random(state));
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  bloom_reset, bloom_add, bloom_test
+// Purpose:   to keep and ask a Bloom filter
+//
+// Details:   A key sets BLOOM_HASHES bits. If any of a key's bits is
+//            clear, the key was never added; if all are set, it
+//            probably was. The bits are all in one block the size of a
+//            cache line, picked by the low bits of the hash, with nine
+//            bits of the rest of the hash picking each bit in the
+//            block; a key then costs one cache miss rather than one a
+//            bit. With BLOOM_BITS_PER_KEY bits for each key, about 1%
+//            of absent keys get through. The filter is a power of two
+//            blocks, so picking a block is a mask. bloom_reset makes
+//            room for twice the keys it is given, so that the filter
+//            can be added to for a while before it fills, but keeps
+//            the filter's size if that is within a factor of two of
+//            it: growing it means fresh memory, and page faults that
+//            cost more than the rebuild.
+// Inputs:    filter - the filter
+//            keys - the keys to make room for
+//            hash - a key's hash
+// Outputs:   filter - empty, or with the key added
+//            returns, for bloom_add, whether any bit was clear - that
+//            is, whether the key is surely new - and for bloom_test,
+//            whether the key may have been added
+//
+//*********************************************************************
+
+void bloom_reset (BloomFilter &filter, size_t keys)
+{
+    size_t words = BLOOM_MIN_BITS / 64;
+
+    while(words * 64 < 2 * keys * BLOOM_BITS_PER_KEY)
+    {
+	words *= 2;
+    }
+    if(filter.bits.size() >= words / 2 && filter.bits.size() <= words * 2)
+    {
+	words = filter.bits.size();
+    }
+    filter.bits.assign(words, 0);
+    filter.keys = 0;
+    filter.stale = 0;
+    return;
+}
+
+bool bloom_add (BloomFilter &filter, uint64_t hash)
+{
+    uint64_t *block = &filter.bits[(hash & (filter.bits.size() /
+					      BLOOM_BLOCK_WORDS - 1)) *
+				   BLOOM_BLOCK_WORDS];
+    uint64_t picks = hash * 0x9E3779B97F4A7C15ull;
+    bool added = false;
+
+    for(int probe = 0; probe < BLOOM_HASHES; probe++, picks >>= 9)
+    {
+	uint64_t &word = block[(picks & 511) / 64];
+	uint64_t bit = 1ull << (picks & 63);
+
+	added = added || (word & bit) == 0;
+	word |= bit;
+    }
+    return added;
+}
+
+bool bloom_test (const BloomFilter &filter, uint64_t hash)
+{
+    const uint64_t *block = &filter.bits[(hash & (filter.bits.size() /
+						    BLOOM_BLOCK_WORDS - 1)) *
+					 BLOOM_BLOCK_WORDS];
+    uint64_t picks = hash * 0x9E3779B97F4A7C15ull;
+
+    for(int probe = 0; probe < BLOOM_HASHES; probe++, picks >>= 9)
+    {
+	if((block[(picks & 511) / 64] & (1ull << (picks & 63))) == 0)
+	{
+	    return false;
+	}
+    }
+    return true;
+}
+
+//*********************************************************************
+// Function:  filter_record, unfilter_record
+// Purpose:   to keep a shard's Bloom filters current as a record is
+//            added or dropped
+//
+// Details:   A bit cannot be taken out of a Bloom filter, as other
+//            keys may share it, so a dropped number, or the name of
+//            an author whose last book in the shard is dropped, is
+//            only counted as stale. A filter is rebuilt from the
+//            shard when half of what it holds is stale, or when it
+//            holds more than it has room for. A stale key that gets
+//            through costs only the index probe the filter would have
+//            saved, so rebuilding more often would cost more than it
+//            saves. The name filter counts in letters, one key for
+//            each prefix, and an author's name counts only when it is
+//            new to the filter, so an author's many books count once.
+//            A record whose author_name changes is taken out under
+//            its old name and put back under its new one, with
+//            renamed set: its number stays in the shard, so the
+//            number filter is left alone rather than counting a key
+//            as stale that is not. The old name is stale, and a
+//            rename can trigger a rebuild, if it was the author's
+//            last book in the shard. The caller must hold the write
+//            lock, and call these once the stock totals count the
+//            record in, or out; by_author tells whether the author
+//            has any other book in the shard.
+// Inputs:    shard - the shard
+//            entry - the record
+//            renamed - only the author_name is changing
+// Outputs:   shard - with its filters updated
+//
+//*********************************************************************
+
+void filter_record (Shard &shard, const Entry &entry, bool renamed)
+{
+    BloomFilter &numbers = shard.number_filter;
+    BloomFilter &names = shard.name_filter;
+    vector<uint64_t> hashes;
+
+    if(!renamed)
+    {
+	numbers.keys += bloom_add(numbers,
+				  number_hash(entry.inventory_number));
+	if(numbers.keys * BLOOM_BITS_PER_KEY > numbers.bits.size() * 64)
+	{
+	    rebuild_number_filter(shard);
+	}
+    }
+
+    prefix_hashes(entry.author_name, hashes);
+    for(size_t prefix = 0; prefix + 1 < hashes.size(); prefix++)
+    {
+	bloom_add(names, hashes[prefix]);
+    }
+    if(!hashes.empty() && bloom_add(names, hashes.back()))
+    {
+	names.keys += hashes.size();
+    }
+    if(names.keys * BLOOM_BITS_PER_KEY > names.bits.size() * 64)
+    {
+	rebuild_name_filter(shard);
+    }
+    return;
+}
+
+void unfilter_record (Shard &shard, const Entry &entry, bool renamed)
+{
+    BloomFilter &numbers = shard.number_filter;
+    BloomFilter &names = shard.name_filter;
+    unordered_map<string_view, uint32_t>::const_iterator author =
+	shard.strings.ids.find(string_view(entry.author_name));
+
+    if(!renamed && ++numbers.stale * BLOOM_STALE_SHARE > numbers.keys)
+    {
+	rebuild_number_filter(shard);
+    }
+    if(author == shard.strings.ids.end() ||
+       shard.by_author.count(author->second) == 0)
+    {
+	names.stale += strlen(entry.author_name);
+	if(names.stale * BLOOM_STALE_SHARE > names.keys)
+	{
+	    rebuild_name_filter(shard);
+	}
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  rebuild_number_filter, rebuild_name_filter
+// Purpose:   to build a shard's Bloom filters afresh
+//
+// Details:   The numbers are those in the number index; the authors
+//            are those with stock totals, each once. The caller must
+//            hold the write lock.
+// Inputs:    shard - the shard
+// Outputs:   shard - with a filter of just its records' keys
+//
+//*********************************************************************
+
+void rebuild_number_filter (Shard &shard)
+{
+    BloomFilter &numbers = shard.number_filter;
+
+    bloom_reset(numbers, shard.by_number.size());
+    for(NUMBER_INDEX::const_iterator number = shard.by_number.begin();
+	number != shard.by_number.end(); number++)
+    {
+	bloom_add(numbers, number_hash(number->first));
+    }
+    numbers.keys = shard.by_number.size();
+    return;
+}
+
+void rebuild_name_filter (Shard &shard)
+{
+    BloomFilter &names = shard.name_filter;
+    vector<uint64_t> hashes;
+    size_t letters = 0;
+
+    for(unordered_map<uint32_t, StockTally>::const_iterator author =
+	    shard.by_author.begin(); author != shard.by_author.end();
+	author++)
+    {
+	letters += shard.strings.strings[author->first].size();
+    }
+    bloom_reset(names, letters);
+    for(unordered_map<uint32_t, StockTally>::const_iterator author =
+	    shard.by_author.begin(); author != shard.by_author.end();
+	author++)
+    {
+	prefix_hashes(shard.strings.strings[author->first].c_str(), hashes);
+	for(size_t prefix = 0; prefix < hashes.size(); prefix++)
+	{
+	    bloom_add(names, hashes[prefix]);
+	}
+    }
+    names.keys = letters;
+    return;
+}
+
+//*********************************************************************
+// Function:  add_record
+// Purpose:   to store a new record and enter it in the indexes
+//
+// Details:   reuses a free slot if there is one, otherwise grows the
+//            slot vector or page file. Nothing is moved, so no other
+//            slot changes.
+//            The entry is packed into the slot before it is indexed,
+//            so that the name index key refers to the pooled name.
+//            The caller must hold the write lock.
+// Inputs:    shard - the shard
+//            entry - the record to add
+// Outputs:   shard - with the record added
+//            returns the slot used, or NO_SLOT if the inventory number
+//            is already in use
+//
+//*********************************************************************
+
+int add_record (Shard &shard, const Entry &entry)
+{
+    int slot;
+
+    if(bloom_test(shard.number_filter,
+		  number_hash(entry.inventory_number)) &&
+       shard.by_number.count(entry.inventory_number) != 0)
+    {
+	return NO_SLOT;
+    }
+    if(shard.free_slots.empty() && shard.pages)
+    {
+	slot = shard.pages->slots++;
+    }
+    else if(shard.free_slots.empty())
+    {
+	slot = shard.book.size();
+	shard.book.push_back(Record());
+    }
+    else
+    {
+	slot = shard.free_slots.back();
+	shard.free_slots.pop_back();
+    }
+    pack_record(shard, slot, entry, false);
+    tally_record(shard, slot, 1);
+    shard.by_number[entry.inventory_number] = slot;
+    shard.by_name[NAME_KEY(author_of(shard, slot),
+			       entry.inventory_number)] = slot;
+    shard.by_location[location_key(entry)] = slot;
+    index_text(shard.text, entry, slot);
+    filter_record(shard, entry);
+    return slot;
+}
+
+//*********************************************************************
+// Function:  drop_record
+// Purpose:   to take a record out of the indexes and free its slot
+//
+// Details:   The slot's title becomes dead space in the title arena,
+//            and its pooled strings are released. The caller must hold
+//            the write lock.
+// Inputs:    shard - the shard
+//            slot - the slot of the record to drop
+// Outputs:   shard - with the record removed
+//
+//*********************************************************************
+
+void drop_record (Shard &shard, int slot)
+{
+    Entry entry = entry_at(shard, slot);
+    Record record = record_at(shard, slot);
+
+    shard.by_name.erase(NAME_KEY(entry.author_name,
+				     entry.inventory_number));
+    shard.by_number.erase(entry.inventory_number);
+    shard.by_location.erase(location_key(entry));
+    unindex_text(shard.text, entry, slot);
+    tally_record(shard, slot, -1);
+    unfilter_record(shard, entry);
+    release_string(shard.strings, record.author_id);
+    release_string(shard.strings, record.comment_id);
+    shard.free_slots.push_back(slot);
+    retire_title(shard, record.title_length);
+    return;
+}
+
+//*********************************************************************
+// Function:  replace_record
+// Purpose:   to overwrite a record in place
+//
+// Details:   The inventory number must not change. The name index is
+//            only touched if the author_name did, the location index
+//            if the location did, and the text index only if the
+//            author_name, title or comment did. The caller must hold
+//            the write lock.
+// Inputs:    shard - the shard
+//            slot - the slot of the record to overwrite
+//            entry - the new contents
+// Outputs:   shard - with the record replaced
+//
+//*********************************************************************
+
+void replace_record (Shard &shard, int slot, const Entry &entry)
+{
+    Entry stored = entry_at(shard, slot);
+    bool rename = strcmp(stored.author_name, entry.author_name) != 0;
+    bool reword = rename ||
+		  strcmp(stored.title, entry.title) != 0 ||
+		  strcmp(stored.comment, entry.comment) != 0;
+
+    if(rename)
+    {
+	shard.by_name.erase(NAME_KEY(stored.author_name,
+					 stored.inventory_number));
+    }
+    if(strcmp(stored.location, entry.location) != 0)
+    {
+	shard.by_location.erase(location_key(stored));
+	shard.by_location[location_key(entry)] = slot;
+    }
+    if(reword)
+    {
+	unindex_text(shard.text, stored, slot);
+    }
+    tally_record(shard, slot, -1);
+    if(rename)
+    {
+	unfilter_record(shard, stored, true);
+    }
+    pack_record(shard, slot, entry, true);
+    tally_record(shard, slot, 1);
+    if(rename)
+    {
+	shard.by_name[NAME_KEY(author_of(shard, slot),
+				   entry.inventory_number)] = slot;
+	filter_record(shard, entry, true);
+    }
+    if(reword)
+    {
+	index_text(shard.text, entry, slot);
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  intern_string, release_string
+// Purpose:   to find or add a string in a string pool, and to let go
+//            of it
+//
+// Details:   every distinct string is stored once and known by a
+//            32 bit id while any record uses it. intern_string counts
+//            one more use, release_string one less; a string whose
+//            last use ends is freed, and its id goes on a free list
+//            for the next new string. Nothing may hold a string's id,
+//            or a view of it, past its last use: the name index keys
+//            go with the records, and the stock totals drop a group
+//            once no record is in it. The strings themselves are in a
+//            deque, so a new one never moves the others.
+// Inputs:    pool - the string pool
+//            text - the string
+//            id - the id of a string a record no longer uses
+// Outputs:   pool - with the string added if it was new, or freed if
+//                   it is no longer used
+//            returns the string's id
+//
+//*********************************************************************
+
+uint32_t intern_string (StringPool &pool, const char text[])
+{
+    unordered_map<string_view, uint32_t>::const_iterator found =
+	pool.ids.find(string_view(text));
+    uint32_t id;
+
+    if(found != pool.ids.end())
+    {
+	pool.uses[found->second]++;
+	return found->second;
+    }
+    if(pool.free_ids.empty())
+    {
+	id = pool.strings.size();
+	pool.strings.push_back(text);
+	pool.uses.push_back(1);
+    }
+    else
+    {
+	id = pool.free_ids.back();
+	pool.free_ids.pop_back();
+	pool.strings[id] = text;
+	pool.uses[id] = 1;
+    }
+    pool.ids[string_view(pool.strings[id])] = id;
+    return id;
+}
+
+void release_string (StringPool &pool, uint32_t id)
+{
+    if(--pool.uses[id] > 0)
+    {
+	return;
+    }
+    pool.ids.erase(string_view(pool.strings[id]));
+    string().swap(pool.strings[id]);
+    pool.free_ids.push_back(id);
+    return;
+}
+
+//*********************************************************************
+// Function:  open_pages
+// Purpose:   to keep a shard's records in a page file
+//
+// Details:   The page file is a temporary file, deleted when the
+//            program ends. Only the given number of its pages are
+//            held in memory at once; see fetch_page. The shard must
+//            be empty.
+// Inputs:    shard - the shard
+//            frames - the pages to hold in memory
+// Outputs:   shard - paged
+//            returns false if no page file could be made
+//
+//*********************************************************************
+
+bool open_pages (Shard &shard, size_t frames)
+{
+    unique_ptr<PagePool> pages(new PagePool());
+    FILE *spill = tmpfile();
+
+    if(spill == NULL)
+    {
+	return false;
+    }
+    pages->file = dup(fileno(spill));    // keeps the deleted file open
+    fclose(spill);
+    if(pages->file < 0)
+    {
+	return false;
+    }
+    pages->slots = 0;
+    pages->hand = 0;
+    pages->frames.resize(max(frames, PAGE_POOL_MIN_FRAMES));
+    pages->memory.resize(pages->frames.size() * PAGE_SIZE);
+    for(size_t frame = 0; frame < pages->frames.size(); frame++)
+    {
+	pages->frames[frame].page = NO_PAGE;
+	pages->frames[frame].referenced = false;
+	pages->frames[frame].dirty = false;
+    }
+    shard.pages = move(pages);
+    return true;
+}
+
+//*********************************************************************
+// Function:  clear_pages
+// Purpose:   to empty a shard's page file
+//
+// Inputs:    pages - the shard's pages
+// Outputs:   pages - with no slots, and nothing held in memory
+//
+//*********************************************************************
+
+void clear_pages (PagePool &pages)
+{
+    lock_guard<mutex> lock(pages.guard);
+
+    for(size_t frame = 0; frame < pages.frames.size(); frame++)
+    {
+	pages.frames[frame].page = NO_PAGE;
+	pages.frames[frame].referenced = false;
+	pages.frames[frame].dirty = false;
+    }
+    pages.resident.clear();
+    pages.slots = 0;
+    pages.hand = 0;
+    if(ftruncate(pages.file, 0) != 0)
+    {
+	page_failed("truncate");
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  page_failed
+// Purpose:   to stop the program when the page file cannot be used
+//
+// Details:   records would be lost otherwise, so there is nothing
+//            better to do.
+// Inputs:    action - what was being done
+//
+//*********************************************************************
+
+void page_failed (const char action[])
+{
+    cerr << "unable to " << action << " the page file: " << strerror(errno)
+	 << endl;
+    exit(1);
+}
+
+//*********************************************************************
+// Function:  fetch_page
+// Purpose:   to bring a page into memory
+//
+// Details:   CLOCK eviction, an approximation of least recently used
+//            that costs nothing on a hit: each frame has a bit set
+//            whenever its page is used. To make room, a hand sweeps
+//            the frames, clearing the bits it finds set, and takes
+//            the first frame whose bit is already clear - one whose
+//            page has not been used since the hand last came by. That
+//            page is written back first if it was changed. A page
+//            past the end of the file reads as zeros. The caller must
+//            hold the pool's guard.
+// Inputs:    pages - the shard's pages
+//            page - the page wanted
+// Outputs:   pages - with the page in a frame
+//            returns the page's bytes
+//
+//*********************************************************************
+
+char *fetch_page (PagePool &pages, int page)
+{
+    unordered_map<int, size_t>::const_iterator found =
+	pages.resident.find(page);
+    size_t frame;
+
+    if(found != pages.resident.end())
+    {
+	count_metric(CNT_PAGE_HIT);
+	pages.frames[found->second].referenced = true;
+	return &pages.memory[found->second * PAGE_SIZE];
+    }
+
+    count_metric(CNT_PAGE_MISS);
+    while(pages.frames[pages.hand].referenced)
+    {
+	pages.frames[pages.hand].referenced = false;
+	pages.hand = (pages.hand + 1) % pages.frames.size();
+    }
+    frame = pages.hand;
+    pages.hand = (pages.hand + 1) % pages.frames.size();
+
+    PageFrame &victim = pages.frames[frame];
+    char *data = &pages.memory[frame * PAGE_SIZE];
+
+    if(victim.page != NO_PAGE)
+    {
+	if(victim.dirty)
+	{
+	    count_metric(CNT_PAGE_WRITE);
+	    if(pwrite(pages.file, data, PAGE_SIZE,
+		      (off_t)victim.page * PAGE_SIZE) != (ssize_t)PAGE_SIZE)
+	    {
+		page_failed("write");
+	    }
+	}
+	pages.resident.erase(victim.page);
+    }
+
+    ssize_t got = pread(pages.file, data, PAGE_SIZE, (off_t)page * PAGE_SIZE);
+    if(got < 0)
+    {
+	page_failed("read");
+    }
+    memset(data + got, '\0', PAGE_SIZE - got);
+    victim.page = page;
+    victim.referenced = true;
+    victim.dirty = false;
+    pages.resident[page] = frame;
+    return data;
+}
+
+//*********************************************************************
+// Function:  read_paged, write_paged
+// Purpose:   to copy a record out of its page, or into it
+//
+// Details:   The record is copied while the pool's guard is held, so
+//            no other reader of the shard can evict the page part way
+//            through. Writing may leave the title as it was. The
+//            caller must hold the shard lock: either kind to read,
+//            the write lock to write.
+// Inputs:    shard - a paged shard
+//            slot - the record's slot
+//            paged - the record to write
+//            with_title - whether to write its title too
+// Outputs:   paged - the record read
+//
+//*********************************************************************
+
+void read_paged (const Shard &shard, int slot, PagedRecord &paged)
+{
+    PagePool &pages = *shard.pages;
+    lock_guard<mutex> lock(pages.guard);
+    const char *data = fetch_page(pages, slot / SLOTS_PER_PAGE);
+
+    memcpy(&paged, data + slot % SLOTS_PER_PAGE * sizeof(PagedRecord),
+	   sizeof(PagedRecord));
+    return;
+}
+
+void write_paged (Shard &shard, int slot, const PagedRecord &paged,
+                  bool with_title)
+{
+    PagePool &pages = *shard.pages;
+    lock_guard<mutex> lock(pages.guard);
+    char *data = fetch_page(pages, slot / SLOTS_PER_PAGE);
+
+    memcpy(data + slot % SLOTS_PER_PAGE * sizeof(PagedRecord), &paged,
+	   with_title ? sizeof(PagedRecord) : sizeof(Record));
+    pages.frames[pages.resident[slot / SLOTS_PER_PAGE]].dirty = true;
+    return;
+}
+
+//*********************************************************************
+// Function:  record_at, store_record
+// Purpose:   to read or overwrite the packed fields of a record
+//
+// Details:   from the slot vector, or the page file of a paged shard.
+//            The title is left as it is. The caller must hold the
+//            shard lock: either kind to read, the write lock to
+//            write.
+// Inputs:    shard - the shard
+//            slot - the record's slot
+//            record - the new fields
+// Outputs:   returns the record's fields
+//
+//*********************************************************************
+
+Record record_at (const Shard &shard, int slot)
+{
+    PagedRecord paged;
+
+    if(!shard.pages)
+    {
+	return shard.book[slot];
+    }
+    read_paged(shard, slot, paged);
+    return paged.record;
+}
+
+void store_record (Shard &shard, int slot, const Record &record)
+{
+    PagedRecord paged;
+
+    if(!shard.pages)
+    {
+	shard.book[slot] = record;
+	return;
+    }
+    paged.record = record;
+    write_paged(shard, slot, paged, false);
+    return;
+}
+
+//*********************************************************************
+// Function:  author_of
+// Purpose:   to give the author_name of a stored record
+//
+// Details:   the pooled string, which the name index keys refer to.
+// Inputs:    shard - the shard
+//            slot - the record's slot
+// Outputs:   returns the author_name
+//
+//*********************************************************************
+
+const string &author_of (const Shard &shard, int slot)
+{
+    return shard.strings.strings[record_at(shard, slot).author_id];
+}
+
+//*********************************************************************
+// Function:  entry_at
+// Purpose:   to unpack a stored record into an Entry
+//
+// Details:   The caller must hold the shard lock (either kind).
+// Inputs:    shard - the shard
+//            slot - the record's slot
+// Outputs:   returns the record with every field filled in
+//
+//*********************************************************************
+
+Entry entry_at (const Shard &shard, int slot)
+{
+    PagedRecord paged;
+    const char *title = paged.title;
+
+    if(shard.pages)
+    {
+	read_paged(shard, slot, paged);
+    }
+    else
+    {
+	paged.record = shard.book[slot];
+	title = shard.titles.data() + paged.record.title_offset;
+    }
+
+    const Record &record = paged.record;
+    const string &author = shard.strings.strings[record.author_id];
+    const string &comment = shard.strings.strings[record.comment_id];
+    Entry entry;
+
+    memcpy(entry.author_name, author.c_str(), author.size() + 1);
+    entry.author_initial = record.author_initial;
+    entry.inventory_number = record.inventory_number;
+    memcpy(entry.location, record.location, MAX_LOCATION);
+    entry.location[MAX_LOCATION] = '\0';
+    memcpy(entry.title, title, record.title_length);
+    entry.title[record.title_length] = '\0';
+    memcpy(entry.comment, comment.c_str(), comment.size() + 1);
+    entry.quantity = record.quantity;
+    return entry;
+}
+
+//*********************************************************************
+// Function:  pack_record
+// Purpose:   to set every field of a stored record from an Entry
+//
+// Details:   the author_name and comment are interned, and if the
+//            slot held a record its strings are released. The title is
+//            appended to the title arena; if the record already had
+//            a title, its old bytes are counted as dead, and the
+//            arena is compacted once dead bytes are both more than
+//            TITLE_COMPACT_MIN and more than half of it. A paged
+//            shard keeps the title in the record's page instead. The
+//            caller must hold the write lock.
+// Inputs:    shard - the shard
+//            slot - the record's slot
+//            entry - the new contents
+//            had_title - whether the slot holds a live record
+// Outputs:   shard - with the record stored
+//
+//*********************************************************************
+
+void pack_record (Shard &shard, int slot, const Entry &entry,
+                  bool had_title)
+{
+    PagedRecord packed;
+    Record &record = packed.record;
+    size_t title_length = strlen(entry.title);
+
+    record.author_id = intern_string(shard.strings, entry.author_name);
+    record.comment_id = intern_string(shard.strings, entry.comment);
+    if(had_title)
+    {
+	Record old = record_at(shard, slot);
+
+	release_string(shard.strings, old.author_id);
+	release_string(shard.strings, old.comment_id);
+    }
+    record.inventory_number = entry.inventory_number;
+    record.quantity = entry.quantity;
+    memset(record.location, '\0', MAX_LOCATION);
+    memcpy(record.location, entry.location, strlen(entry.location));
+    record.author_initial = entry.author_initial;
+    record.title_length = title_length;
+    if(shard.pages)
+    {
+	record.title_offset = 0;
+	memset(packed.title, '\0', MAX_TITLE);
+	memcpy(packed.title, entry.title, title_length);
+	write_paged(shard, slot, packed, true);
+	return;
+    }
+
+    size_t old_length = shard.book[slot].title_length;
+
+    record.title_offset = shard.titles.size();
+    shard.book[slot] = record;
+    shard.titles.append(entry.title, title_length);
+    if(had_title)
+    {
+	retire_title(shard, old_length);
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  retire_title
+// Purpose:   to account for a title no record uses any more
+//
+// Details:   when enough of the title arena is dead, every live
+//            record's title is copied into a fresh arena in slot
+//            order and the old one is released. A paged shard has
+//            no arena, and nothing to do. The caller must hold the
+//            write lock.
+// Inputs:    shard - the shard
+//            length - the length of the dead title
+// Outputs:   shard - with the dead bytes counted, and the arena
+//                        compacted if it was due
+//
+//*********************************************************************
+
+void retire_title (Shard &shard, size_t length)
+{
+    string packed;
+
+    if(shard.pages)
+    {
+	return;
+    }
+
+    shard.dead_title_bytes += length;
+    if(shard.dead_title_bytes < TITLE_COMPACT_MIN ||
+       shard.dead_title_bytes * 2 < shard.titles.size())
+    {
+	return;
+    }
+
+    TimedOp timer(MET_COMPACT);
+    count_metric(CNT_COMPACTED_BYTES, shard.dead_title_bytes);
+    packed.reserve(shard.titles.size() - shard.dead_title_bytes);
+    for(NUMBER_INDEX::const_iterator live = shard.by_number.begin();
+	live != shard.by_number.end(); live++)
+    {
+	Record &record = shard.book[live->second];
+	uint32_t offset = packed.size();
+
+	packed.append(shard.titles, record.title_offset,
+		      record.title_length);
+	record.title_offset = offset;
+    }
+    shard.titles.swap(packed);
+    shard.dead_title_bytes = 0;
+    return;
+}
+
+//*********************************************************************
+// Function:  split_words
+// Purpose:   to break text into the words the text index holds
+//
+// Details:   a word is a run of letters and digits, folded to lower
+//            case. Each distinct word is listed once.
+// Inputs:    text - the text to split
+// Outputs:   words - the distinct words, appended
+//
+//*********************************************************************
+
+void split_words (const char text[], vector<string> &words)
+{
+    string word;
+
+    for(const char *next = text; ; next++)
+    {
+	if(*next != '\0' && isalnum((unsigned char)*next))
+	{
+	    word += (char)tolower((unsigned char)*next);
+	}
+	else
+	{
+	    if(!word.empty() &&
+	       find(words.begin(), words.end(), word) == words.end())
+	    {
+		words.push_back(word);
+	    }
+	    word.clear();
+	    if(*next == '\0')
+	    {
+		break;
+	    }
+	}
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  entry_words
+// Purpose:   to list the searchable words of an entry
+//
+// Inputs:    entry - the record
+// Outputs:   words - the distinct words of its author name, title and
+//                    comment
+//
+//*********************************************************************
+
+void entry_words (const Entry &entry, vector<string> &words)
+{
+    words.clear();
+    split_words(entry.author_name, words);
+    split_words(entry.title, words);
+    split_words(entry.comment, words);
+    return;
+}
+
+//*********************************************************************
+// Function:  word_grams
+// Purpose:   to list the trigrams of a word
+//
+// Details:   the word is padded with GRAM_PAD at both ends, so that
+//            "dune" gives $du, dun, une and ne$. If whole is false
+//            the trailing pad is left off, giving only the grams every
+//            word beginning with this one also has.
+// Inputs:    word - the word
+//            whole - whether to include the grams of the word's end
+// Outputs:   grams - the trigrams
+//
+//*********************************************************************
+
+void word_grams (const string &word, bool whole, vector<string> &grams)
+{
+    string padded = GRAM_PAD + word;
+
+    if(whole)
+    {
+	padded += GRAM_PAD;
+    }
+    grams.clear();
+    for(size_t start = 0; start + GRAM_LENGTH <= padded.size(); start++)
+    {
+	grams.push_back(padded.substr(start, GRAM_LENGTH));
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  index_text
+// Purpose:   to enter a record's words in the text index
+//
+// Details:   A word seen for the first time is given an id and its
+//            trigrams are entered in the gram index; after that only
+//            the word's posting list changes. The caller must hold the
+//            write lock.
+// Inputs:    text - the text index
+//            entry - the record
+//            slot - the record's slot
+// Outputs:   text - with the record's slot posted under its words
+//
+//*********************************************************************
+
+void index_text (TextIndex &text, const Entry &entry, int slot)
+{
+    vector<string> words;
+    vector<string> grams;
+
+    entry_words(entry, words);
+    for(size_t word = 0; word < words.size(); word++)
+    {
+	unordered_map<string, int>::iterator known =
+	    text.word_ids.find(words[word]);
+	int id;
+
+	if(known != text.word_ids.end())
+	{
+	    id = known->second;
+	}
+	else
+	{
+	    id = text.words.size();
+	    text.word_ids[words[word]] = id;
+	    text.words.push_back(words[word]);
+	    text.postings.push_back(Posting());
+	    word_grams(words[word], true, grams);
+	    for(size_t gram = 0; gram < grams.size(); gram++)
+	    {
+		text.grams[grams[gram]].push_back(id);
+	    }
+	}
+	post_slot(text.postings[id], slot);
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  unindex_text
+// Purpose:   to take a record's words out of the text index
+//
+// Details:   Words stay in the dictionary when their last record goes,
+//            so that a later record with the same word reuses its id.
+//            The caller must hold the write lock.
+// Inputs:    text - the text index
+//            entry - the record, as it was indexed
+//            slot - the record's slot
+// Outputs:   text - with the slot no longer posted
+//
+//*********************************************************************
+
+void unindex_text (TextIndex &text, const Entry &entry, int slot)
+{
+    vector<string> words;
+
+    entry_words(entry, words);
+    for(size_t word = 0; word < words.size(); word++)
+    {
+	unordered_map<string, int>::iterator known =
+	    text.word_ids.find(words[word]);
+
+	if(known != text.word_ids.end())
+	{
+	    unpost_slot(text.postings[known->second], slot);
+	}
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  posted_before
+// Purpose:   to order the entries of a posting list
+//
+// Details:   a dropped slot is kept as ~slot, in its slot's place.
+// Inputs:    posted - an entry of the list
+//            slot - the slot being looked for
+// Outputs:   returns true if the entry is of a lower slot
+//
+//*********************************************************************
+
+bool posted_before (int posted, int slot)
+{
+    return (posted < 0 ? ~posted : posted) < slot;
+}
+
+//*********************************************************************
+// Function:  post_slot
+// Purpose:   to add a slot to a word's posting list
+//
+// Details:   A record almost always takes a new slot, above all the
+//            others, and is appended. A slot of a record dropped from
+//            the list is marked live again. Any other goes in added,
+//            so that a freed slot reused low in a long list does not
+//            move the list's tail; added is merged into slots once it
+//            is more than 1 in POSTING_ADDED_SHARE of the list.
+// Inputs:    posting - the word's posting list
+//            slot - the record's slot
+// Outputs:   posting - with the slot posted
+//
+//*********************************************************************
+
+void post_slot (Posting &posting, int slot)
+{
+    vector<int> &slots = posting.slots;
+    vector<int> &added = posting.added;
+
+    if(slots.empty() || posted_before(slots.back(), slot))
+    {
+	slots.push_back(slot);
+	return;
+    }
+
+    vector<int>::iterator place =
+	lower_bound(slots.begin(), slots.end(), slot, posted_before);
+    if(*place == slot)
+    {
+	return;
+    }
+    if(*place == ~slot)
+    {
+	*place = slot;
+	posting.dead--;
+	return;
+    }
+    place = lower_bound(added.begin(), added.end(), slot);
+    if(place != added.end() && *place == slot)
+    {
+	return;
+    }
+    added.insert(place, slot);
+    if(added.size() < POSTING_ADDED_MIN ||
+       added.size() * POSTING_ADDED_SHARE < slots.size())
+    {
+	return;
+    }
+    slots.erase(remove_if(slots.begin(), slots.end(),
+			  [](int posted) { return posted < 0; }),
+		slots.end());
+    posting.dead = 0;
+    slots.insert(slots.end(), added.begin(), added.end());
+    inplace_merge(slots.begin(), slots.end() - added.size(), slots.end());
+    added.clear();
+    return;
+}
+
+//*********************************************************************
+// Function:  unpost_slot
+// Purpose:   to drop a slot from a word's posting list
+//
+// Details:   The slot is marked dropped rather than taken out, and the
+//            list compacted once 1 slot in POSTING_DEAD_SHARE is, so
+//            that dropping costs O(log n) and the compaction O(1)
+//            spread over the drops.
+// Inputs:    posting - the word's posting list
+//            slot - the record's slot
+// Outputs:   posting - without the slot
+//
+//*********************************************************************
+
+void unpost_slot (Posting &posting, int slot)
+{
+    vector<int> &slots = posting.slots;
+    vector<int> &added = posting.added;
+    vector<int>::iterator place =
+	lower_bound(added.begin(), added.end(), slot);
+
+    if(place != added.end() && *place == slot)
+    {
+	added.erase(place);
+	return;
+    }
+    place = lower_bound(slots.begin(), slots.end(), slot, posted_before);
+    if(place == slots.end() || *place != slot)
+    {
+	return;
+    }
+    *place = ~slot;
+    posting.dead++;
+    if(posting.dead * POSTING_DEAD_SHARE > slots.size())
+    {
+	slots.erase(remove_if(slots.begin(), slots.end(),
+			      [](int posted) { return posted < 0; }),
+		    slots.end());
+	posting.dead = 0;
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  edit_distance
+// Purpose:   to count the single character insertions, deletions and
+//            substitutions that turn one word into another
+//
+// Details:   the usual dynamic programme, kept to two rows, which gives
+//            up as soon as every value in a row is over the limit.
+// Inputs:    from, to - the words
+//            limit - the largest distance of interest
+// Outputs:   returns the distance, or limit + 1 if it is over limit
+//
+//*********************************************************************
+
+int edit_distance (const string &from, const string &to, int limit)
+{
+    int from_length = from.size();
+    int to_length = to.size();
+    vector<int> previous(to_length + 1);
+    vector<int> current(to_length + 1);
+
+    if(abs(from_length - to_length) > limit)
+    {
+	return limit + 1;
+    }
+    for(int column = 0; column <= to_length; column++)
+    {
+	previous[column] = column;
+    }
+    for(int row = 1; row <= from_length; row++)
+    {
+	int best;
+
+	current[0] = row;
+	best = row;
+	for(int column = 1; column <= to_length; column++)
+	{
+	    int cost = (from[row - 1] == to[column - 1]) ? 0 : 1;
+
+	    current[column] = min(min(previous[column] + 1,
+				      current[column - 1] + 1),
+				  previous[column - 1] + cost);
+	    best = min(best, current[column]);
+	}
+	if(best > limit)
+	{
+	    return limit + 1;
+	}
+	previous.swap(current);
+    }
+    return min(previous[to_length], limit + 1);
+}
+
+//*********************************************************************
+// Function:  match_words
+// Purpose:   to find the dictionary words matching a search word
+//
+// Details:   A word scores MATCH_EXACT if it is the search word,
+//            MATCH_PREFIX if it starts with it, or MATCH_FUZZY if it is
+//            within the allowed edit distance (none below
+//            FUZZY_ONE_LENGTH letters, one below FUZZY_TWO_LENGTH, and
+//            two from then on).
+//
+//            Only words sharing enough trigrams with the search word
+//            are compared with it: a word beginning with the search
+//            word has all of its grams but the last, and as an edit
+//            can spoil at most GRAM_LENGTH grams, a word within
+//            distance d has all but GRAM_LENGTH * d of them. The fuzzy
+//            lengths are chosen so that this is always at least one
+//            gram. A word needing k of the search word's n distinct
+//            grams is in at least one of the n - k + 1 with the
+//            fewest words, so only those gram lists are walked; the
+//            rest, the common grams, are only probed for the words
+//            found. Search words shorter than GRAM_LENGTH - 1 letters
+//            are only matched exactly.
+// Inputs:    text - the text index
+//            wanted - the search word
+// Outputs:   matched - the matching words' scores and ids, best first
+//
+//*********************************************************************
+
+void match_words (const TextIndex &text, const string &wanted,
+                  vector<pair<int, int> > &matched)
+{
+    static const vector<int> no_words;
+    int length = wanted.size();
+    int distance = (length < FUZZY_ONE_LENGTH) ? 0 :
+		   (length < FUZZY_TWO_LENGTH) ? 1 : 2;
+    vector<string> grams;
+    vector<const vector<int> *> lists;     // word ids of each gram
+    vector<int> candidates;
+
+    matched.clear();
+    if(length < GRAM_LENGTH - 1)
+    {
+	unordered_map<string, int>::const_iterator found =
+	    text.word_ids.find(wanted);
+	if(found != text.word_ids.end())
+	{
+	    matched.push_back(pair<int, int>(MATCH_EXACT, found->second));
+	}
+	return;
+    }
+
+    word_grams(wanted, true, grams);
+    int needed = min((int)grams.size() - 1,
+		     (int)grams.size() - GRAM_LENGTH * distance);
+    sort(grams.begin(), grams.end());
+    needed -= grams.end() - unique(grams.begin(), grams.end());
+    grams.erase(unique(grams.begin(), grams.end()), grams.end());
+    needed = max(needed, 1);               // a repeated gram is shared once
+    for(size_t gram = 0; gram < grams.size(); gram++)
+    {
+	unordered_map<string, vector<int> >::const_iterator found =
+	    text.grams.find(grams[gram]);
+	lists.push_back(found == text.grams.end() ? &no_words :
+			&found->second);
+    }
+    sort(lists.begin(), lists.end(),
+	 [](const vector<int> *a, const vector<int> *b)
+	 {
+	     return a->size() < b->size();
+	 });
+
+    size_t walked = lists.size() - needed + 1;
+    for(size_t list = 0; list < walked; list++)
+    {
+	const vector<int> &ids = *lists[list];
+	for(size_t word = 0; word < ids.size(); word++)
+	{
+	    if(word == 0 || ids[word] != ids[word - 1])
+	    {
+		candidates.push_back(ids[word]);
+	    }
+	}
+    }
+    sort(candidates.begin(), candidates.end());
+    for(size_t first = 0, next; first < candidates.size(); first = next)
+    {
+	int id = candidates[first];
+	int shared;
+
+	for(next = first; next < candidates.size() &&
+		candidates[next] == id; next++)
+	{
+	}
+	shared = next - first;
+	for(size_t list = walked; list < lists.size() && shared < needed;
+	    list++)
+	{
+	    if(binary_search(lists[list]->begin(), lists[list]->end(), id))
+	    {
+		shared++;
+	    }
+	}
+	if(shared < needed)
+	{
+	    continue;
+	}
+
+	const string &word = text.words[id];
+	if(word == wanted)
+	{
+	    matched.push_back(pair<int, int>(MATCH_EXACT, id));
+	}
+	else if(word.compare(0, length, wanted) == 0)
+	{
+	    matched.push_back(pair<int, int>(MATCH_PREFIX, id));
+	}
+	else if(edit_distance(wanted, word, distance) <= distance)
+	{
+	    matched.push_back(pair<int, int>(MATCH_FUZZY, id));
+	}
+    }
+    sort(matched.begin(), matched.end(), greater<pair<int, int> >());
+    return;
+}
+
+//*********************************************************************
+// Function:  search_text
+// Purpose:   to find the records best matching a list of search words
+//
+// Details:   Each search word is looked up on its own (see
+//            match_words), and a record takes the best score of its
+//            words for it. The scores of all the search words are
+//            added and the top results are given in score order, then
+//            in key field order.
+//
+//            The scores are kept in search_marks, by slot, and the
+//            matched words' postings walked best word first, so a
+//            record is scored once per search word without a lookup.
+//            Fewer than limit records score above the lowest score
+//            that makes the results; those are sorted, and the rest
+//            of the results are the first records of that score in
+//            key field order. When records of that score are common,
+//            they are found by walking the name index from the start
+//            and stopping once enough are found, rather than by
+//            sorting them all.
+//
+//            The caller must hold the read lock.
+// Inputs:    shard - the shard
+//            query - the search words
+//            limit - the most results wanted
+// Outputs:   hits - the matching records' scores and slots, best
+//                   first
+//
+//*********************************************************************
+
+void search_text (const Shard &shard, const char query[],
+                  size_t limit, vector<pair<int, int> > &hits)
+{
+    const TextIndex &text = shard.text;
+    vector<uint32_t> &marks = search_marks;
+    vector<string> terms;
+    vector<pair<int, int> > matched;       // (score, word id)
+    vector<int> touched;                   // slots with a score
+    size_t slots = shard.pages ? shard.pages->slots : shard.book.size();
+
+    hits.clear();
+    split_words(query, terms);
+    terms.resize(min(terms.size(), MAX_SEARCH_WORDS));
+    if(marks.size() < slots)
+    {
+	marks.resize(slots);
+    }
+    for(size_t term = 0; term < terms.size(); term++)
+    {
+	uint32_t scored = (term + 1) << 16;
+
+	match_words(text, terms[term], matched);
+	for(size_t word = 0; word < matched.size(); word++)
+	{
+	    const Posting &posting = text.postings[matched[word].second];
+	    const vector<int> *parts[] = { &posting.slots, &posting.added };
+
+	    for(size_t part = 0; part < 2; part++)
+	    {
+		const vector<int> &posted = *parts[part];
+
+		for(size_t entry = 0; entry < posted.size(); entry++)
+		{
+		    int slot = posted[entry];
+
+		    if(slot < 0 || (marks[slot] & ~0xFFFFu) == scored)
+		    {
+			continue;
+		    }
+		    if(marks[slot] == 0)
+		    {
+			touched.push_back(slot);
+		    }
+		    marks[slot] = scored |
+			((marks[slot] & 0xFFFF) + matched[word].first);
+		}
+	    }
+	}
+    }
+
+    vector<size_t> counts(MATCH_EXACT * terms.size() + 1);
+    for(size_t hit = 0; hit < touched.size(); hit++)
+    {
+	counts[marks[touched[hit]] & 0xFFFF]++;
+    }
+
+    size_t above = 0;                      // records scoring over lowest
+    int lowest = counts.size() - 1;
+    while(lowest > 0 && above + counts[lowest] < limit)
+    {
+	above += counts[lowest--];
+    }
+
+    size_t ties = (lowest > 0) ? counts[lowest] : 0;
+    size_t wanted = min(limit - above, ties);
+    bool walk = wanted < ties &&
+		wanted * shard.by_name.size() <= ties * ties;
+    vector<pair<int, int> > ranked;        // (score, slot)
+    for(size_t hit = 0; hit < touched.size(); hit++)
+    {
+	int score = marks[touched[hit]] & 0xFFFF;
+
+	if(score > lowest || (score == lowest && lowest > 0 && !walk))
+	{
+	    ranked.push_back(pair<int, int>(score, touched[hit]));
+	}
+    }
+    auto before = [&shard](const pair<int, int> &a, const pair<int, int> &b)
+		  {
+		      if(a.first != b.first)
+		      {
+			  return a.first > b.first;
+		      }
+		      Record left = record_at(shard, a.second);
+		      Record right = record_at(shard, b.second);
+		      if(left.author_id != right.author_id)
+		      {
+			  return author_of(shard, a.second) <
+				 author_of(shard, b.second);
+		      }
+		      return left.inventory_number < right.inventory_number;
+		  };
+    if(walk)
+    {
+	sort(ranked.begin(), ranked.end(), before);
+	for(NAME_INDEX::const_iterator record = shard.by_name.begin();
+	    ranked.size() < above + wanted; record++)
+	{
+	    if((int)(marks[record->second] & 0xFFFF) == lowest)
+	    {
+		ranked.push_back(pair<int, int>(lowest, record->second));
+	    }
+	}
+    }
+    else
+    {
+	partial_sort(ranked.begin(), ranked.begin() + above + wanted,
+		     ranked.end(), before);
+	ranked.resize(above + wanted);
+    }
+
+    for(size_t hit = 0; hit < touched.size(); hit++)
+    {
+	marks[touched[hit]] = 0;
+    }
+    hits.swap(ranked);
+    return;
+}
+
+//*********************************************************************
+// Function:  search_entries
+// Purpose:   to search titles, comments and author names for words
+//            the user enters
+//
+// Details:   reads a line of search words and lists up to
+//            MAX_SEARCH_RESULTS of the best matches. See query_text.
+// Inputs:    inventory - the database
+//
+//*********************************************************************
+
+void search_entries (const Inventory &inventory)
+{
+    string query;
+    vector<Entry> entries;
+    OutputBuffer output;
+
+    cout << "Enter words from the title, comment or author name: ";
+    getline(cin, query);
+
+    start_output(output, cout);
+    query_text(inventory, query.c_str(), MAX_SEARCH_RESULTS, entries);
+    for(size_t hit = 0; hit < entries.size(); hit++)
+    {
+	put_entry(output, entries[hit], FMT_REPORT, hit + 1);
+    }
+    flush_output(output);
+    if(entries.empty())
+    {
+	cout << endl << "No entries match " << query << "." << endl;
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  location_key
+// Purpose:   to make the location index key of an entry
+//
+// Details:   a location is a shelf letter, a dash and a bin number,
+//            as in h-03 or m-9. The shelf letter is folded to lower
+//            case and the bin is compared as a number, so m-9 comes
+//            before m-10. A location without a bin number after the
+//            dash is given bin NO_BIN, which puts it first on its
+//            shelf.
+// Inputs:    entry - the record
+// Outputs:   returns (shelf, bin, inventory number)
+//
+//*********************************************************************
+
+LOCATION_KEY location_key (const Entry &entry)
+{
+    const char *dash = strchr(entry.location, '-');
+    char *end;
+    long bin = NO_BIN;
+
+    if(dash != NULL && isdigit((unsigned char)dash[1]))
+    {
+	bin = strtol(dash + 1, &end, 10);
+	if(*end != '\0')
+	{
+	    bin = NO_BIN;
+	}
+    }
+    return LOCATION_KEY((char)tolower((unsigned char)entry.location[0]),
+			(int)bin, entry.inventory_number);
+}
+
+//*********************************************************************
+// Function:  parse_bin_range
+// Purpose:   to read the shelf and bins a location query asks for
+//
+// Details:   accepts a single bin written as a location ("h-03"), a
+//            shelf letter alone ("g") for the whole shelf, or a shelf
+//            letter and a first and last bin ("g 70 79"). Anything
+//            after the query, such as a third bin, refuses it.
+// Inputs:    text - the query
+// Outputs:   shelf - the shelf letter, in lower case
+//            first, last - the bins wanted, inclusive
+//            returns false if the query is none of these
+//
+//*********************************************************************
+
+bool parse_bin_range (const char text[], char &shelf, int &first, int &last)
+{
+    char word[MAX_LOCATION+1];
+    int consumed = 0;
+
+    if(sscanf(text, " %4s %n", word, &consumed) != 1)
+    {
+	return false;
+    }
+    shelf = (char)tolower((unsigned char)word[0]);
+    if(word[1] == '-')
+    {
+	Entry probe;
+
+	strcpy(probe.location, word);
+	probe.inventory_number = 0;
+	first = last = get<1>(location_key(probe));
+	return first != NO_BIN && text[consumed] == '\0';
+    }
+    if(word[1] != '\0')
+    {
+	return false;
+    }
+    first = NO_BIN;
+    last = INT_MAX;
+    if(text[consumed] == '\0')
+    {
+	return true;
+    }
+    text += consumed;
+    return next_number(text, first) && next_number(text, last) &&
+	   *text == '\0' && first <= last;
+}
+
+//*********************************************************************
+// Function:  find_by_location
+// Purpose:   to list the records in a range of bins on one shelf
+//
+// Details:   a range scan of the location index, so the records come
+//            out in walk order - by bin, then by inventory number
+//            within a bin - and only the records in range are looked
+//            at. The caller must hold the read lock.
+// Inputs:    shard - the shard
+//            shelf - the shelf letter, in lower case
+//            first, last - the bins wanted, inclusive
+//            after - the key to carry on after, or NULL to start at
+//                    the first bin
+//            most - the most records wanted
+// Outputs:   slots - the slots of the records found, appended
+//
+//*********************************************************************
+
+void find_by_location (const Shard &shard, char shelf, int first,
+                       int last, const LOCATION_KEY *after, size_t most,
+                       vector<int> &slots)
+{
+    LOCATION_INDEX::const_iterator loop =
+	(after == NULL) ?
+	    shard.by_location.lower_bound(LOCATION_KEY(shelf, first,
+						       INT_MIN)) :
+	    shard.by_location.upper_bound(*after);
+    LOCATION_INDEX::const_iterator end =
+	shard.by_location.upper_bound(LOCATION_KEY(shelf, last,
+						       INT_MAX));
+
+    for(size_t found = 0; found < most && loop != end; found++, loop++)
+    {
+	slots.push_back(loop->second);
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  list_by_location
+// Purpose:   to display the entries in a bin or range of bins, in the
+//            order a picker walks past them
+//
+// Inputs:    inventory - the database
+//
+//*********************************************************************
+
+void list_by_location (const Inventory &inventory)
+{
+    string query;
+    vector<Entry> entries;
+    char shelf;
+    int first, last;
+    OutputBuffer output;
+
+    cout << "Enter a bin (h-03), a shelf (g), or a shelf and range of "
+	 << "bins (g 70 79): ";
+    getline(cin, query);
+    if(!parse_bin_range(query.c_str(), shelf, first, last))
+    {
+	cout << endl << query << " is not a bin or range of bins." << endl;
+	return;
+    }
+
+    start_output(output, cout);
+    query_by_location(inventory, shelf, first, last, entries);
+    for(size_t hit = 0; hit < entries.size(); hit++)
+    {
+	put_entry(output, entries[hit], FMT_REPORT, hit + 1);
+    }
+    flush_output(output);
+    if(entries.empty())
+    {
+	cout << endl << "Nothing stored at " << query << "." << endl;
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  tally_record
+// Purpose:   to count a record into, or out of, the stock totals
+//
+// Details:   Every change to a record goes through add_record,
+//            drop_record, replace_record or a quantity adjustment,
+//            and each of these takes the record out of its shard's
+//            totals before the change and puts it back after, so the
+//            totals are always those of the records as they stand. A
+//            group whose last record goes is dropped, so a query
+//            costs only as much as there are groups. The caller must
+//            hold the write lock.
+// Inputs:    shard - the shard
+//            slot - the record
+//            sign - 1 to count the record in, -1 to count it out
+// Outputs:   shard - with its totals updated
+//
+//*********************************************************************
+
+void tally_record (Shard &shard, int slot, int sign)
+{
+    Record record = record_at(shard, slot);
+    char shelf = (char)tolower((unsigned char)record.location[0]);
+    int quantity = record.quantity;
+    StockTally *groups[] = { &shard.by_category[record.comment_id],
+			     &shard.by_author[record.author_id],
+			     &shard.by_shelf[shelf] };
+
+    for(int group = 0; group < 3; group++)
+    {
+	StockTally &tally = *groups[group];
+
+	tally.books += sign;
+	if(quantity > 0)
+	{
+	    tally.on_hand += sign * (int64_t)quantity;
+	}
+	else if(quantity == 0)
+	{
+	    tally.out_of_stock += sign;
+	}
+	else
+	{
+	    tally.back_orders += sign;
+	    tally.back_ordered -= sign * (int64_t)quantity;
+	}
+    }
+    if(groups[0]->books == 0)
+    {
+	shard.by_category.erase(record.comment_id);
+    }
+    if(groups[1]->books == 0)
+    {
+	shard.by_author.erase(record.author_id);
+    }
+    if(groups[2]->books == 0)
+    {
+	shard.by_shelf.erase(shelf);
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  add_tally
+// Purpose:   to add one set of stock totals to another
+//
+// Inputs:    sum - the totals so far
+//            more - the totals to add
+// Outputs:   sum - with more added
+//
+//*********************************************************************
+
+void add_tally (StockTally &sum, const StockTally &more)
+{
+    sum.books += more.books;
+    sum.on_hand += more.on_hand;
+    sum.out_of_stock += more.out_of_stock;
+    sum.back_orders += more.back_orders;
+    sum.back_ordered += more.back_ordered;
+    return;
+}
+
+//*********************************************************************
+// Function:  view_named
+// Purpose:   to map the name of a grouping of the totals to the view
+//
+// Inputs:    name - category, author, shelf or all
+// Outputs:   view - the grouping
+//            returns false for any other name
+//
+//*********************************************************************
+
+bool view_named (const char name[], StockView &view)
+{
+    const char *names[] = { "category", "author", "shelf", "all" };
+
+    for(int named = VIEW_CATEGORY; named <= VIEW_ALL; named++)
+    {
+	if(strcmp(name, names[named]) == 0)
+	{
+	    view = (StockView)named;
+	    return true;
+	}
+    }
+    return false;
+}
+
+//*********************************************************************
+// Function:  query_totals
+// Purpose:   to read the stock totals of the whole inventory
+//
+// Details:   Nothing is scanned: each shard already has its totals
+//            by comment (the category), by author and by shelf. The
+//            groups of every shard are added together by name, so
+//            all groups cost O(groups x shards), and one named group
+//            a hash lookup in each shard. VIEW_ALL adds up the shelf
+//            groups, since every record is on exactly one shelf. A
+//            record with no location is on shelf "none". Each shard
+//            is read under its own read lock, taken in turn, so a
+//            transaction over several shards may be counted on one
+//            and not yet on another.
+// Inputs:    inventory - the database
+//            view - the grouping wanted
+//            name - the one group wanted, or NULL for every group
+// Outputs:   totals - each group's name and totals, in name order
+//
+//*********************************************************************
+
+void query_totals (const Inventory &inventory, StockView view,
+                   const char name[], map<string, StockTally> &totals)
+{
+    TimedOp timer(MET_TOTALS);
+
+    totals.clear();
+    if(view == VIEW_ALL)
+    {
+	StockTally &sum = totals["all"];
+
+	for(size_t index = 0; index < inventory.shards.size(); index++)
+	{
+	    const Shard &shard = *inventory.shards[index];
+	    READ_LOCK lock(shard.guard);
+
+	    for(unordered_map<char, StockTally>::const_iterator group =
+		    shard.by_shelf.begin(); group != shard.by_shelf.end();
+		group++)
+	    {
+		add_tally(sum, group->second);
+	    }
+	}
+	return;
+    }
+
+    for(size_t index = 0; index < inventory.shards.size(); index++)
+    {
+	const Shard &shard = *inventory.shards[index];
+	READ_LOCK lock(shard.guard);
+
+	if(view == VIEW_SHELF)
+	{
+	    for(unordered_map<char, StockTally>::const_iterator group =
+		    shard.by_shelf.begin(); group != shard.by_shelf.end();
+		group++)
+	    {
+		string shelf = (group->first == '\0') ? string("none")
+						      : string(1, group->first);
+		if(name == NULL || shelf == name)
+		{
+		    add_tally(totals[shelf], group->second);
+		}
+	    }
+	    continue;
+	}
+
+	const unordered_map<uint32_t, StockTally> &groups =
+	    (view == VIEW_CATEGORY) ? shard.by_category : shard.by_author;
+	if(name != NULL)
+	{
+	    unordered_map<string_view, uint32_t>::const_iterator id =
+		shard.strings.ids.find(name);
+	    unordered_map<uint32_t, StockTally>::const_iterator group =
+		(id == shard.strings.ids.end()) ? groups.end()
+						: groups.find(id->second);
+	    if(group != groups.end())
+	    {
+		add_tally(totals[name], group->second);
+	    }
+	    continue;
+	}
+	for(unordered_map<uint32_t, StockTally>::const_iterator group =
+		groups.begin(); group != groups.end(); group++)
+	{
+	    add_tally(totals[shard.strings.strings[group->first]],
+		      group->second);
+	}
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  format_totals
+// Purpose:   to append a group's stock totals as a line of text
+//
+// Details:   the group name, then the number of books, the copies on
+//            hand, the books out of stock, the books back-ordered and
+//            the copies owed on back order, separated by tabs.
+// Inputs:    text - the text so far
+//            name - the group
+//            tally - its totals
+// Outputs:   text - with the line appended
+//
+//*********************************************************************
+
+void format_totals (string &text, const string &name, const StockTally &tally)
+{
+    text += name;
+    text += FIELD_SEP;
+    put_number(text, tally.books);
+    text += FIELD_SEP;
+    put_number(text, tally.on_hand);
+    text += FIELD_SEP;
+    put_number(text, tally.out_of_stock);
+    text += FIELD_SEP;
+    put_number(text, tally.back_orders);
+    text += FIELD_SEP;
+    put_number(text, tally.back_ordered);
+    text += EOLN;
+    return;
+}
+
+//*********************************************************************
+// Function:  show_totals
+// Purpose:   to display stock totals the user asks for
+//
+// Details:   reads a grouping (category, author, shelf or all) and,
+//            optionally, the name of one group, and displays a table
+//            of the totals. See query_totals.
+// Inputs:    inventory - the database
+//
+//*********************************************************************
+
+void show_totals (const Inventory &inventory)
+{
+    string query;
+    char grouping[16];
+    char name[MAX_COMMENT + 1];
+    map<string, StockTally> totals;
+    StockView view;
+    string table;
+    char line[128];
+
+    cout << "Totals by category, author or shelf (add a name for one "
+	 << "group), or all: ";
+    getline(cin, query);
+    int fields = sscanf(query.c_str(), "%15s %24[^\n]", grouping, name);
+    if(fields < 1 || !view_named(grouping, view))
+    {
+	cout << endl << query << " is not category, author, shelf or all."
+	     << endl;
+	return;
+    }
+
+    query_totals(inventory, view, (fields == 2) ? name : NULL, totals);
+    snprintf(line, sizeof(line), "%-24s %10s %12s %12s %12s %12s\n",
+	     grouping, "Books", "On hand", "Out of stock", "Back orders",
+	     "Copies owed");
+    table = line;
+    for(map<string, StockTally>::const_iterator group = totals.begin();
+	group != totals.end(); group++)
+    {
+	snprintf(line, sizeof(line),
+		 "%-24s %10lld %12lld %12lld %12lld %12lld\n",
+		 group->first.c_str(), (long long)group->second.books,
+		 (long long)group->second.on_hand,
+		 (long long)group->second.out_of_stock,
+		 (long long)group->second.back_orders,
+		 (long long)group->second.back_ordered);
+	table += line;
+    }
+    cout << endl << table;
+    if(totals.empty())
+    {
+	cout << endl << "No books in " << query << "." << endl;
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  remove
+// Purpose:   to remove entries the user wishes to remove
+//
+// Details:   looks the inventory number inputted up in the number
+//            index of its shard. If found, the user confirms if it is
+//            the correct entry to be deleted, and it is then dropped.
+//
+//            The entry is fetched under the shard's read lock, which
+//            is released while the user answers. The write lock is
+//            then taken and the entry looked up again, since another
+//            client may have removed it in the meantime.
+// Inputs:    inventory - the database
+// Outputs:   inventory - with a single entry deleted
+//
+//*********************************************************************
+
+void remove (Inventory &inventory)
+{
+    char confirm;
+    int invNum;
+    Entry shown;
+    cout << "Enter the inventory number of the book" <<
+            "record you wish to remove: ";
+    cin >> invNum;
+
+    if(!get_entry(inventory, invNum, shown))
+    {
+	cout << endl << "Record " << invNum << " not found. " << endl;
+	return;
+    }
+
+    write_entry(shown);
+    cout << endl << "Are you sure you wish to delete " <<
+                     "this record? (y/n) ";
+    cin >> confirm;
+    if(confirm != 'y')
+    {
+	cout << endl << "Record NOT Deleted" << endl;
+	return;
+    }
+
+    if(!remove_entry(inventory, invNum))
+    {
+	cout << endl << "Record " << invNum << " was removed by another "
+	     << "client. " << endl;
+	return;
+    }
+    cout << endl << "Record Deleted" << endl;
+    return;
+}
+
+//*********************************************************************
+// Function:  remove_entry
+// Purpose:   to delete a book by inventory number without prompting
+//
+// Details:   takes the write lock of the entry's shard, finds the
+//            entry, drops it and publishes the removal. Used by remove
+//            once the user has confirmed.
+// Inputs:    inventory - the database
+//            inv_num - the inventory number to delete
+// Outputs:   inventory - with the entry deleted
+//            returns whether or not the entry was found
+//
+//*********************************************************************
+
+bool remove_entry (Inventory &inventory, int inv_num)
+{
+    TimedOp timer(MET_REMOVE);
+    Shard &shard = shard_for(inventory, inv_num);
+    WRITE_LOCK lock(shard.guard);
+    int slot = find_entry(shard, inv_num);
+    ChangeEvent removed;
+    if(slot == NO_SLOT)
+    {
+	count_metric(CNT_NUMBER_MISS);
+	return false;
+    }
+    count_metric(CNT_NUMBER_HIT);
+    removed.kind = MUT_REMOVE;
+    removed.entry = entry_at(shard, slot);
+    drop_record(shard, slot);
+    publish_changes(inventory.changes, vector<ChangeEvent>(1, removed));
+    return true;
+}
+
+//*********************************************************************
+// Function:  writefile
+// Purpose:   to save the inventory to a file.
+//
+// Details:   The file name will be read from the user.
+//            Each entry field is written to a separate line of 
+//            the file.
+//
+//            The read locks are taken a chunk of entries at a time
+//            and not held while writing; see for_each_in_order.
+//
+// Inputs:    inventory - the database
+//
+//*********************************************************************
+
+void writefile (const Inventory &store)
+{
+  AUTHOR_STRING filename;
+ 
+  cout << "Enter the name of the inventory file: ";
+  cin >> filename;
+  if (!save_inventory (store, filename))
+  {
+    cout << "Unsuccessful trying to open file " << filename << endl;
+  }
+  return;
+}
+
+//*********************************************************************
+// Function:  save_inventory
+// Purpose:   to save the inventory to a named file.
+//
+// Details:   The non-interactive half of writefile, shared with the
+//            batch and server modes. This is an export in the
+//            inventory file format.
+//
+// Inputs:    inventory - the database
+//            filename - the file to write
+// Outputs:   returns whether or not the file could be written
+//
+//*********************************************************************
+
+bool save_inventory (const Inventory &store, const char filename[])
+{
+  return export_inventory (store, filename, FMT_FILE);
+}
+
+//*********************************************************************
+// Function:  field_named
+// Purpose:   to map a field name used by SET to the field
+//
+// Inputs:    name - author, initial, location, title, comment or
+//                   quantity
+// Outputs:   returns the field, or FLD_NONE for any other name
+//
+//*********************************************************************
+
+EntryField field_named (const char name[])
+{
+    const char *names[] = { "author", "initial", "location", "title",
+                            "comment", "quantity" };
+
+    for(int field = FLD_AUTHOR_NAME; field < FLD_NONE; field++)
+    {
+	if(strcmp(name, names[field]) == 0)
+	{
+	    return (EntryField)field;
+	}
+    }
+    return FLD_NONE;
+}
+
+//*********************************************************************
+// Function:  parse_number
+// Purpose:   to read a whole string as an integer
+//
+// Inputs:    text - the digits, with an optional sign
+// Outputs:   value - the number
+//            returns false if text is empty, has anything after the
+//            number, or is out of range for an int
+//
+//*********************************************************************
+
+bool parse_number (const char text[], int &value)
+{
+    char *end;
+    long number;
+
+    errno = 0;
+    number = strtol(text, &end, 10);
+    if(end == text || *end != '\0' || errno != 0 ||
+       number < INT_MIN || number > INT_MAX)
+    {
+	return false;
+    }
+    value = (int)number;
+    return true;
+}
+
+//*********************************************************************
+// Function:  next_word
+// Purpose:   to read the next word of a command
+//
+// Details:   the word runs to the next blank. The blanks after it are
+//            skipped too, so once the last argument has been read the
+//            caller can check that nothing is left. A word too long
+//            for word is refused rather than cut short.
+// Inputs:    text - the rest of the command
+//            size - the room in word, with its terminator
+// Outputs:   text - past the word and the blanks after it, if read
+//            word - the word
+//            returns false if there is no word or it is too long
+//
+//*********************************************************************
+
+bool next_word (const char *&text, char word[], size_t size)
+{
+    const char *start = text;
+    size_t length;
+
+    while(isspace((unsigned char)*start))
+    {
+	start++;
+    }
+    length = strcspn(start, " \t\r\n");
+    if(length == 0 || length >= size)
+    {
+	return false;
+    }
+    memcpy(word, start, length);
+    word[length] = '\0';
+    text = start + length;
+    while(isspace((unsigned char)*text))
+    {
+	text++;
+    }
+    return true;
+}
+
+//*********************************************************************
+// Function:  next_number
+// Purpose:   to read the next word of a command as an integer
+//
+// Details:   the word must be a whole number, as for parse_number, so
+//            "12x" is refused rather than read as 12. See next_word.
+// Inputs:    text - the rest of the command
+// Outputs:   text - past the word and the blanks after it, if read
+//            value - the number
+//            returns false if there is no word or it is not a number
+//
+//*********************************************************************
+
+bool next_number (const char *&text, int &value)
+{
+    const char *rest = text;
+    char word[16];
+
+    if(!next_word(rest, word, sizeof(word)) || !parse_number(word, value))
+    {
+	return false;
+    }
+    text = rest;
+    return true;
+}
+
+//*********************************************************************
+// Function:  next_sequence
+// Purpose:   to read the next word of a command as a change's sequence
+//            number
+//
+// Details:   as next_number, but for an unsigned 64 bit number; a sign
+//            is refused, so "-1" is not taken as the largest number.
+// Inputs:    text - the rest of the command
+// Outputs:   text - past the word and the blanks after it, if read
+//            value - the number
+//            returns false if there is no word or it is not a number
+//
+//*********************************************************************
+
+bool next_sequence (const char *&text, uint64_t &value)
+{
+    const char *rest = text;
+    char word[24];
+    char *end;
+    unsigned long long number;
+
+    if(!next_word(rest, word, sizeof(word)) ||
+       !isdigit((unsigned char)word[0]))
+    {
+	return false;
+    }
+    errno = 0;
+    number = strtoull(word, &end, 10);
+    if(*end != '\0' || errno != 0)
+    {
+	return false;
+    }
+    value = number;
+    text = rest;
+    return true;
+}
+
+//*********************************************************************
+// Function:  set_field
+// Purpose:   to store one field of an entry given as text
+//
+// Details:   The value is checked against the field's maximum length,
+//            and may not contain a tab or newline since either would
+//            break the inventory file and the command protocol. The
+//            author name may not be empty and the initial must be a
+//            single character. The entry is unchanged if the value is
+//            rejected.
+// Inputs:    entry - the record to change
+//            field - which field
+//            value - the new value
+// Outputs:   entry - with the field changed
+//            returns whether or not the value was valid
+//
+//*********************************************************************
+
+bool set_field (Entry &entry, EntryField field, const char value[])
+{
+    size_t length = strlen(value);
+
+    if(strchr(value, FIELD_SEP) != NULL || strchr(value, EOLN) != NULL)
+    {
+	return false;
+    }
+    switch(field)
+    {
+      case FLD_AUTHOR_NAME:
+	if(length == 0 || length > (size_t)MAX_AUTHOR_NAME)
+	{
+	    return false;
+	}
+	strcpy(entry.author_name, value);
+	return true;
+      case FLD_AUTHOR_INITIAL:
+	if(length != 1)
+	{
+	    return false;
+	}
+	entry.author_initial = value[0];
+	return true;
+      case FLD_LOCATION:
+	if(length > (size_t)MAX_LOCATION)
+	{
+	    return false;
+	}
+	strcpy(entry.location, value);
+	return true;
+      case FLD_TITLE:
+	if(length > (size_t)MAX_TITLE)
+	{
+	    return false;
+	}
+	strcpy(entry.title, value);
+	return true;
+      case FLD_COMMENT:
+	if(length > (size_t)MAX_COMMENT)
+	{
+	    return false;
+	}
+	strcpy(entry.comment, value);
+	return true;
+      case FLD_QUANTITY:
+	return parse_number(value, entry.quantity);
+      default:
+	return false;
+    }
+}
+
+//*********************************************************************
+// Function:  parse_entry
+// Purpose:   to read a record given as a tab separated line
+//
+// Details:   The fields are in the same order as a record line of a
+//            command reply: author name, initial, inventory number,
+//            location, title, comment and quantity.
+// Inputs:    line - the fields
+// Outputs:   entry - the record
+//            returns false unless there are exactly seven valid fields
+//
+//*********************************************************************
+
+bool parse_entry (const char line[], Entry &entry)
+{
+    const EntryField order[] = { FLD_AUTHOR_NAME, FLD_AUTHOR_INITIAL,
+                                 FLD_NONE, FLD_LOCATION, FLD_TITLE,
+                                 FLD_COMMENT, FLD_QUANTITY };
+    const int FIELDS = sizeof(order) / sizeof(order[0]);
+    string text;
+
+    for(int field = 0; field < FIELDS; field++)
+    {
+	const char *end = strchr(line, FIELD_SEP);
+
+	if((end == NULL) != (field == FIELDS - 1))
+	{
+	    return false;
+	}
+	text.assign(line, end == NULL ? strlen(line) : end - line);
+	if(order[field] == FLD_NONE)
+	{
+	    if(!parse_number(text.c_str(), entry.inventory_number))
+	    {
+		return false;
+	    }
+	}
+	else if(!set_field(entry, order[field], text.c_str()))
+	{
+	    return false;
+	}
+	line = end + 1;
+    }
+    return true;
+}
+
+//*********************************************************************
+// Function:  apply_mutation
+// Purpose:   to make a single change to the inventory
+//
+// Details:   An insert fails if the inventory number is in use; any
+//            other change fails if it is not. An adjustment fails
+//            rather than let the quantity overflow. The caller must
+//            hold the write lock.
+// Inputs:    shard - the shard
+//            change - the mutation to apply
+// Outputs:   shard - with the change made
+//            error - why the change could not be made
+//            returns whether or not the change was made
+//
+//*********************************************************************
+
+bool apply_mutation (Shard &shard, const Mutation &change,
+                     string &error)
+{
+    int slot = find_entry(shard, change.inventory_number);
+    Entry updated;
+    Record adjusted;
+
+    if(change.kind == MUT_INSERT)
+    {
+	if(add_record(shard, change.entry) == NO_SLOT)
+	{
+	    error = to_string(change.inventory_number) + " already exists";
+	    return false;
+	}
+	return true;
+    }
+    if(slot == NO_SLOT)
+    {
+	error = to_string(change.inventory_number) + " not found";
+	return false;
+    }
+
+    switch(change.kind)
+    {
+      case MUT_REMOVE:
+	drop_record(shard, slot);
+	break;
+      case MUT_ADJUST:
+	updated = entry_at(shard, slot);
+	if((change.delta > 0 && updated.quantity > INT_MAX - change.delta) ||
+	   (change.delta < 0 && updated.quantity < INT_MIN - change.delta))
+	{
+	    error = "quantity of " + to_string(change.inventory_number) +
+		    " out of range";
+	    return false;
+	}
+	tally_record(shard, slot, -1);
+	adjusted = record_at(shard, slot);
+	adjusted.quantity += change.delta;
+	store_record(shard, slot, adjusted);
+	tally_record(shard, slot, 1);
+	break;
+      case MUT_UPDATE:
+	updated = entry_at(shard, slot);
+	if(!set_field(updated, change.field, change.value.c_str()))
+	{
+	    error = "invalid value for " + to_string(change.inventory_number);
+	    return false;
+	}
+	replace_record(shard, slot, updated);
+	break;
+      default:
+	break;
+    }
+    return true;
+}
+
+//*********************************************************************
+// Function:  commit_transaction
+// Purpose:   to apply a group of changes atomically
+//
+// Details:   Takes the write locks of the shards it changes, in shard
+//            order, once for the whole transaction, so readers see the
+//            inventory either before or after it; transactions on
+//            other shards go ahead at the same time. The state of
+//            each record is saved before it is changed; if a change
+//            fails, the saved states are put back in reverse order and
+//            nothing is left changed. Every step is a hash or tree
+//            operation, so a transaction costs O(k log n) for k
+//            changes. Once all of the changes are made they are
+//            published to the change stream, still under the locks.
+// Inputs:    inventory - the database
+//            changes - the mutations, applied in order
+// Outputs:   inventory - with all of the changes made, or none
+//            error - which change failed and why
+//            returns whether or not the transaction was applied
+//
+//*********************************************************************
+
+bool commit_transaction (Inventory &inventory, const Transaction &changes,
+                         string &error)
+{
+    struct Undo
+    {
+	int   inventory_number;
+	bool  existed;               // whether there was a record before
+	Entry before;                // and if so, what it was
+    };
+    TimedOp timer(MET_COMMIT);
+    vector<Undo> undo;
+    vector<ChangeEvent> events;
+    vector<size_t> touched;
+    vector<WRITE_LOCK> locks;
+
+    for(size_t step = 0; step < changes.size(); step++)
+    {
+	touched.push_back(shard_index(inventory,
+				      changes[step].inventory_number));
+    }
+    sort(touched.begin(), touched.end());
+    touched.erase(unique(touched.begin(), touched.end()), touched.end());
+    for(size_t shard = 0; shard < touched.size(); shard++)
+    {
+	locks.push_back(WRITE_LOCK(inventory.shards[touched[shard]]->guard));
+    }
+
+    undo.reserve(changes.size());
+    for(size_t step = 0; step < changes.size(); step++)
+    {
+	const Mutation &change = changes[step];
+	Shard &shard = shard_for(inventory, change.inventory_number);
+	int slot = find_entry(shard, change.inventory_number);
+	Undo saved;
+
+	saved.inventory_number = change.inventory_number;
+	saved.existed = (slot != NO_SLOT);
+	if(saved.existed)
+	{
+	    saved.before = entry_at(shard, slot);
+	}
+	if(!apply_mutation(shard, change, error))
+	{
+	    error = "change " + to_string(step + 1) + ": " + error;
+	    while(!undo.empty())
+	    {
+		Shard &undone = shard_for(inventory,
+					  undo.back().inventory_number);
+
+		slot = find_entry(undone, undo.back().inventory_number);
+		if(slot != NO_SLOT)
+		{
+		    drop_record(undone, slot);
+		}
+		if(undo.back().existed)
+		{
+		    add_record(undone, undo.back().before);
+		}
+		undo.pop_back();
+	    }
+	    count_metric(CNT_COMMIT_FAILED);
+	    return false;
+	}
+	undo.push_back(saved);
+
+	ChangeEvent event;
+	event.kind = change.kind;
+	event.entry = (change.kind == MUT_REMOVE) ? saved.before :
+		      entry_at(shard, find_entry(shard, change.inventory_number));
+	events.push_back(event);
+    }
+    publish_changes(inventory.changes, events);
+    return true;
+}
+
+//*********************************************************************
+// Function:  open_changes
+// Purpose:   to start the change stream
+//
+// Details:   Allocates the ring. If a file is named, changes are also
+//            appended to it by a writer thread of their own, and the
+//            numbering carries on from the last change in the file, so
+//            that a tailer sees one rising sequence across restarts.
+// Inputs:    filename - the change file, or NULL for none
+// Outputs:   changes - ready to publish
+//            returns false if the file could not be opened
+//
+//*********************************************************************
+
+bool open_changes (ChangeLog &changes, const char filename[])
+{
+    changes.ring.reset(new ChangeSlot[CHANGE_RING_SIZE]);
+    for(size_t slot = 0; slot < CHANGE_RING_SIZE; slot++)
+    {
+	changes.ring[slot].sequence.store(0, memory_order_relaxed);
+    }
+    changes.last = 0;
+    changes.published = 0;
+    changes.appended = 0;
+    changes.stopping = false;
+    changes.file = -1;
+    if(filename == NULL)
+    {
+	return true;
+    }
+
+    changes.file = open(filename, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if(changes.file < 0)
+    {
+	return false;
+    }
+
+    char tail[CHANGE_LINE_MAX];
+    off_t size = lseek(changes.file, 0, SEEK_END);
+    off_t from = max(size - (off_t)sizeof(tail), (off_t)0);
+    ssize_t got = pread(changes.file, tail, sizeof(tail), from);
+    unsigned long long number;
+
+    while(got > 0 && tail[got - 1] == EOLN)
+    {
+	got--;
+    }
+    for(ssize_t line = got; line >= 0; line--)
+    {
+	if(line == 0 || tail[line - 1] == EOLN)
+	{
+	    if(line < got && sscanf(tail + line, "%llu", &number) == 1)
+	    {
+		changes.last = changes.published = changes.appended = number;
+	    }
+	    break;
+	}
+    }
+    changes.writer = thread(append_changes, ref(changes));
+    return true;
+}
+
+//*********************************************************************
+// Function:  close_changes
+// Purpose:   to stop the change stream
+//
+// Details:   waits for the writer thread to append every change
+//            published so far, then closes the file.
+// Inputs:    changes - the change stream
+// Outputs:   changes - with its file, if any, complete and closed
+//
+//*********************************************************************
+
+void close_changes (ChangeLog &changes)
+{
+    if(changes.file >= 0)
+    {
+	changes.stopping = true;
+	changes.writer.join();
+	close(changes.file);
+	changes.file = -1;
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  publish_changes
+// Purpose:   to add the changes of a transaction to the stream
+//
+// Details:   A block of sequence numbers is claimed with one atomic
+//            add, so a transaction's changes are numbered together
+//            even while other shards publish theirs (a transaction of
+//            more than CHANGE_BLOCK changes takes several blocks). Each change is
+//            then copied into its ring slot and the slot stamped with
+//            its number; a reader takes a change only once its stamp
+//            is there, and notices if it is overwritten while being
+//            read (a seqlock). Finally published is moved past the
+//            block, in order, so readers never skip a change that is
+//            still being written.
+//
+//            Nothing here takes a lock. Only when a change file is
+//            being written does a publisher wait, and then only if
+//            the writer thread is a whole ring behind, so no change
+//            is overwritten before it is in the file.
+//
+//            The caller holds the write locks of the records'
+//            shards, so changes to a record are numbered in the order
+//            they were made.
+// Inputs:    changes - the change stream
+//            events - the changes, in the order they were made
+// Outputs:   changes - with the changes published
+//
+//*********************************************************************
+
+void publish_changes (ChangeLog &changes, const vector<ChangeEvent> &events)
+{
+    for(size_t start = 0; start < events.size(); start += CHANGE_BLOCK)
+    {
+	size_t count = min(events.size() - start, CHANGE_BLOCK);
+	uint64_t first = changes.last.fetch_add(count) + 1;
+	uint64_t before = first - 1;
+
+	for(size_t event = 0; event < count; event++)
+	{
+	    uint64_t sequence = first + event;
+	    ChangeSlot &slot = changes.ring[sequence % CHANGE_RING_SIZE];
+
+	    while(changes.file >= 0 &&
+		  sequence > changes.appended.load() + CHANGE_RING_SIZE)
+	    {
+		this_thread::yield();
+	    }
+	    slot.sequence.store(0, memory_order_relaxed);
+	    atomic_thread_fence(memory_order_release);
+	    slot.event = events[start + event];
+	    slot.event.sequence = sequence;
+	    slot.sequence.store(sequence, memory_order_release);
+	}
+	while(!changes.published.compare_exchange_weak(before,
+						       first + count - 1))
+	{
+	    before = first - 1;
+	    this_thread::yield();
+	}
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  read_changes
+// Purpose:   to read the changes after some point from the ring
+//
+// Details:   Any number of readers may do this at once; none of them
+//            holds up a publisher. A reader a whole ring behind has
+//            lost changes, and must start again from a full listing.
+// Inputs:    changes - the change stream
+//            after - the last sequence number already seen
+//            limit - the most changes wanted
+// Outputs:   events - the changes after it, in order, appended
+//            returns false if some of them are no longer in the ring
+//
+//*********************************************************************
+
+bool read_changes (const ChangeLog &changes, uint64_t after, size_t limit,
+                   vector<ChangeEvent> &events)
+{
+    uint64_t published = changes.published.load(memory_order_acquire);
+
+    if(published > CHANGE_RING_SIZE &&
+       after < published - CHANGE_RING_SIZE)
+    {
+	return false;
+    }
+    if(after >= published)
+    {
+	return true;                // nothing new, and after + 1 may wrap
+    }
+    for(uint64_t sequence = after + 1;
+	sequence <= published && limit > 0; sequence++, limit--)
+    {
+	const ChangeSlot &slot = changes.ring[sequence % CHANGE_RING_SIZE];
+	ChangeEvent event;
+
+	if(slot.sequence.load(memory_order_acquire) != sequence)
+	{
+	    return false;
+	}
+	event = slot.event;
+	atomic_thread_fence(memory_order_acquire);
+	if(slot.sequence.load(memory_order_relaxed) != sequence)
+	{
+	    return false;
+	}
+	events.push_back(event);
+    }
+    return true;
+}
+
+//*********************************************************************
+// Function:  format_change
+// Purpose:   to append a change as a line of text
+//
+// Details:   the sequence number, the kind of change (INSERT, UPDATE,
+//            ADJUST or REMOVE), then the fields of the record as in a
+//            reply, all separated by tabs. The record is as it was
+//            after the change, or for REMOVE as it was when removed.
+// Inputs:    text - the text so far
+//            event - the change
+// Outputs:   text - with the line appended
+//
+//*********************************************************************
+
+void format_change (string &text, const ChangeEvent &event)
+{
+    const char *kinds[] = { "INSERT", "UPDATE", "ADJUST", "REMOVE" };
+    char number[24];
+
+    snprintf(number, sizeof(number), "%llu",
+	     (unsigned long long)event.sequence);
+    text += number;
+    text += FIELD_SEP;
+    text += kinds[event.kind];
+    text += FIELD_SEP;
+    format_entry(text, event.entry, FMT_TAB, 0);
+    return;
+}
+
+//*********************************************************************
+// Function:  append_changes
+// Purpose:   to follow the ring and append each change to the file
+//
+// Details:   Runs on a thread of its own while the change file is
+//            open. Whatever has been published is formatted and
+//            appended with one write; when there is nothing new it
+//            sleeps for CHANGE_POLL_MS. Each line reaches the file
+//            whole, so a tailer never sees part of a change. Returns
+//            once close_changes asks and everything is written.
+//
+//            appended is moved up only past the changes whose lines
+//            were written in full; part of a line left by a failed
+//            write is cut off again. The rest are tried again every
+//            CHANGE_RETRY_MS, and the failure is reported once, when
+//            it starts, and again when writing recovers. Meanwhile
+//            publishers wait once the writer is a ring behind (see
+//            publish_changes), so a full disk holds up changes rather
+//            than losing them. When close_changes asks while writes
+//            are failing, the changes left unwritten are counted and
+//            given up.
+// Inputs:    changes - the change stream
+// Outputs:   changes - with appended moved up as changes are written
+//
+//*********************************************************************
+
+void append_changes (ChangeLog &changes)
+{
+    vector<ChangeEvent> events;
+    vector<size_t> ends;             // where each change's line ends
+    string text;
+    bool failing = false;            // the last write failed
+
+    for(;;)
+    {
+	bool stopping = changes.stopping;
+	uint64_t done = changes.appended;
+	off_t start = lseek(changes.file, 0, SEEK_END);
+	const char *reason = "nothing was written";
+	size_t sent = 0;
+	size_t whole = 0;
+
+	events.clear();
+	ends.clear();
+	text.clear();
+	read_changes(changes, done, CHANGE_RING_SIZE, events);
+	for(size_t event = 0; event < events.size(); event++)
+	{
+	    format_change(text, events[event]);
+	    ends.push_back(text.size());
+	}
+	while(sent < text.size())
+	{
+	    ssize_t put = write(changes.file, text.data() + sent,
+				text.size() - sent);
+	    if(put < 0 && errno == EINTR)
+	    {
+		continue;
+	    }
+	    if(put <= 0)
+	    {
+		if(put < 0)
+		{
+		    reason = strerror(errno);
+		}
+		break;
+	    }
+	    sent += put;
+	}
+	while(whole < ends.size() && ends[whole] <= sent)
+	{
+	    whole++;
+	}
+	changes.appended = done + whole;
+	if(sent < text.size())
+	{
+	    size_t kept = whole == 0 ? 0 : ends[whole - 1];
+
+	    if(!failing)
+	    {
+		cerr << "unable to append to the change file: " << reason
+		     << "; retrying" << endl;
+		failing = true;
+	    }
+	    if(sent > kept && (start < 0 ||
+			       ftruncate(changes.file, start + kept) != 0))
+	    {
+		cerr << "unable to cut a partly written change from the "
+		     << "change file" << endl;
+	    }
+	    if(stopping)
+	    {
+		cerr << changes.published - changes.appended
+		     << " changes were not appended to the change file"
+		     << endl;
+		return;
+	    }
+	    this_thread::sleep_for(chrono::milliseconds(CHANGE_RETRY_MS));
+	    continue;
+	}
+	if(failing && !events.empty())
+	{
+	    cerr << "appending to the change file again" << endl;
+	    failing = false;
+	}
+	if(events.empty())
+	{
+	    if(stopping)
+	    {
+		return;
+	    }
+	    this_thread::sleep_for(chrono::milliseconds(CHANGE_POLL_MS));
+	}
+    }
+}
+
+//*********************************************************************
+// Function:  put_number
+// Purpose:   to append an integer to some text
+//
+// Details:   the digits are produced into a small buffer from the
+//            right, which avoids the locale and stream state that
+//            "<<" carries for every number.
+// Inputs:    number - the value
+// Outputs:   text - with the number appended
+//
+//*********************************************************************
+
+void put_number (string &text, long long number)
+{
+    char digits[24];
+    char *first = digits + sizeof(digits);
+    unsigned long long magnitude =
+	(number < 0) ? 0ull - (unsigned long long)number
+		     : (unsigned long long)number;
+
+    do
+    {
+	*--first = (char)('0' + magnitude % 10);
+	magnitude /= 10;
+    } while(magnitude != 0);
+    if(number < 0)
+    {
+	*--first = '-';
+    }
+    text.append(first, digits + sizeof(digits) - first);
+    return;
+}
+
+//*********************************************************************
+// Function:  put_padded
+// Purpose:   to append text left justified in a column
+//
+// Details:   spaces are added after the text to fill width; text that
+//            is already as wide is appended as it is.
+// Inputs:    value - the text to add
+//            width - the column width
+// Outputs:   text - with the padded value appended
+//
+//*********************************************************************
+
+void put_padded (string &text, const char value[], size_t width)
+{
+    size_t length = strlen(value);
+
+    text.append(value, length);
+    if(length < width)
+    {
+	text.append(width - length, ' ');
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  put_quoted
+// Purpose:   to append a string field quoted for CSV or JSON
+//
+// Details:   CSV fields are quoted only if they hold a comma, quote
+//            or line break, with any quote doubled. JSON strings are
+//            always quoted, with quote, backslash and control
+//            characters escaped.
+// Inputs:    value - the field
+//            format - FMT_CSV or FMT_JSON
+// Outputs:   text - with the quoted field appended
+//
+//*********************************************************************
+
+void put_quoted (string &text, const char value[], OutputFormat format)
+{
+    static const char HEX[] = "0123456789abcdef";
+
+    if(format == FMT_CSV)
+    {
+	if(strpbrk(value, ",\"\r\n") == NULL)
+	{
+	    text += value;
+	    return;
+	}
+	text += '"';
+	for(const char *next = value; *next != '\0'; next++)
+	{
+	    if(*next == '"')
+	    {
+		text += '"';
+	    }
+	    text += *next;
+	}
+	text += '"';
+	return;
+    }
+
+    text += '"';
+    for(const char *next = value; *next != '\0'; next++)
+    {
+	unsigned char letter = (unsigned char)*next;
+
+	if(letter == '"' || letter == '\\')
+	{
+	    text += '\\';
+	    text += (char)letter;
+	}
+	else if(letter < 0x20)
+	{
+	    text += "\\u00";
+	    text += HEX[letter >> 4];
+	    text += HEX[letter & 0xf];
+	}
+	else
+	{
+	    text += (char)letter;
+	}
+    }
+    text += '"';
+    return;
+}
+
+//*********************************************************************
+// Function:  format_entry
+// Purpose:   to append one entry to some text in a given format
+//
+// Details:   The formats are
+//              FMT_REPORT - the seven labelled lines shown to the user,
+//                           preceded by "# n" when ordinal is not 0
+//              FMT_FILE   - one field per line, as in the inventory file
+//              FMT_TAB    - one line, fields separated by FIELD_SEP, as
+//                           in a command reply
+//              FMT_CSV    - one comma separated line
+//              FMT_JSON   - one JSON object per line
+//              FMT_FIXED  - one line of space separated columns, each
+//                           as wide as its field can be, with the
+//                           numbers right justified
+//            In every format but FMT_REPORT and FMT_FILE the fields
+//            come in declaration order.
+// Inputs:    entry - the record
+//            format - how to lay it out
+//            ordinal - the record's number in a report, or 0
+// Outputs:   text - with the entry appended
+//
+//*********************************************************************
+
+void format_entry (string &text, const Entry &entry, OutputFormat format,
+                   int ordinal)
+{
+    const char initial[2] = { entry.author_initial, '\0' };
+
+    switch(format)
+    {
+      case FMT_REPORT:
+	if(ordinal != 0)
+	{
+	    text += "# ";
+	    put_number(text, ordinal);
+	    text += EOLN;
+	}
+	put_padded(text, "Author Last Name", REPORT_LABEL_WIDTH);
+	text += entry.author_name;
+	text += EOLN;
+	put_padded(text, "Author Initial", REPORT_LABEL_WIDTH);
+	text += entry.author_initial;
+	text += EOLN;
+	put_padded(text, "Inventory Number", REPORT_LABEL_WIDTH);
+	put_number(text, entry.inventory_number);
+	text += EOLN;
+	put_padded(text, "Location", REPORT_LABEL_WIDTH);
+	text += entry.location;
+	text += EOLN;
+	put_padded(text, "Book Title", REPORT_LABEL_WIDTH);
+	text += entry.title;
+	text += EOLN;
+	put_padded(text, "Comments", REPORT_LABEL_WIDTH);
+	text += entry.comment;
+	text += EOLN;
+	put_padded(text, "Quantity", REPORT_LABEL_WIDTH);
+	put_number(text, entry.quantity);
+	text += EOLN;
+	break;
+      case FMT_FILE:
+	text += entry.author_name;
+	text += EOLN;
+	text += entry.author_initial;
+	text += EOLN;
+	put_number(text, entry.inventory_number);
+	text += EOLN;
+	text += entry.location;
+	text += EOLN;
+	text += entry.title;
+	text += EOLN;
+	text += entry.comment;
+	text += EOLN;
+	put_number(text, entry.quantity);
+	text += EOLN;
+	break;
+      case FMT_TAB:
+	text += entry.author_name;
+	text += FIELD_SEP;
+	text += entry.author_initial;
+	text += FIELD_SEP;
+	put_number(text, entry.inventory_number);
+	text += FIELD_SEP;
+	text += entry.location;
+	text += FIELD_SEP;
+	text += entry.title;
+	text += FIELD_SEP;
+	text += entry.comment;
+	text += FIELD_SEP;
+	put_number(text, entry.quantity);
+	text += EOLN;
+	break;
+      case FMT_CSV:
+	put_quoted(text, entry.author_name, format);
+	text += ',';
+	put_quoted(text, initial, format);
+	text += ',';
+	put_number(text, entry.inventory_number);
+	text += ',';
+	put_quoted(text, entry.location, format);
+	text += ',';
+	put_quoted(text, entry.title, format);
+	text += ',';
+	put_quoted(text, entry.comment, format);
+	text += ',';
+	put_number(text, entry.quantity);
+	text += EOLN;
+	break;
+      case FMT_JSON:
+	text += "{\"author_name\":";
+	put_quoted(text, entry.author_name, format);
+	text += ",\"author_initial\":";
+	put_quoted(text, initial, format);
+	text += ",\"inventory_number\":";
+	put_number(text, entry.inventory_number);
+	text += ",\"location\":";
+	put_quoted(text, entry.location, format);
+	text += ",\"title\":";
+	put_quoted(text, entry.title, format);
+	text += ",\"comment\":";
+	put_quoted(text, entry.comment, format);
+	text += ",\"quantity\":";
+	put_number(text, entry.quantity);
+	text += "}\n";
+	break;
+      case FMT_FIXED:
+	{
+	    size_t start;
+
+	    put_padded(text, entry.author_name, MAX_AUTHOR_NAME + 1);
+	    put_padded(text, initial, 2);
+	    start = text.size();
+	    put_number(text, entry.inventory_number);
+	    text.insert(start, NUMBER_WIDTH - (text.size() - start), ' ');
+	    text += ' ';
+	    put_padded(text, entry.location, MAX_LOCATION + 1);
+	    put_padded(text, entry.title, MAX_TITLE + 1);
+	    put_padded(text, entry.comment, MAX_COMMENT + 1);
+	    start = text.size();
+	    put_number(text, entry.quantity);
+	    text.insert(start, NUMBER_WIDTH - (text.size() - start), ' ');
+	    text += EOLN;
+	}
+	break;
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  format_named
+// Purpose:   to map a format name used by EXPORT to the format
+//
+// Inputs:    name - csv, json, fixed, tab, report or inventory
+// Outputs:   format - the format
+//            returns false for any other name
+//
+//*********************************************************************
+
+bool format_named (const char name[], OutputFormat &format)
+{
+    const char *names[] = { "report", "inventory", "tab", "csv", "json",
+                            "fixed" };
+
+    for(int named = FMT_REPORT; named <= FMT_FIXED; named++)
+    {
+	if(strcmp(name, names[named]) == 0)
+	{
+	    format = (OutputFormat)named;
+	    return true;
+	}
+    }
+    return false;
+}
+
+//*********************************************************************
+// Function:  start_output
+// Purpose:   to get an output buffer ready for a listing or export
+//
+// Inputs:    out - where the text is to go
+// Outputs:   output - empty and bound to out
+//
+//*********************************************************************
+
+void start_output (OutputBuffer &output, ostream &out)
+{
+    output.out = &out;
+    output.text.clear();
+    output.text.reserve(OUTPUT_CHUNK + OUTPUT_CHUNK / 8);
+    return;
+}
+
+//*********************************************************************
+// Function:  put_entry
+// Purpose:   to add an entry to an output buffer
+//
+// Details:   the entry is formatted into the buffer, which is only
+//            written out once it holds OUTPUT_CHUNK bytes. The buffer
+//            keeps its space after a write, so a listing of any
+//            length uses the same memory throughout.
+// Inputs:    entry, format, ordinal - as for format_entry
+// Outputs:   output - with the entry added
+//
+//*********************************************************************
+
+void put_entry (OutputBuffer &output, const Entry &entry, OutputFormat format,
+                int ordinal)
+{
+    format_entry(output.text, entry, format, ordinal);
+    if(output.text.size() >= (size_t)OUTPUT_CHUNK)
+    {
+	flush_output(output);
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  flush_output
+// Purpose:   to write whatever an output buffer holds
+//
+// Inputs:    output - the buffer
+// Outputs:   output - empty
+//            returns false if the stream has failed
+//
+//*********************************************************************
+
+bool flush_output (OutputBuffer &output)
+{
+    output.out->write(output.text.data(), output.text.size());
+    output.text.clear();
+    output.out->flush();
+    return !output.out->fail();
+}
+
+//*********************************************************************
+// Function:  export_inventory
+// Purpose:   to write the whole inventory to a file in a given format
+//
+// Details:   entries go out in key field order. A CSV export starts
+//            with a line of column names. No lock is held while the
+//            file is written; see for_each_in_order.
+// Inputs:    inventory - the database
+//            filename - the file to write
+//            format - the layout of each entry
+// Outputs:   written - if given, the number of entries written
+//            returns false if the file could not be opened or written
+//
+//*********************************************************************
+
+bool export_inventory (const Inventory &inventory, const char filename[],
+                       OutputFormat format, int *written)
+{
+    ofstream outp(filename, ios::out | ios::binary);
+    OutputBuffer output;
+    int count = 0;
+
+    if(outp.fail())
+    {
+	return false;
+    }
+    start_output(output, outp);
+    if(format == FMT_CSV)
+    {
+	output.text += "author_name,author_initial,inventory_number,"
+		       "location,title,comment,quantity\n";
+    }
+
+    for_each_in_order(inventory, [&](const Entry &entry)
+    {
+	count++;
+	put_entry(output, entry, format, count);
+    });
+    if(written != NULL)
+    {
+	*written = count;
+    }
+    return flush_output(output);
+}
+
+//*********************************************************************
+// Function:  export_file
+// Purpose:   to export the inventory to a file the user names, in a
+//            format the user picks
+//
+// Inputs:    inventory - the database
+//
+//*********************************************************************
+
+void export_file (const Inventory &inventory)
+{
+    char name[16];
+    char filename[FILE_LENGTH];
+    OutputFormat format;
+
+    cout << "Enter the format (csv, json, fixed, tab, inventory or "
+	 << "report) and file name: ";
+    cin >> setw(sizeof(name)) >> name >> setw(sizeof(filename)) >> filename;
+    if(!format_named(name, format))
+    {
+	cout << endl << name << " is not a known format." << endl;
+    }
+    else if(!export_inventory(inventory, filename, format))
+    {
+	cout << "Unsuccessful trying to write file " << filename << endl;
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  write_entry
+// Purpose:   to output a single entry
+//
+// Details:   Each value of the entry will be outputted to the user.
+//            The lines are formatted first and written together.
+//
+// Inputs:    entry - the record to display
+//
+//*********************************************************************
+
+void write_entry(const Entry &entry)
+{
+    string text;
+
+    format_entry(text, entry, FMT_REPORT, 0);
+    cout.write(text.data(), text.size());
+}
+
+//*********************************************************************
+// Function:  execute_command
+// Purpose:   to run a single batch or server command
+//
+// Details:   The first word of the line selects the command; see the
+//            file header for the list. Blank lines are ignored. Each
+//            command appends its records and then exactly one OK or
+//            ERR status line, so pipelined replies stay in step with
+//            the requests.
+//
+//            REMOVE, ADD, SET and ADJ each build one mutation. Outside
+//            a transaction it is committed at once; after BEGIN it is
+//            added to the session's pending transaction instead.
+// Inputs:    inventory - the database
+//            session - the client's transaction state
+//            line - the command, without its end of line
+// Outputs:   session - with a change held back or a transaction ended
+//            reply - with the command's reply appended
+//            returns whether the session should carry on, end, or end
+//            and stop the server
+//
+//*********************************************************************
+
+CommandStatus execute_command (Inventory &inventory, Session &session,
+                               const char line[], string &reply)
+{
+    Mutation change = Mutation();    // fields a kind leaves unset are zero
+    string error;
+    char name[16];
+    char verb[16];
+    char arg[FILE_LENGTH];
+    int  consumed = 0;
+    int  number;
+    int  count = 0;
+
+    if(sscanf(line, " %15s %n", verb, &consumed) != 1)
+    {
+	return CMD_CONTINUE;
+    }
+    line += consumed;
+
+    if(strcmp(verb, "LIST") == 0)
+    {
+	for_each_in_order(inventory, [&](const Entry &entry)
+	{
+	    format_entry(reply, entry, FMT_TAB, 0);
+	    count++;
+	});
+    }
+    else if(strcmp(verb, "FIND") == 0)
+    {
+	size_t length = strlen(line);
+
+	while(length > 0 && isspace((unsigned char)line[length - 1]))
+	{
+	    length--;
+	}
+	if(length == 0 || length > (size_t)MAX_AUTHOR_NAME)
+	{
+	    reply += "ERR FIND needs an author name of at most " +
+		     to_string(MAX_AUTHOR_NAME) + " characters\n";
+	    return CMD_CONTINUE;
+	}
+	memcpy(arg, line, length);
+	arg[length] = '\0';
+	vector<Entry> entries;
+	query_by_name(inventory, arg, entries);
+	for(size_t hit = 0; hit < entries.size(); hit++)
+	{
+	    format_entry(reply, entries[hit], FMT_TAB, 0);
+	}
+	count = entries.size();
+    }
+    else if(strcmp(verb, "SEARCH") == 0)
+    {
+	vector<Entry> entries;
+	query_text(inventory, line, MAX_SEARCH_RESULTS, entries);
+	for(size_t hit = 0; hit < entries.size(); hit++)
+	{
+	    format_entry(reply, entries[hit], FMT_TAB, 0);
+	}
+	count = entries.size();
+    }
+    else if(strcmp(verb, "LOC") == 0)
+    {
+	vector<Entry> entries;
+	char shelf;
+	int first, last;
+
+	if(!parse_bin_range(line, shelf, first, last))
+	{
+	    reply += "ERR LOC needs a bin, shelf or range of bins\n";
+	    return CMD_CONTINUE;
+	}
+	query_by_location(inventory, shelf, first, last, entries);
+	for(size_t hit = 0; hit < entries.size(); hit++)
+	{
+	    format_entry(reply, entries[hit], FMT_TAB, 0);
+	}
+	count = entries.size();
+    }
+    else if(strcmp(verb, "TOTALS") == 0)
+    {
+	map<string, StockTally> totals;
+	StockView view;
+	int fields = sscanf(line, "%15s %n", name, &consumed);
+
+	if(fields < 1 || !view_named(name, view))
+	{
+	    reply += "ERR TOTALS needs category, author, shelf or all\n";
+	    return CMD_CONTINUE;
+	}
+	line += consumed;
+	query_totals(inventory, view, (*line != '\0') ? line : NULL, totals);
+	for(map<string, StockTally>::const_iterator group = totals.begin();
+	    group != totals.end(); group++)
+	{
+	    format_totals(reply, group->first, group->second);
+	}
+	count = totals.size();
+    }
+    else if(strcmp(verb, "CHANGES") == 0)
+    {
+	vector<ChangeEvent> events;
+	uint64_t after;
+	int limit = CHANGE_RING_SIZE;
+
+	if(!next_sequence(line, after) ||
+	   (*line != '\0' && !next_number(line, limit)) ||
+	   *line != '\0' || limit < 0)
+	{
+	    reply += "ERR CHANGES needs a sequence number\n";
+	    return CMD_CONTINUE;
+	}
+	if(!read_changes(inventory.changes, after, limit, events))
+	{
+	    reply += "ERR changes after " + to_string(after) +
+		     " are no longer buffered\n";
+	    return CMD_CONTINUE;
+	}
+	for(size_t event = 0; event < events.size(); event++)
+	{
+	    format_change(reply, events[event]);
+	}
+	count = events.size();
+    }
+    else if(strcmp(verb, "GET") == 0)
+    {
+	if(!next_number(line, number) || *line != '\0')
+	{
+	    reply += "ERR GET needs an inventory number\n";
+	    return CMD_CONTINUE;
+	}
+	Entry entry;
+	if(!get_entry(inventory, number, entry))
+	{
+	    reply += "ERR " + to_string(number) + " not found\n";
+	    return CMD_CONTINUE;
+	}
+	format_entry(reply, entry, FMT_TAB, 0);
+	count = 1;
+    }
+    else if(strcmp(verb, "REMOVE") == 0 || strcmp(verb, "ADD") == 0 ||
+	    strcmp(verb, "SET") == 0 || strcmp(verb, "ADJ") == 0)
+    {
+	if(verb[0] == 'R')
+	{
+	    change.kind = MUT_REMOVE;
+	    if(!next_number(line, change.inventory_number) || *line != '\0')
+	    {
+		reply += "ERR REMOVE needs an inventory number\n";
+		return CMD_CONTINUE;
+	    }
+	}
+	else if(strcmp(verb, "ADD") == 0)
+	{
+	    change.kind = MUT_INSERT;
+	    if(!parse_entry(line, change.entry))
+	    {
+		reply += "ERR ADD needs seven valid tab separated fields\n";
+		return CMD_CONTINUE;
+	    }
+	    change.inventory_number = change.entry.inventory_number;
+	}
+	else if(verb[0] == 'S')
+	{
+	    change.kind = MUT_UPDATE;
+	    consumed = 0;
+	    if(!next_number(line, change.inventory_number) ||
+	       sscanf(line, "%15s %n", name, &consumed) != 1 ||
+	       consumed == 0 ||
+	       (change.field = field_named(name)) == FLD_NONE)
+	    {
+		reply += "ERR SET needs an inventory number, field and "
+			 "value\n";
+		return CMD_CONTINUE;
+	    }
+	    change.value = line + consumed;
+	}
+	else
+	{
+	    change.kind = MUT_ADJUST;
+	    if(!next_number(line, change.inventory_number) ||
+	       !next_number(line, change.delta) || *line != '\0')
+	    {
+		reply += "ERR ADJ needs an inventory number and amount\n";
+		return CMD_CONTINUE;
+	    }
+	}
+
+	if(session.in_transaction)
+	{
+	    session.pending.push_back(change);
+	}
+	else if(!commit_transaction(inventory, Transaction(1, change), error))
+	{
+	    reply += "ERR " + error + EOLN;
+	    return CMD_CONTINUE;
+	}
+	else
+	{
+	    count = 1;
+	}
+    }
+    else if(strcmp(verb, "BEGIN") == 0)
+    {
+	if(session.in_transaction)
+	{
+	    reply += "ERR already in a transaction\n";
+	    return CMD_CONTINUE;
+	}
+	session.in_transaction = true;
+	session.pending.clear();
+    }
+    else if(strcmp(verb, "COMMIT") == 0 || strcmp(verb, "ABORT") == 0)
+    {
+	if(!session.in_transaction)
+	{
+	    reply += "ERR no transaction\n";
+	    return CMD_CONTINUE;
+	}
+	session.in_transaction = false;
+	if(verb[0] == 'C')
+	{
+	    if(!commit_transaction(inventory, session.pending, error))
+	    {
+		session.pending.clear();
+		reply += "ERR " + error + EOLN;
+		return CMD_CONTINUE;
+	    }
+	    count = session.pending.size();
+	}
+	session.pending.clear();
+    }
+    else if(strcmp(verb, "STATS") == 0)
+    {
+	int seconds = -1;
+	bool named = next_word(line, name, sizeof(name));
+	bool every = named && strcmp(name, "every") == 0;
+	bool json = named && strcmp(name, "json") == 0;
+	bool filed = false;        // every gave a file, and a valid format
+
+	if(every && next_number(line, seconds) && seconds > 0 &&
+	   next_word(line, arg, sizeof(arg)))
+	{
+	    filed = true;
+	    if(next_word(line, name, sizeof(name)))
+	    {
+		json = strcmp(name, "json") == 0;
+		filed = json || strcmp(name, "text") == 0;
+	    }
+	}
+
+	if(*line == '\0' &&
+	   (!named || (!every && (json || strcmp(name, "text") == 0))))
+	{
+	    count = format_stats(inventory, json, reply);
+	}
+	else if(*line == '\0' && !every &&
+		(strcmp(name, "on") == 0 || strcmp(name, "off") == 0))
+	{
+	    metrics.enabled = (name[1] == 'n');
+	}
+	else if(*line == '\0' && every && seconds == 0)
+	{
+	    stop_stats_dump();
+	}
+	else if(*line == '\0' && filed)
+	{
+	    start_stats_dump(inventory, seconds, arg, json);
+	}
+	else
+	{
+	    reply += "ERR STATS needs text, json, on, off or every "
+		     "<seconds> <file> [json]\n";
+	    return CMD_CONTINUE;
+	}
+    }
+    else if(strcmp(verb, "SAVE") == 0)
+    {
+	if(!next_word(line, arg, sizeof(arg)) || *line != '\0')
+	{
+	    reply += "ERR SAVE needs a file name\n";
+	    return CMD_CONTINUE;
+	}
+	if(!save_inventory(inventory, arg))
+	{
+	    reply += "ERR unable to open ";
+	    reply += arg;
+	    reply += EOLN;
+	    return CMD_CONTINUE;
+	}
+    }
+    else if(strcmp(verb, "EXPORT") == 0)
+    {
+	OutputFormat format;
+
+	if(!next_word(line, name, sizeof(name)) ||
+	   !next_word(line, arg, sizeof(arg)) || *line != '\0' ||
+	   !format_named(name, format))
+	{
+	    reply += "ERR EXPORT needs a format and a file name\n";
+	    return CMD_CONTINUE;
+	}
+	if(!export_inventory(inventory, arg, format, &count))
+	{
+	    reply += "ERR unable to write ";
+	    reply += arg;
+	    reply += EOLN;
+	    return CMD_CONTINUE;
+	}
+    }
+    else if(strcmp(verb, "QUIT") == 0)
+    {
+	reply += "OK 0\n";
+	return CMD_QUIT;
+    }
+    else if(strcmp(verb, "SHUTDOWN") == 0)
+    {
+	reply += "OK 0\n";
+	return CMD_SHUTDOWN;
+    }
+    else
+    {
+	reply += "ERR unknown command ";
+	reply += verb;
+	reply += EOLN;
+	return CMD_CONTINUE;
+    }
+
+    reply += "OK " + to_string(count) + EOLN;
+    return CMD_CONTINUE;
+}
+
+//*********************************************************************
+// Function:  run_batch
+// Purpose:   to run a script of commands
+//
+// Details:   reads commands a line at a time until end of input or
+//            QUIT. Replies are gathered and written in REPLY_FLUSH
+//            sized pieces rather than one per command.
+// Inputs:    inventory - the database
+//            in - the commands
+// Outputs:   out - the replies
+//
+//*********************************************************************
+
+void run_batch (Inventory &inventory, istream &in, ostream &out)
+{
+    string line;
+    string reply;
+    Session session = { false, Transaction() };
+    CommandStatus status = CMD_CONTINUE;
+
+    while(status == CMD_CONTINUE && getline(in, line))
+    {
+	status = execute_command(inventory, session, line.c_str(), reply);
+	if(reply.size() >= (size_t)REPLY_FLUSH)
+	{
+	    out.write(reply.data(), reply.size());
+	    reply.clear();
+	}
+    }
+    out.write(reply.data(), reply.size());
+    out.flush();
+    return;
+}
+
+//*********************************************************************
+// Function:  serve
+// Purpose:   to serve the inventory on a Unix domain socket
+//
+// Details:   any file already at path is removed before binding. Each
+//            accepted client is handed to serve_client on a thread of
+//            its own; the shard locks keep them apart. The threads of
+//            clients that have gone are joined as new ones arrive.
+//            Once a client sends SHUTDOWN no more are accepted, the
+//            sockets of the rest are shut down, so each ends once its
+//            command in hand is done, and every thread is joined
+//            before returning: nothing is left running that could
+//            still use the inventory.
+//
+//            Only SHUTDOWN ends the accept loop. An accept that fails
+//            for any other reason is tried again: at once after a
+//            signal or a client that gave up while queued, and after
+//            ACCEPT_RETRY_MS otherwise, such as when the process is out
+//            of file descriptors; the waiting clients stay queued. A
+//            failure is reported once, until an accept works again.
+// Inputs:    inventory - the database
+//            path - the socket file name
+// Outputs:   returns false if the socket could not be set up
+//
+//*********************************************************************
+
+bool serve (Inventory &inventory, const char path[])
+{
+    sockaddr_un address;
+    Server server;
+    vector<thread> gone;
+    int client;
+    bool failing = false;             // accept's failure has been reported
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address.sun_path))
+    {
+	cerr << "socket path too long: " << path << endl;
+	return false;
+    }
+    strcpy(address.sun_path, path);
+
+    server.listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if(server.listener < 0 ||
+       bind(server.listener, (sockaddr *)&address, sizeof(address)) < 0 ||
+       listen(server.listener, SOMAXCONN) < 0)
+    {
+	cerr << "unable to listen on " << path << endl;
+	if(server.listener >= 0)
+	{
+	    close(server.listener);
+	}
+	return false;
+    }
+
+    server.stopping = false;
+    while(!server.stopping)
+    {
+	client = accept(server.listener, NULL, NULL);
+	if(client < 0)
+	{
+	    if(server.stopping || errno == EINTR || errno == ECONNABORTED)
+	    {
+		continue;
+	    }
+	    if(!failing)
+	    {
+		cerr << "unable to accept a client: " << strerror(errno)
+		     << "; retrying" << endl;
+		failing = true;
+	    }
+	    this_thread::sleep_for(chrono::milliseconds(ACCEPT_RETRY_MS));
+	    continue;
+	}
+	if(failing)
+	{
+	    cerr << "accepting clients again" << endl;
+	    failing = false;
+	}
+
+	lock_guard<mutex> lock(server.guard);
+
+	server.clients[client] = thread(serve_client, ref(inventory),
+					ref(server), client);
+	gone.swap(server.finished);
+	for(size_t worker = 0; worker < gone.size(); worker++)
+	{
+	    gone[worker].join();
+	}
+	gone.clear();
+    }
+
+    {
+	unique_lock<mutex> lock(server.guard);
+
+	for(unordered_map<int, thread>::const_iterator open =
+		server.clients.begin(); open != server.clients.end(); open++)
+	{
+	    shutdown(open->first, SHUT_RDWR);
+	}
+	server.all_gone.wait(lock, [&]() { return server.clients.empty(); });
+	gone.swap(server.finished);
+    }
+    for(size_t worker = 0; worker < gone.size(); worker++)
+    {
+	gone[worker].join();
+    }
+    close(server.listener);
+    unlink(path);
+    return true;
+}
+
+//*********************************************************************
+// Function:  serve_client
+// Purpose:   to run one client's commands
+//
+// Details:   reads whatever the client has sent, runs every complete
+//            line in it, and sends all of the replies back in one
+//            write. A partial line is kept until the rest arrives.
+//            A line longer than COMMAND_LINE_MAX is not a command, and
+//            is answered with an error and the connection closed, so
+//            a client that never sends a newline cannot make the
+//            server hold an ever growing line.
+//            A client that hangs up before reading its replies only
+//            ends its own session; MSG_NOSIGNAL keeps the SIGPIPE from
+//            stopping the server.
+//            SHUTDOWN marks the server stopping and shuts the listening
+//            socket down, which ends the accept loop in serve. On the way out the client's thread
+//            is handed to serve to be joined.
+// Inputs:    inventory - the database
+//            server - the clients being served
+//            client - the connected socket, closed on return
+//
+//*********************************************************************
+
+void serve_client (Inventory &inventory, Server &server, int client)
+{
+    char chunk[READ_CHUNK];
+    string pending;                // received but not yet a whole line
+    string reply;                  // replies not yet sent
+    Session session = { false, Transaction() };
+    CommandStatus status = CMD_CONTINUE;
+    ssize_t got;
+
+    while(status == CMD_CONTINUE &&
+	  (got = read(client, chunk, sizeof(chunk))) > 0)
+    {
+	size_t start = 0;
+	size_t end;
+
+	pending.append(chunk, got);
+	while(status == CMD_CONTINUE &&
+	      (end = pending.find(EOLN, start)) != string::npos &&
+	      end - start <= COMMAND_LINE_MAX)
+	{
+	    pending[end] = '\0';
+	    status = execute_command(inventory, session,
+				     pending.c_str() + start, reply);
+	    start = end + 1;
+	}
+	pending.erase(0, start);
+	if(status == CMD_CONTINUE && pending.size() > COMMAND_LINE_MAX)
+	{
+	    reply += "ERR lines may be at most " +
+		     to_string(COMMAND_LINE_MAX) + " characters\n";
+	    status = CMD_QUIT;
+	}
+
+	size_t sent = 0;
+	while(sent < reply.size())
+	{
+	    ssize_t put = send(client, reply.data() + sent,
+			       reply.size() - sent, MSG_NOSIGNAL);
+	    if(put <= 0)
+	    {
+		status = CMD_QUIT;
+		break;
+	    }
+	    sent += put;
+	}
+	reply.clear();
+    }
+
+    if(status == CMD_SHUTDOWN)
+    {
+	server.stopping = true;
+	shutdown(server.listener, SHUT_RDWR);
+    }
+    lock_guard<mutex> lock(server.guard);
+    server.finished.push_back(move(server.clients[client]));
+    server.clients.erase(client);
+    close(client);
+    server.all_gone.notify_all();
+    return;
+}
+
+//*********************************************************************
+// Function:  next_random
+// Purpose:   to draw a pseudo-random number
+//
+// Details:   splitmix64; small, fast and good enough for making test
+//            data. The same seed always gives the same sequence.
+// Inputs:    state - the generator state
+// Outputs:   state - advanced
+//            returns the next 64 random bits
+//
+//*********************************************************************
+
+uint64_t next_random (uint64_t &state)
+{
+    uint64_t mixed = (state += 0x9E3779B97F4A7C15ull);
+
+    mixed = (mixed ^ (mixed >> 30)) * 0xBF58476D1CE4E5B9ull;
+    mixed = (mixed ^ (mixed >> 27)) * 0x94D049BB133111EBull;
+    return mixed ^ (mixed >> 31);
+}
+
+//*********************************************************************
+// Function:  open_synthetic
+// Purpose:   to set up the shape of a synthetic inventory
+//
+// Details:   One author per SYNTHETIC_BOOKS_PER_AUTHOR records, with
+//            made up surnames of two to four syllables. Authors are
+//            drawn with Zipf weights (the k-th most popular is chosen
+//            in proportion to 1/k), so that a few authors have many
+//            books and most have a few, as in a real warehouse.
+// Inputs:    records - the size of inventory to be made
+//            seed - picks one of many inventories of that size
+// Outputs:   shape - the authors and their weights
+//
+//*********************************************************************
+
+void open_synthetic (Synthetic &shape, size_t records, uint64_t seed)
+{
+    const char *syllables[] = { "an", "ber", "cla", "dor", "el", "fin",
+				"gar", "hol", "is", "jen", "kel", "lan",
+				"mor", "nel", "ob", "per", "quin", "ros",
+				"sta", "tor", "ul", "van", "wes", "yor" };
+    const size_t kinds = sizeof(syllables) / sizeof(syllables[0]);
+    size_t authors = max(records / SYNTHETIC_BOOKS_PER_AUTHOR, (size_t)1);
+    double total = 0;
+
+    shape.seed = seed;
+    shape.authors.clear();
+    shape.weights.clear();
+    for(size_t author = 0; author < authors; author++)
+    {
+	uint64_t state = seed ^ (author * 0xD1B54A32D192ED03ull);
+	int parts = 2 + next_random(state) % 3;
+	string name;
+
+	for(int part = 0; part < parts; part++)
+	{
+	    name += syllables[next_random(state) % kinds];
+	}
+	name[0] = toupper(name[0]);
+	name.resize(min(name.size(), (size_t)MAX_AUTHOR_NAME));
+	shape.authors.push_back(name);
+	total += 1.0 / (author + 1);
+	shape.weights.push_back(total);
+    }
+    for(size_t author = 0; author < authors; author++)
+    {
+	shape.weights[author] /= total;
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  synthetic_number
+// Purpose:   to give the inventory number of a synthetic record
+//
+// Details:   the record's position times an odd constant, modulo 2^31.
+//            Multiplying by an odd number is one to one modulo a power
+//            of two, so the numbers are all different and positive,
+//            and they are scattered rather than in order.
+// Inputs:    index - the position of the record, from 0
+// Outputs:   returns its inventory number
+//
+//*********************************************************************
+
+int synthetic_number (size_t index)
+{
+    return (int)(((uint64_t)(index + 1) * 2654435761ull) & INT_MAX);
+}
+
+//*********************************************************************
+// Function:  synthetic_author
+// Purpose:   to draw an author with the Zipf weights
+//
+// Inputs:    shape - the authors and weights
+//            state - the generator state
+// Outputs:   state - advanced
+//            returns the index of an author
+//
+//*********************************************************************
+
+size_t synthetic_author (const Synthetic &shape, uint64_t &state)
+{
+    double draw = (next_random(state) >> 11) * (1.0 / (1ull << 53));
+
+    return min((size_t)(lower_bound(shape.weights.begin(),
+				    shape.weights.end(), draw) -
+			shape.weights.begin()),
+	       shape.authors.size() - 1);
+}
+
+//*********************************************************************
+// Function:  synthetic_entry
+// Purpose:   to make one record of a synthetic inventory
+//
+// Details:   The record at a given index is always the same for the
+//            same shape, so a benchmark can look up records it knows
+//            are there without keeping them. Comments are a dozen
+//            categories drawn with the same skew as the authors,
+//            locations are any bin of shelves a to z, titles are two
+//            to four words,
+//            and one book in ten is back-ordered and one in ten has
+//            none on hand.
+// Inputs:    shape - the authors and weights
+//            index - the position of the record, from 0
+// Outputs:   entry - the record
+//
+//*********************************************************************
+
+void synthetic_entry (const Synthetic &shape, size_t index, Entry &entry)
+{
+    const char *words[] = { "The", "Red", "Rabbit", "Java", "Gently",
+			    "Sum", "of", "All", "Fears", "Data", "Night",
+			    "River", "Lost", "City", "Code", "Empire",
+			    "Storm", "Garden", "Machine", "Winter" };
+    const char *comments[] = { "computer science", "science fiction",
+			       "action", "economics", "suspense", "saga",
+			       "history", "poetry", "mathematics",
+			       "philosophy", "children", "reference" };
+    const size_t word_kinds = sizeof(words) / sizeof(words[0]);
+    const size_t comment_kinds = sizeof(comments) / sizeof(comments[0]);
+    uint64_t state = shape.seed ^ (index * 0x9FB21C651E98DF25ull);
+    int stock = next_random(state) % 10;
+    string title;
+
+    strcpy(entry.author_name,
+	   shape.authors[synthetic_author(shape, state)].c_str());
+    entry.author_initial = 'A' + next_random(state) % 26;
+    entry.inventory_number = synthetic_number(index);
+    snprintf(entry.location, sizeof(entry.location), "%c-%02d",
+	     (char)('a' + next_random(state) % 26),
+	     (int)(next_random(state) % 100));
+    for(int word = 2 + next_random(state) % 3; word > 0; word--)
+    {
+	if(!title.empty())
+	{
+	    title += ' ';
+	}
+	title += words[next_random(state) % word_kinds];
+    }
+    title.resize(min(title.size(), (size_t)MAX_TITLE));
+    strcpy(entry.title, title.c_str());
+    strcpy(entry.comment, comments[min(synthetic_author(shape, state),
+				       comment_kinds - 1)]);
+    entry.quantity = (stock == 0) ? -(int)(1 + next_random(state) % 20) :
+		     (stock == 1) ? 0 : (int)(1 + next_random(state) % 50);
+    return;
+}
+
+//*********************************************************************
+// Function:  generate_inventory
+// Purpose:   to write a synthetic inventory file
+//
+// Details:   The file has the layout readfile expects. It is written
+//            in chunks as it is made, so no more than a chunk is held
+//            in memory whatever the size.
+// Inputs:    shape - the authors and weights
+//            records - the number of records to write
+//            filename - the file to write
+// Outputs:   returns false if the file could not be written
+//
+//*********************************************************************
+
+bool generate_inventory (const Synthetic &shape, size_t records,
+                         const char filename[])
+{
+    ofstream outp(filename, ios::out | ios::binary);
+    OutputBuffer output;
+    Entry entry;
+
+    if(outp.fail())
+    {
+	return false;
+    }
+    start_output(output, outp);
+    for(size_t index = 0; index < records; index++)
+    {
+	synthetic_entry(shape, index, entry);
+	put_entry(output, entry, FMT_FILE, 0);
+    }
+    return flush_output(output);
+}
+
+//*********************************************************************
+// Function:  mix_named
+// Purpose:   to find a workload mix by name
+//
+// Inputs:    name - lookup, prefix, delete, mixed or pick
+// Outputs:   returns the mix, or NULL for any other name
+//
+//*********************************************************************
+
+const WorkloadMix *mix_named (const char name[])
+{
+    for(size_t mix = 0; mix < sizeof(WORKLOAD_MIXES) /
+			      sizeof(WORKLOAD_MIXES[0]); mix++)
     {
-	compare = strncmp(inventory[loop].author_name, lastName, 
-			  strlen(lastName));
-	if(compare == 0)
+	if(strcmp(name, WORKLOAD_MIXES[mix].name) == 0)
 	{
-	    cout << "# " << count << endl;
-	    write_entry(inventory, loop);
-	    count++;
-	    found = true;
+	    return &WORKLOAD_MIXES[mix];
+	}
+    }
+    return NULL;
+}
+
+//*********************************************************************
+// Function:  run_workload
+// Purpose:   to run one client's share of a benchmark
+//
+// Details:   Each operation is sent through execute_command, just as
+//            a pick station's would be, and timed: GET of a record
+//            that was loaded, FIND of an author's name, or REMOVE of
+//            a loaded record (which may already be gone). Authors for
+//            FIND are chosen evenly, not by popularity, so a run does
+//            not hinge on how many books the top author happens to
+//            have.
+// Inputs:    inventory - the database
+//            shape - the inventory's authors and weights
+//            records - how many records were loaded
+//            mix - the share of each kind of operation
+//            operations - how many to run
+//            seed - this client's seed
+// Outputs:   inventory - less any records removed
+//            latencies - nanoseconds taken by each operation, by kind
+//
+//*********************************************************************
+
+void run_workload (Inventory &inventory, const Synthetic &shape,
+                   size_t records, const WorkloadMix &mix,
+                   size_t operations, uint64_t seed,
+                   vector<uint64_t> latencies[])
+{
+    Session session = { false, Transaction() };
+    uint64_t state = seed;
+    string command;
+    string reply;
+
+    for(size_t done = 0; done < operations; done++)
+    {
+	int draw = next_random(state) % 100;
+	int kind = 0;
+
+	while(kind < BENCH_KINDS - 1 && draw >= mix.percent[kind])
+	{
+	    draw -= mix.percent[kind];
+	    kind++;
 	}
-	else if(compare > 0)
+	switch(kind)
 	{
-	    loop = no_entries;
+	  case BENCH_LOOKUP:
+	    command = "GET " + to_string(synthetic_number(
+				   next_random(state) % records));
+	    break;
+	  case BENCH_PREFIX:
+	    command = "FIND " + shape.authors[next_random(state) %
+					       shape.authors.size()];
+	    break;
+	  default:
+	    command = "REMOVE " + to_string(synthetic_number(
+				      next_random(state) % records));
+	    break;
 	}
-	loop++;
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	execute_command(inventory, session, command.c_str(), reply);
+	latencies[kind].push_back(chrono::duration_cast<chrono::nanoseconds>(
+				      chrono::steady_clock::now() - start)
+				  .count());
+	reply.clear();
     }
+    return;
+}
 
-    if(!found)
+//*********************************************************************
+// Function:  put_latencies
+// Purpose:   to append a JSON summary of some timed operations
+//
+// Details:   sorts the latencies and gives the count, the rate over
+//            the whole run, and the 50th, 90th, 99th and 99.9th
+//            percentiles and the worst, in microseconds.
+// Inputs:    text - the report so far
+//            latencies - nanoseconds taken by each operation
+//            seconds - the length of the run
+// Outputs:   text - with the summary object added
+//
+//*********************************************************************
+
+void put_latencies (string &text, vector<uint64_t> &latencies,
+                    double seconds)
+{
+    const double wanted[] = { 50, 90, 99, 99.9 };
+    const char *names[] = { "p50_us", "p90_us", "p99_us", "p999_us" };
+    char number[32];
+
+    sort(latencies.begin(), latencies.end());
+    text += "{\"count\": ";
+    put_number(text, latencies.size());
+    snprintf(number, sizeof(number), "%.1f",
+	     seconds > 0 ? latencies.size() / seconds : 0.0);
+    text += ", \"ops_per_sec\": ";
+    text += number;
+    for(int rank = 0; rank < 4; rank++)
     {
-	cout << endl << lastName << " not found in inventory." << endl;
+	size_t at = latencies.empty() ? 0 :
+		    min((size_t)(wanted[rank] / 100 * latencies.size()),
+			latencies.size() - 1);
+	snprintf(number, sizeof(number), "%.3f",
+		 latencies.empty() ? 0.0 : latencies[at] / 1000.0);
+	text += ", \"";
+	text += names[rank];
+	text += "\": ";
+	text += number;
+    }
+    snprintf(number, sizeof(number), "%.3f",
+	     latencies.empty() ? 0.0 : latencies.back() / 1000.0);
+    text += ", \"max_us\": ";
+    text += number;
+    text += '}';
+    return;
+}
+
+//*********************************************************************
+// Function:  run_benchmark
+// Purpose:   to measure the inventory on a synthetic workload
+//
+// Details:   Writes a synthetic inventory of the given size to a
+//            temporary file and times:
+//              bulk load - load_inventory, the work of readfile
+//              the mix   - operations spread over some client
+//                          threads; see run_workload
+//              save      - save_inventory, the work of writefile
+//            and reports each as JSON on one line, with the peak
+//            resident memory of the process. The temporary files are
+//            removed afterwards.
+// Inputs:    inventory - the database, which is replaced
+//            records - the size of inventory to make
+//            mix - the workload mix
+//            operations - the number of operations in the mix
+//            clients - the number of threads running the mix
+// Outputs:   out - the JSON report
+//            returns false if the temporary files could not be made
+//
+//*********************************************************************
+
+bool run_benchmark (Inventory &inventory, size_t records,
+                    const WorkloadMix &mix, size_t operations,
+                    int clients, ostream &out)
+{
+    const char *kinds[BENCH_KINDS] = { "lookup", "prefix", "delete" };
+    char data_file[] = "/tmp/bookWarehouseDB.XXXXXX";
+    char save_file[] = "/tmp/bookWarehouseDB.XXXXXX";
+    int data = mkstemp(data_file);
+    int save = mkstemp(save_file);
+    Synthetic shape;
+    vector<vector<uint64_t> > latencies(clients * BENCH_KINDS);
+    vector<thread> workers;
+    vector<uint64_t> all;
+    string report;
+    char number[32];
+    bool success;
+    rusage usage;
+
+    if(data < 0 || save < 0)
+    {
+	return false;
+    }
+    close(data);
+    close(save);
+    open_synthetic(shape, records, BENCH_SEED);
+    success = generate_inventory(shape, records, data_file);
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    success = success && load_inventory(inventory, data_file);
+    double load_seconds = chrono::duration<double>(
+	chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    for(int client = 0; success && client < clients; client++)
+    {
+	workers.push_back(thread(run_workload, ref(inventory), cref(shape),
+				 records, cref(mix),
+				 operations / clients +
+				     (client < (int)(operations % clients)),
+				 BENCH_SEED + client + 1,
+				 &latencies[client * BENCH_KINDS]));
+    }
+    for(size_t worker = 0; worker < workers.size(); worker++)
+    {
+	workers[worker].join();
+    }
+    double mix_seconds = chrono::duration<double>(
+	chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    success = success && save_inventory(inventory, save_file);
+    double save_seconds = chrono::duration<double>(
+	chrono::steady_clock::now() - start).count();
+    unlink(data_file);
+    unlink(save_file);
+    if(!success)
+    {
+	return false;
+    }
+
+    report = "{\"records\": ";
+    put_number(report, records);
+    report += ", \"mix\": \"";
+    report += mix.name;
+    report += "\", \"clients\": ";
+    put_number(report, clients);
+    report += ", \"shards\": ";
+    put_number(report, inventory.shards.size());
+    snprintf(number, sizeof(number), "%.3f", load_seconds);
+    report += ", \"load\": {\"seconds\": ";
+    report += number;
+    snprintf(number, sizeof(number), "%.1f",
+	     load_seconds > 0 ? records / load_seconds : 0.0);
+    report += ", \"records_per_sec\": ";
+    report += number;
+    snprintf(number, sizeof(number), "%.3f", save_seconds);
+    report += "}, \"save\": {\"seconds\": ";
+    report += number;
+    report += "}";
+    for(int kind = 0; kind < BENCH_KINDS; kind++)
+    {
+	vector<uint64_t> timed;
+
+	for(int client = 0; client < clients; client++)
+	{
+	    vector<uint64_t> &own = latencies[client * BENCH_KINDS + kind];
+	    timed.insert(timed.end(), own.begin(), own.end());
+	}
+	all.insert(all.end(), timed.begin(), timed.end());
+	if(!timed.empty())
+	{
+	    report += ", \"";
+	    report += kinds[kind];
+	    report += "\": ";
+	    put_latencies(report, timed, mix_seconds);
+	}
+    }
+    report += ", \"total\": ";
+    put_latencies(report, all, mix_seconds);
+    getrusage(RUSAGE_SELF, &usage);
+    report += ", \"peak_rss_kb\": ";
+    put_number(report, usage.ru_maxrss);
+    report += "}\n";
+    out << report;
+    out.flush();
+    return true;
+}
+
+//*********************************************************************
+// Function:  thread_metrics
+// Purpose:   to find the calling thread's metrics block
+//
+// Details:   A thread is given a block the first time it records
+//            anything, and gives it back when it ends; the next new
+//            thread reuses it rather than adding another. Counts in a
+//            block are never reset, so nothing recorded is lost when
+//            a thread ends. Only the owning thread writes a block, so
+//            recording is a relaxed load and store with no lock and
+//            no read-modify-write; readers add the blocks up.
+// Outputs:   returns the block
+//
+//*********************************************************************
+
+ThreadMetrics &thread_metrics ()
+{
+    if(own_metrics.block == NULL)
+    {
+	lock_guard<mutex> lock(metrics.guard);
+
+	if(metrics.idle.empty())
+	{
+	    metrics.blocks.emplace_back();
+	    own_metrics.block = &metrics.blocks.back();
+	}
+	else
+	{
+	    own_metrics.block = metrics.idle.back();
+	    metrics.idle.pop_back();
+	}
     }
+    return *own_metrics.block;
+}
+
+//*********************************************************************
+// Function:  ~MetricsHandle
+// Purpose:   to give a thread's metrics block back as the thread ends
+//
+//*********************************************************************
+
+MetricsHandle::~MetricsHandle ()
+{
+    if(block != NULL)
+    {
+	lock_guard<mutex> lock(metrics.guard);
+	metrics.idle.push_back(block);
+    }
+}
+
+//*********************************************************************
+// Function:  bump
+// Purpose:   to add to one of the calling thread's metrics
+//
+// Inputs:    value - the metric
+//            amount - how much to add
+// Outputs:   value - increased
+//
+//*********************************************************************
+
+void bump (atomic<uint64_t> &value, uint64_t amount)
+{
+    value.store(value.load(memory_order_relaxed) + amount,
+		memory_order_relaxed);
+    return;
+}
+
+//*********************************************************************
+// Function:  count_metric
+// Purpose:   to count an event, such as an index miss
+//
+// Inputs:    counter - what happened
+//            amount - how many times
+//
+//*********************************************************************
 
+void count_metric (MetricCounter counter, uint64_t amount)
+{
+    if(metrics.enabled.load(memory_order_relaxed))
+    {
+	bump(thread_metrics().counters[counter], amount);
+    }
     return;
 }
 
 //*********************************************************************
-// Function:  remove
-// Purpose:   to remove entries the user wishes to remove
+// Function:  latency_bucket, bucket_ceiling
+// Purpose:   to map a latency to its histogram bucket and back
 //
-// Details:   loops until the inventory number inputted is found 
-//            in the entry array. If found, the user confirms if it is
-//            the correct entry to be deleted. It then shifts down all
-//            the values above the selected entry which is overwritten.
-// Inputs:    inventory - the database array
-//            no_entries - the number of entries 
-// Outputs:   inventory - with a single entry deleted
-//            no_entries - altered if an entry is deleted
+// Details:   HDR style: below 2^HIST_SUB_BITS nanoseconds each value
+//            has a bucket; above, each power of two is split into
+//            2^HIST_SUB_BITS buckets, so a bucket is never wider than
+//            1/8 of its values - 12.5% precision from nanoseconds to
+//            half an hour, in HIST_BUCKETS counters.
+// Inputs:    nanoseconds - a latency
+//            bucket - a bucket
+// Outputs:   returns the bucket of a latency, or the largest latency
+//            a bucket holds
 //
 //*********************************************************************
 
-void remove (Entry inventory[], int &no_entries)
+int latency_bucket (uint64_t nanoseconds)
 {
-    char confirm;
-    int invNum;
-    int loop = 0;
-    bool found = false;
-    cout << "Enter the inventory number of the book" <<
-            "record you wish to remove: ";
-    cin >> invNum;
-    
-    while(loop < no_entries)
+    const uint64_t linear = 1ull << HIST_SUB_BITS;
+
+    if(nanoseconds < linear)
+    {
+	return (int)nanoseconds;
+    }
+
+    int octave = 63 - __builtin_clzll(nanoseconds);
+    int sub = (nanoseconds >> (octave - HIST_SUB_BITS)) & (linear - 1);
+
+    return min((octave - HIST_SUB_BITS + 1) * (int)linear + sub,
+	       HIST_BUCKETS - 1);
+}
+
+uint64_t bucket_ceiling (int bucket)
+{
+    const int linear = 1 << HIST_SUB_BITS;
+
+    if(bucket < linear)
+    {
+	return bucket;
+    }
+
+    int octave = bucket / linear + HIST_SUB_BITS - 1;
+    uint64_t sub = bucket % linear;
+
+    return ((linear + sub + 1) << (octave - HIST_SUB_BITS)) - 1;
+}
+
+//*********************************************************************
+// Function:  TimedOp, ~TimedOp
+// Purpose:   to time an operation from here to the end of the scope
+//
+// Details:   While metrics are enabled every operation is counted,
+//            and one in METRIC_SAMPLING of each kind is timed: the
+//            time taken, its histogram bucket and the worst time so
+//            far go in the calling thread's block. The clock is not
+//            read for the rest.
+// Inputs:    op - the operation
+//
+//*********************************************************************
+
+TimedOp::TimedOp (MetricOp op) : op(op), timing(false)
+{
+    if(metrics.enabled.load(memory_order_relaxed))
+    {
+	ThreadMetrics &own = thread_metrics();
+	uint64_t done = own.operations[op].load(memory_order_relaxed);
+
+	bump(own.operations[op], 1);
+	timing = (done & (METRIC_SAMPLING[op] - 1)) == 0;
+	if(timing)
+	{
+	    start = chrono::steady_clock::now();
+	}
+    }
+}
+
+TimedOp::~TimedOp ()
+{
+    if(!timing)
+    {
+	return;
+    }
+    uint64_t taken = chrono::duration_cast<chrono::nanoseconds>(
+	chrono::steady_clock::now() - start).count();
+    ThreadMetrics &own = thread_metrics();
+
+    bump(own.timed[op], 1);
+    bump(own.total_ns[op], taken);
+    bump(own.latency[op][latency_bucket(taken)], 1);
+    if(taken > own.max_ns[op].load(memory_order_relaxed))
+    {
+	own.max_ns[op].store(taken, memory_order_relaxed);
+    }
+}
+
+//*********************************************************************
+// Function:  structure_bytes
+// Purpose:   to estimate the memory each structure of the inventory
+//            uses
+//
+// Details:   Vectors and strings are measured by capacity. Tree and
+//            hash nodes cannot be measured, so each is counted as its
+//            contents plus MAP_NODE_OVERHEAD or HASH_NODE_OVERHEAD
+//            bytes of pointers and colour or hash, and each hash
+//            bucket as one pointer; these are the sizes in the usual
+//            64 bit standard libraries. Walks the text index's
+//            postings, so costs O(words), not O(records). Takes each
+//            shard's read lock in turn.
+// Inputs:    inventory - the database
+// Outputs:   sizes - bytes per structure, in the order of
+//                    STRUCTURE_NAMES
+//
+//*********************************************************************
+
+void structure_bytes (const Inventory &inventory, uint64_t sizes[])
+{
+    fill(sizes, sizes + MEM_KINDS, 0);
+    for(size_t index = 0; index < inventory.shards.size(); index++)
+    {
+	const Shard &shard = *inventory.shards[index];
+	READ_LOCK lock(shard.guard);
+	const TextIndex &text = shard.text;
+
+	sizes[MEM_RECORDS] += shard.book.capacity() * sizeof(Record) +
+			      shard.free_slots.capacity() * sizeof(int);
+	sizes[MEM_TITLES] += shard.titles.capacity();
+	sizes[MEM_FILTERS] += (shard.number_filter.bits.capacity() +
+			       shard.name_filter.bits.capacity()) *
+			      sizeof(uint64_t);
+	if(shard.pages)
+	{
+	    lock_guard<mutex> pool(shard.pages->guard);
+
+	    sizes[MEM_PAGE_POOL] += shard.pages->memory.capacity() +
+		shard.pages->frames.capacity() * sizeof(PageFrame) +
+		shard.pages->resident.size() *
+		(sizeof(pair<int, size_t>) + HASH_NODE_OVERHEAD);
+	}
+	for(size_t id = 0; id < shard.strings.strings.size(); id++)
+	{
+	    sizes[MEM_STRINGS] += sizeof(string) +
+		shard.strings.strings[id].capacity();
+	}
+	sizes[MEM_STRINGS] += shard.strings.ids.bucket_count() *
+			      sizeof(void *) +
+			      shard.strings.ids.size() *
+			      (sizeof(string_view) + sizeof(uint32_t) +
+			       HASH_NODE_OVERHEAD) +
+			      (shard.strings.uses.capacity() +
+			       shard.strings.free_ids.capacity()) *
+			      sizeof(uint32_t);
+	sizes[MEM_NAME_INDEX] += shard.by_name.size() *
+				 (sizeof(NAME_INDEX::value_type) +
+				  MAP_NODE_OVERHEAD);
+	sizes[MEM_NUMBER_INDEX] += shard.by_number.bucket_count() *
+				   sizeof(void *) +
+				   shard.by_number.size() *
+				   (sizeof(NUMBER_INDEX::value_type) +
+				    HASH_NODE_OVERHEAD);
+	sizes[MEM_LOCATION_INDEX] += shard.by_location.size() *
+				     (sizeof(LOCATION_INDEX::value_type) +
+				      MAP_NODE_OVERHEAD);
+	sizes[MEM_TEXT_INDEX] += text.word_ids.bucket_count() *
+				 sizeof(void *) +
+				 text.word_ids.size() *
+				 (sizeof(string) + sizeof(int) +
+				  HASH_NODE_OVERHEAD) +
+				 text.words.capacity() * sizeof(string) +
+				 text.postings.capacity() * sizeof(Posting);
+	for(size_t word = 0; word < text.postings.size(); word++)
+	{
+	    sizes[MEM_TEXT_INDEX] += text.words[word].capacity() +
+		(text.postings[word].slots.capacity() +
+		 text.postings[word].added.capacity()) * sizeof(int);
+	}
+	for(unordered_map<string, vector<int> >::const_iterator gram =
+		text.grams.begin(); gram != text.grams.end(); gram++)
+	{
+	    sizes[MEM_TEXT_INDEX] += sizeof(string) + sizeof(vector<int>) +
+		HASH_NODE_OVERHEAD + gram->second.capacity() * sizeof(int);
+	}
+	sizes[MEM_TOTALS] += (shard.by_category.size() +
+			      shard.by_author.size() +
+			      shard.by_shelf.size()) *
+			     (sizeof(uint32_t) + sizeof(StockTally) +
+			      HASH_NODE_OVERHEAD);
+	sizes[MEM_DEAD_TITLES] += shard.dead_title_bytes;
+    }
+    sizes[MEM_CHANGE_RING] = inventory.changes.ring ?
+			     CHANGE_RING_SIZE * sizeof(ChangeSlot) : 0;
+    return;
+}
+
+//*********************************************************************
+// Function:  format_stats
+// Purpose:   to append every metric as text or JSON
+//
+// Details:   Adds up every thread's block. For each operation that
+//            has happened: its count, and the mean, 50th, 90th, 99th
+//            and 99.9th percentile and worst of its timed sample, in
+//            microseconds; then
+//            the index hits and misses, the title compactions and the
+//            bytes they freed, the records, and the memory of each
+//            structure. As text each metric is a line of its name and
+//            value separated by a tab; as JSON they are one object on
+//            one line. The counts are read while other threads carry
+//            on, so they may be a few operations apart from each
+//            other, but never torn.
+// Inputs:    inventory - the database
+//            json - whether to write JSON
+//            text - the text so far
+// Outputs:   text - with the metrics appended
+//            returns the number of metrics
+//
+//*********************************************************************
+
+int format_stats (const Inventory &inventory, bool json, string &text)
+{
+    const char *percentile_names[] = { "p50_us", "p90_us", "p99_us",
+				       "p999_us" };
+    const double percentiles[] = { 0.50, 0.90, 0.99, 0.999 };
+    vector<pair<string, string> > values;
+    uint64_t counters[CNT_KINDS] = { 0 };
+    uint64_t sizes[MEM_KINDS];
+    uint64_t memory = 0;
+    char number[32];
+
+    auto add = [&](const string &name, double value, const char *format)
     {
-	if(invNum == inventory[loop].inventory_number)
+	snprintf(number, sizeof(number), format, value);
+	values.push_back(pair<string, string>(name, number));
+    };
+
+    {
+	lock_guard<mutex> lock(metrics.guard);
+
+	for(int op = 0; op < MET_KINDS; op++)
 	{
-	    write_entry(inventory, loop);
-	    cout << endl << "Are you sure you wish to delete " <<
-                             "this record? (y/n) ";
-	    cin >> confirm;
-	    if(confirm == 'y')
+	    uint64_t count = 0, timed = 0, total = 0, worst = 0, seen = 0;
+	    vector<uint64_t> latency(HIST_BUCKETS, 0);
+	    string prefix = string("op.") + METRIC_OP_NAMES[op] + ".";
+
+	    for(deque<ThreadMetrics>::const_iterator block =
+		    metrics.blocks.begin(); block != metrics.blocks.end();
+		block++)
 	    {
-		while(loop < no_entries)
+		count += block->operations[op].load(memory_order_relaxed);
+		timed += block->timed[op].load(memory_order_relaxed);
+		total += block->total_ns[op].load(memory_order_relaxed);
+		worst = max(worst,
+			    block->max_ns[op].load(memory_order_relaxed));
+		for(int bucket = 0; bucket < HIST_BUCKETS; bucket++)
 		{
-		    inventory[loop] = inventory[loop + 1];
-		    loop++;
+		    latency[bucket] +=
+			block->latency[op][bucket].load(memory_order_relaxed);
 		}
-		cout << endl << "Record Deleted" << endl;
-		no_entries--;
 	    }
-	    else
+	    if(count == 0)
+	    {
+		continue;
+	    }
+	    add(prefix + "count", count, "%.0f");
+	    if(timed == 0)
+	    {
+		continue;
+	    }
+	    add(prefix + "mean_us", total / 1000.0 / timed, "%.3f");
+	    for(int rank = 0, bucket = 0; rank < 4; rank++)
+	    {
+		uint64_t wanted = (uint64_t)ceil(percentiles[rank] * timed);
+
+		while(bucket < HIST_BUCKETS - 1 &&
+		      seen + latency[bucket] < wanted)
+		{
+		    seen += latency[bucket++];
+		}
+		add(prefix + percentile_names[rank],
+		    min(bucket_ceiling(bucket), worst) / 1000.0, "%.3f");
+	    }
+	    add(prefix + "max_us", worst / 1000.0, "%.3f");
+	}
+	for(deque<ThreadMetrics>::const_iterator block =
+		metrics.blocks.begin(); block != metrics.blocks.end(); block++)
+	{
+	    for(int counter = 0; counter < CNT_KINDS; counter++)
 	    {
-		cout << endl << "Record NOT Deleted" << endl;
+		counters[counter] +=
+		    block->counters[counter].load(memory_order_relaxed);
 	    }
-	    found = true;
-	    loop = no_entries;
 	}
-	loop++;
+    }
+    for(int counter = 0; counter < CNT_KINDS; counter++)
+    {
+	add(METRIC_COUNTER_NAMES[counter], counters[counter], "%.0f");
     }
 
-    if(!found)
+    structure_bytes(inventory, sizes);
+    for(int structure = 0; structure < MEM_KINDS; structure++)
     {
-	cout << endl << "Record " << invNum << " not found. " << endl;
+	add(string("memory.") + STRUCTURE_NAMES[structure], sizes[structure],
+	    "%.0f");
+	memory += (structure == MEM_DEAD_TITLES) ? 0 : sizes[structure];
     }
-    return;
+    add("memory.total", memory, "%.0f");
+    add("records", total_entries(inventory), "%.0f");
+    add("shards", inventory.shards.size(), "%.0f");
+    add("metrics_enabled", metrics.enabled, "%.0f");
+
+    if(json)
+    {
+	text += '{';
+	for(size_t value = 0; value < values.size(); value++)
+	{
+	    text += (value == 0) ? "\"" : ", \"";
+	    text += values[value].first;
+	    text += "\": ";
+	    text += values[value].second;
+	}
+	text += "}\n";
+	return 1;
+    }
+    for(size_t value = 0; value < values.size(); value++)
+    {
+	text += values[value].first;
+	text += FIELD_SEP;
+	text += values[value].second;
+	text += EOLN;
+    }
+    return values.size();
 }
 
 //*********************************************************************
-// Function:  writefile
-// Purpose:   to save the inventory to a file.
-//
-// Details:   The file name will be read from the user.
-//            Each entry field is written to a separate line of 
-//            the file.
+// Function:  dump_stats
+// Purpose:   to append the metrics to a file every so often
 //
-// Inputs:    inventory - the database array
-//            no_entries - the number of entries
+// Details:   Runs on a thread of its own until stop_stats_dump. Each
+//            dump starts with a line "# <seconds since the epoch>" as
+//            text, or is one JSON line with a "time" added.
+// Inputs:    inventory - the database
 //
 //*********************************************************************
 
-void writefile (Entry inventory[], int no_entries)
+void dump_stats (const Inventory &inventory)
 {
-  ofstream outp;
-  int i;
-  AUTHOR_STRING filename;
- 
-  cout << "Enter the name of the inventory file: ";
-  cin >> filename;
-  outp.open (filename);
-  if (outp.fail ())
-  {
-    cout << "Unsuccessful trying to open file " << filename << endl;
-  }
-  else
-  {
-    for (i = 0; i < no_entries; i++)
+    unique_lock<mutex> lock(metrics.dump_guard);
+
+    while(!metrics.dump_cv.wait_for(lock,
+				    chrono::seconds(metrics.dump_seconds),
+				    [] { return metrics.dump_stop; }))
     {
-      outp << inventory[i].author_name << EOLN;
-      outp << inventory[i].author_initial << EOLN;
-      outp << inventory[i].inventory_number << EOLN;
-      outp << inventory[i].location << EOLN;
-      outp << inventory[i].title << EOLN;
-      outp << inventory[i].comment << EOLN;
-      outp << inventory[i].quantity << EOLN;
-    }
+	string text;
+	long long now = chrono::duration_cast<chrono::seconds>(
+	    chrono::system_clock::now().time_since_epoch()).count();
 
-    outp.close ();
-  }    
-  return;
+	if(metrics.dump_json)
+	{
+	    format_stats(inventory, true, text);
+	    text.replace(0, 1, "{\"time\": " + to_string(now) + ", ");
+	}
+	else
+	{
+	    text = "# " + to_string(now) + "\n";
+	    format_stats(inventory, false, text);
+	}
+	ofstream outp(metrics.dump_file, ios::out | ios::app | ios::binary);
+	outp.write(text.data(), text.size());
+    }
+    return;
 }
 
 //*********************************************************************
-// Function:  writefile
-// Purpose:   to output a single entry
+// Function:  start_stats_dump, stop_stats_dump
+// Purpose:   to start or stop dumping the metrics to a file
+//
+// Details:   starting replaces any dump already running.
+// Inputs:    inventory - the database
+//            seconds - the time between dumps
+//            filename - the file to append to
+//            json - whether to write JSON
 //
-// Details:   The inputted index will be used to find the values held
-//            in the entry array. Each value will be outputted to the user
+//*********************************************************************
+
+void start_stats_dump (const Inventory &inventory, int seconds,
+                       const char filename[], bool json)
+{
+    lock_guard<recursive_mutex> control(metrics.dump_control);
+
+    stop_stats_dump();
+    metrics.dump_seconds = seconds;
+    metrics.dump_file = filename;
+    metrics.dump_json = json;
+    metrics.dump_stop = false;
+    metrics.dumper = thread(dump_stats, cref(inventory));
+    return;
+}
+
+void stop_stats_dump ()
+{
+    lock_guard<recursive_mutex> control(metrics.dump_control);
+
+    if(metrics.dumper.joinable())
+    {
+	{
+	    lock_guard<mutex> lock(metrics.dump_guard);
+	    metrics.dump_stop = true;
+	}
+	metrics.dump_cv.notify_all();
+	metrics.dumper.join();
+    }
+    return;
+}
+
+//*********************************************************************
+// Function:  show_stats
+// Purpose:   to display the metrics
 //
-// Inputs:    inventory - the database array
-//            no_entries - the number of entries
+// Inputs:    inventory - the database
 //
 //*********************************************************************
 
-void write_entry(const Entry inventory[], int index)
+void show_stats (const Inventory &inventory)
 {
-    cout << left;
-    cout << setw(20) << "Author Last Name" << inventory[index].author_name 
-	 << endl;
-    cout << setw(20) << "Author Initial" << inventory[index].author_initial 
-	 << endl;
-    cout << setw(20) << "Inventory Number" << inventory[index].inventory_number 
-	 << endl;
-    cout << setw(20) << "Location" << inventory[index].location << endl;
-    cout << setw(20) << "Book Title" << inventory[index].title << endl;
-    cout << setw(20) << "Comments" << inventory[index].comment << endl;
-    cout << setw(20) << "Quantity" << inventory[index].quantity << endl;
+    string text;
+
+    format_stats(inventory, false, text);
+    cout << endl << text;
+    return;
 }
@@ -0,0 +1,2232 @@
+// *********************************************************************
+//
+// Source File: bookWarehouseDB_test.cpp
+//
+// Purpose:
+//  Checks of the inventory database that are hard to make by hand:
+//  many clients at once, servers shut down mid-command, bad input
+//  files and the like.
+//
+// Details:
+//
+// The program is compiled in whole, with its main renamed, so that
+// the checks can call its functions directly. Build and run from the
+// program's directory with
+//
+//    g++ -std=c++17 -O2 -pthread -o bookWarehouseDB_test
+//        tests/bookWarehouseDB_test.cpp
+//    ./bookWarehouseDB_test [<check name> ...]
+//
+// With no names every check is run except the throughput measurement,
+// which is run only when named. Each check has TEST_SECONDS to finish;
+// one that hangs is reported as failed and the run stops. The exit
+// status is 0 only if every check run passed.
+//
+// *********************************************************************
+
+#define main bookWarehouseDB_main
+#include "../bookWarehouseDB.cpp"
+#undef main
+
+#include <csignal>
+#include <dirent.h>
+#include <set>
+
+const int TEST_SECONDS    = 120;  // longest any one check may take
+const double THROUGHPUT_FLOOR = 0.5;
+                                  // least share of one client's rate
+                                  // that many clients may fall to
+
+#define CHECK(condition) check((condition), #condition, __FILE__, __LINE__)
+
+struct TestCase
+{
+   const char  *name;
+   void       (*run)();
+   bool         by_default;         // run when no check is named
+};
+
+int failures = 0;                   // failed CHECKs so far
+const char *running = "";           // name of the check under way
+
+void check (bool passed, const char condition[], const char file[],
+            int line);            // count and report a failed condition
+void timed_out (int);             // SIGALRM handler: a check hung
+void open_test_inventory (Inventory&, size_t records, size_t shards);
+                                  // a synthetic inventory in memory
+string run_command (Inventory&, Session&, const char line[]);
+                                  // a command's whole reply
+int quantity_of (Inventory&, int inv_num);
+                                  // a record's quantity, or INT_MIN
+int connect_to (const char path[]);
+string ask (int client, const char command[]);
+                                  // send one command and read its reply,
+                                  // up to its OK or ERR line
+                                  // a client socket connected to a server
+int running_threads ();           // threads of this process
+int highest_descriptor ();        // the highest file descriptor open
+void write_test_file (char name[], const char text[], bool append = false);
+                                  // a temporary file holding text
+
+void test_concurrent_adjust ();
+void test_listing_does_not_block_writers ();
+void test_queries_lock_one_shard ();
+void test_shutdown_during_listing ();
+void test_command_numbers ();
+void test_malformed_inventory ();
+void test_malformed_sort ();
+void test_sort_file_limit ();
+void test_bin_ranges ();
+void test_change_file_errors ();
+void test_filters_after_renames ();
+void test_string_pool_reuse ();
+void test_fan_out_pool ();
+void test_search_ranking ();
+void test_accept_retries ();
+void test_long_lines ();
+void test_stock_totals ();
+void test_paged_matches_memory ();
+void test_metrics_add_up ();
+void test_synthetic_workload ();
+void test_buffered_exports ();
+void test_transactions_undo ();
+void test_location_ranges ();
+void throughput ();
+
+const TestCase TESTS[] =
+{
+   { "concurrent_adjust", test_concurrent_adjust, true },
+   { "listing_does_not_block_writers", test_listing_does_not_block_writers,
+     true },
+   { "queries_lock_one_shard", test_queries_lock_one_shard, true },
+   { "shutdown_during_listing", test_shutdown_during_listing, true },
+   { "command_numbers", test_command_numbers, true },
+   { "malformed_inventory", test_malformed_inventory, true },
+   { "malformed_sort", test_malformed_sort, true },
+   { "sort_file_limit", test_sort_file_limit, true },
+   { "bin_ranges", test_bin_ranges, true },
+   { "change_file_errors", test_change_file_errors, true },
+   { "filters_after_renames", test_filters_after_renames, true },
+   { "string_pool_reuse", test_string_pool_reuse, true },
+   { "fan_out_pool", test_fan_out_pool, true },
+   { "search_ranking", test_search_ranking, true },
+   { "accept_retries", test_accept_retries, true },
+   { "long_lines", test_long_lines, true },
+   { "stock_totals", test_stock_totals, true },
+   { "paged_matches_memory", test_paged_matches_memory, true },
+   { "metrics_add_up", test_metrics_add_up, true },
+   { "synthetic_workload", test_synthetic_workload, true },
+   { "buffered_exports", test_buffered_exports, true },
+   { "transactions_undo", test_transactions_undo, true },
+   { "location_ranges", test_location_ranges, true },
+   { "throughput", throughput, false }
+};
+
+
+
+int main (int argc, char *argv[])
+{
+   size_t count = sizeof (TESTS) / sizeof (TESTS[0]);
+   int run = 0;
+
+   signal (SIGALRM, timed_out);
+   for (size_t test = 0; test < count; test++)
+   {
+       bool named = (argc == 1 && TESTS[test].by_default);
+
+       for (int arg = 1; arg < argc; arg++)
+       {
+           named = named || strcmp (argv[arg], TESTS[test].name) == 0;
+       }
+       if (!named)
+       {
+           continue;
+       }
+
+       int before = failures;
+
+       running = TESTS[test].name;
+       alarm (TEST_SECONDS);
+       TESTS[test].run ();
+       alarm (0);
+       cout << (failures == before ? "pass " : "FAIL ") << running << endl;
+       run++;
+   }
+   if (run == 0)
+   {
+       cerr << "no such check" << endl;
+       return 2;
+   }
+   return failures == 0 ? 0 : 1;
+}
+
+//*********************************************************************
+// Function:  check, timed_out
+// Purpose:   to report a failed check
+//
+// Details:   a failed condition is reported with where it is and the
+//            run carries on; a check that runs out of time cannot be
+//            carried on from, so the run ends there.
+// Inputs:    passed - whether the condition held
+//            condition, file, line - the condition's text and place
+//
+//*********************************************************************
+
+void check (bool passed, const char condition[], const char file[],
+            int line)
+{
+    if(!passed)
+    {
+	cout << file << ":" << line << ": " << running << ": " << condition
+	     << endl;
+	failures++;
+    }
+    return;
+}
+
+void timed_out (int)
+{
+    const char message[] = "FAIL timed out: ";
+
+    write(STDOUT_FILENO, message, sizeof(message) - 1);
+    write(STDOUT_FILENO, running, strlen(running));
+    write(STDOUT_FILENO, "\n", 1);
+    _exit(1);
+}
+
+//*********************************************************************
+// Function:  open_test_inventory
+// Purpose:   to make a synthetic inventory to check against
+//
+// Details:   the inventory is written to a temporary file and loaded,
+//            as a real one would be, then the file is removed.
+// Inputs:    records - the size of the inventory
+//            shards - how many shards to split it into
+// Outputs:   inventory - loaded, with a change stream but no file
+//
+//*********************************************************************
+
+void open_test_inventory (Inventory &inventory, size_t records,
+                          size_t shards)
+{
+    char data_file[] = "/tmp/bookWarehouseDB_test.XXXXXX";
+    int data = mkstemp(data_file);
+    Synthetic shape;
+
+    CHECK(data >= 0);
+    close(data);
+    open_inventory(inventory, shards);
+    open_changes(inventory.changes, NULL);
+    open_synthetic(shape, records, BENCH_SEED);
+    CHECK(generate_inventory(shape, records, data_file));
+    CHECK(load_inventory(inventory, data_file));
+    unlink(data_file);
+    return;
+}
+
+//*********************************************************************
+// Function:  run_command, quantity_of
+// Purpose:   to run a protocol command, and to read a quantity back
+//
+// Inputs:    inventory - the database
+//            session - the client's transaction state
+//            line - the command
+//            inv_num - an inventory number
+// Outputs:   returns the reply, or the record's quantity (INT_MIN if
+//            there is no such record)
+//
+//*********************************************************************
+
+string run_command (Inventory &inventory, Session &session,
+                    const char line[])
+{
+    string reply;
+
+    execute_command(inventory, session, line, reply);
+    return reply;
+}
+
+int quantity_of (Inventory &inventory, int inv_num)
+{
+    Entry entry;
+
+    return get_entry(inventory, inv_num, entry) ? entry.quantity : INT_MIN;
+}
+
+//*********************************************************************
+// Function:  connect_to, running_threads, highest_descriptor
+// Purpose:   to talk to a server, and to see what is left running
+//
+// Details:   connect_to tries for a few seconds, as the server may
+//            not be listening yet.
+// Inputs:    path - the server's socket
+// Outputs:   returns the connected socket, or -1; or the number of
+//            threads in the process; or its highest open descriptor
+//
+//*********************************************************************
+
+int connect_to (const char path[])
+{
+    sockaddr_un address;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    for(int attempt = 0; attempt < 500; attempt++)
+    {
+	int client = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if(connect(client, (sockaddr *)&address, sizeof(address)) == 0)
+	{
+	    return client;
+	}
+	close(client);
+	this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    return -1;
+}
+
+string ask (int client, const char command[])
+{
+    string reply;
+    char chunk[256];
+    ssize_t got;
+
+    if(send(client, command, strlen(command), MSG_NOSIGNAL) !=
+       (ssize_t)strlen(command))
+    {
+	return reply;
+    }
+    while((got = read(client, chunk, sizeof(chunk))) > 0)
+    {
+	reply.append(chunk, got);
+
+	size_t last = reply.rfind('\n', reply.size() - 2);
+	last = (last == string::npos) ? 0 : last + 1;
+	if(reply.back() == '\n' &&
+	   (reply.compare(last, 3, "OK ") == 0 ||
+	    reply.compare(last, 4, "ERR ") == 0))
+	{
+	    break;
+	}
+    }
+    return reply;
+}
+
+int running_threads ()
+{
+    DIR *tasks = opendir("/proc/self/task");
+    int count = 0;
+
+    while(tasks != NULL && readdir(tasks) != NULL)
+    {
+	count++;
+    }
+    if(tasks != NULL)
+    {
+	closedir(tasks);
+    }
+    return count - 2;              // less . and ..
+}
+
+int highest_descriptor ()
+{
+    DIR *open_files = opendir("/proc/self/fd");
+    dirent *file;
+    int highest = 0;
+
+    while(open_files != NULL && (file = readdir(open_files)) != NULL)
+    {
+	highest = max(highest, atoi(file->d_name));
+    }
+    if(open_files != NULL)
+    {
+	closedir(open_files);
+    }
+    return highest;
+}
+
+//*********************************************************************
+// Function:  test_concurrent_adjust
+// Purpose:   to check that no change is lost when many clients change
+//            the same records at once
+//
+// Details:   16 clients adjust 8 hot records, some alone and some as
+//            a transfer of one copy between two of them in a
+//            transaction, while another client lists and exports the
+//            inventory over and over. Every client keeps its own
+//            count of what it did to each record; at the end each
+//            record must have moved by exactly the sum of them.
+//
+//*********************************************************************
+
+void test_concurrent_adjust ()
+{
+    const int clients = 16;
+    const int operations = 2000;
+    const int hot = 8;
+    Inventory inventory;
+    vector<int> numbers, before;
+    vector<vector<int> > moved(clients, vector<int>(hot, 0));
+    vector<thread> workers;
+    atomic<bool> done(false);
+
+    open_test_inventory(inventory, 20000, 4);
+    for(int record = 0; record < hot; record++)
+    {
+	numbers.push_back(synthetic_number(record * 7));
+	before.push_back(quantity_of(inventory, numbers.back()));
+    }
+
+    thread reader([&]()
+    {
+	Session session = { false, Transaction() };
+
+	while(!done)
+	{
+	    string reply = run_command(inventory, session, "LIST");
+	    CHECK(reply.compare(reply.size() - 9, 9, "OK 20000\n") == 0);
+	    run_command(inventory, session, "EXPORT csv /dev/null");
+	}
+    });
+    for(int client = 0; client < clients; client++)
+    {
+	workers.push_back(thread([&, client]()
+	{
+	    Session session = { false, Transaction() };
+	    uint64_t state = client + 1;
+	    char line[64];
+
+	    for(int step = 0; step < operations; step++)
+	    {
+		int from = next_random(state) % hot;
+		int to = next_random(state) % hot;
+
+		if(next_random(state) % 2 == 0)
+		{
+		    snprintf(line, sizeof(line), "ADJ %d 1", numbers[to]);
+		    CHECK(run_command(inventory, session, line) == "OK 1\n");
+		    moved[client][to]++;
+		    continue;
+		}
+		run_command(inventory, session, "BEGIN");
+		snprintf(line, sizeof(line), "ADJ %d -1", numbers[from]);
+		run_command(inventory, session, line);
+		snprintf(line, sizeof(line), "ADJ %d 1", numbers[to]);
+		run_command(inventory, session, line);
+		CHECK(run_command(inventory, session, "COMMIT") == "OK 2\n");
+		moved[client][from]--;
+		moved[client][to]++;
+	    }
+	}));
+    }
+    for(size_t worker = 0; worker < workers.size(); worker++)
+    {
+	workers[worker].join();
+    }
+    done = true;
+    reader.join();
+
+    for(int record = 0; record < hot; record++)
+    {
+	int expected = before[record];
+
+	for(int client = 0; client < clients; client++)
+	{
+	    expected += moved[client][record];
+	}
+	CHECK(quantity_of(inventory, numbers[record]) == expected);
+    }
+    close_changes(inventory.changes);
+    return;
+}
+
+//*********************************************************************
+// Function:  test_listing_does_not_block_writers
+// Purpose:   to check that a change goes ahead while a listing is
+//            being written
+//
+// Details:   the listing's first entry is held up until a change to
+//            the inventory has been committed, as a slow file or
+//            client would hold it up. If the listing held the read
+//            locks while it wrote, the change would wait out the
+//            hold and the listing would time out waiting for it.
+//            The listing must still come out whole and in order.
+//
+//*********************************************************************
+
+void test_listing_does_not_block_writers ()
+{
+    const size_t records = 3 * SCAN_CHUNK + 17;
+    Inventory inventory;
+    mutex guard;
+    condition_variable changed;
+    bool committed = false;
+    bool waited_out = false;
+    atomic<bool> listing(false);
+    size_t seen = 0;
+    bool in_order = true;
+    Entry last;
+
+    open_test_inventory(inventory, records, 4);
+    thread lister([&]()
+    {
+	for_each_in_order(inventory, [&](const Entry &entry)
+	{
+	    if(seen == 0)
+	    {
+		unique_lock<mutex> lock(guard);
+
+		listing = true;
+		waited_out = !changed.wait_for(lock, chrono::seconds(10),
+					       [&]() { return committed; });
+	    }
+	    else
+	    {
+		in_order = in_order && key_order(last, entry);
+	    }
+	    last = entry;
+	    seen++;
+	});
+    });
+    while(!listing)
+    {
+	this_thread::yield();
+    }
+
+    Session session = { false, Transaction() };
+    char line[64];
+    snprintf(line, sizeof(line), "ADJ %d 5", synthetic_number(records - 1));
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    CHECK(run_command(inventory, session, line) == "OK 1\n");
+    CHECK(chrono::steady_clock::now() - start < chrono::seconds(2));
+    {
+	lock_guard<mutex> lock(guard);
+	committed = true;
+    }
+    changed.notify_all();
+    lister.join();
+
+    CHECK(!waited_out);
+    CHECK(seen == records);
+    CHECK(in_order);
+    close_changes(inventory.changes);
+    return;
+}
+
+//*********************************************************************
+// Function:  test_queries_lock_one_shard
+// Purpose:   to check that a query over every shard holds up changes
+//            only to the shard it is reading
+//
+// Details:   The last shard's write lock is held, as a long
+//            transaction would hold it, while a query runs; the query
+//            waits there. An adjustment to the first shard must still
+//            go ahead meanwhile, which it cannot if the query keeps
+//            the shards it has already read locked. Then name and
+//            location queries of more records than a chunk must still
+//            find every record, once and in order.
+//
+//*********************************************************************
+
+void test_queries_lock_one_shard ()
+{
+    const size_t records = 30 * SCAN_CHUNK + 17;
+                                     // over a chunk on each of 26 shelves
+    const char *queries[] = { "FIND S", "LOC a", "SEARCH river",
+			      "TOTALS category" };
+    Inventory inventory;
+    Session session = { false, Transaction() };
+    vector<Entry> entries;
+    char line[64];
+    size_t index = 0;
+    int first;
+    size_t found = 0;
+
+    open_test_inventory(inventory, 400, 4);
+    do
+    {
+	first = synthetic_number(index++);
+    } while(shard_index(inventory, first) != 0);
+    snprintf(line, sizeof(line), "ADJ %d 1", first);
+    for(size_t query = 0; query < sizeof(queries) / sizeof(queries[0]);
+	query++)
+    {
+	WRITE_LOCK held(inventory.shards.back()->guard);
+	Session asking = { false, Transaction() };
+	atomic<bool> adjusted(false);
+	thread reader([&]()
+		      {
+			  run_command(inventory, asking, queries[query]);
+		      });
+
+	this_thread::sleep_for(chrono::milliseconds(50));
+	thread writer([&]()
+		      {
+			  adjusted = run_command(inventory, session, line) ==
+				     "OK 1\n";
+		      });
+	for(int wait = 0; wait < 200 && !adjusted; wait++)
+	{
+	    this_thread::sleep_for(chrono::milliseconds(10));
+	}
+	CHECK(adjusted);
+	held.unlock();
+	reader.join();
+	writer.join();
+    }
+    close_changes(inventory.changes);
+
+    open_test_inventory(inventory, records, 1);
+    query_by_name(inventory, "", entries);
+    CHECK(entries.size() == records);
+    for(size_t entry = 1; entry < entries.size(); entry++)
+    {
+	CHECK(key_order(entries[entry - 1], entries[entry]));
+    }
+    for(int shelf = CHAR_MIN; shelf <= CHAR_MAX; shelf++)
+    {
+	query_by_location(inventory, (char)shelf, INT_MIN, INT_MAX, entries);
+	for(size_t entry = 1; entry < entries.size(); entry++)
+	{
+	    CHECK(walk_order(entries[entry - 1], entries[entry]));
+	}
+	found += entries.size();
+    }
+    CHECK(found == records);
+    close_changes(inventory.changes);
+    return;
+}
+
+//*********************************************************************
+// Function:  throughput
+// Purpose:   to measure how the store scales with more clients
+//
+// Details:   prints the rate of a pick station mix - 90 GETs to 10
+//            ADJs - over 100000 records in one shard per core, for 1
+//            to 64 clients sharing 400000 operations. More clients
+//            must not lose an adjustment, nor bring the rate below
+//            THROUGHPUT_FLOOR of what one client manages: waiting on
+//            one another's locks must cost less than that, even with
+//            fewer cores than clients.
+//
+//*********************************************************************
+
+void throughput ()
+{
+    const size_t records = 100000;
+    const int operations = 400000;
+    Inventory inventory;
+    atomic<long long> adjusted(0);   // ADJs made, by all clients
+    long long before = 0;
+    long long after = 0;
+    double single = 0;               // the rate of one client
+
+    open_test_inventory(inventory, records, thread::hardware_concurrency());
+    for(size_t record = 0; record < records; record++)
+    {
+	before += quantity_of(inventory, synthetic_number(record));
+    }
+    for(int clients = 1; clients <= 64; clients *= 2)
+    {
+	vector<thread> workers;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	for(int client = 0; client < clients; client++)
+	{
+	    workers.push_back(thread([&, client]()
+	    {
+		Session session = { false, Transaction() };
+		uint64_t state = client + 1;
+		char line[64];
+		string reply;
+
+		for(int step = client; step < operations; step += clients)
+		{
+		    int number = synthetic_number(next_random(state) % records);
+
+		    if(next_random(state) % 10 == 0)
+		    {
+			snprintf(line, sizeof(line), "ADJ %d 1", number);
+			adjusted++;
+		    }
+		    else
+		    {
+			snprintf(line, sizeof(line), "GET %d", number);
+		    }
+		    execute_command(inventory, session, line, reply);
+		    reply.clear();
+		}
+	    }));
+	}
+	for(size_t worker = 0; worker < workers.size(); worker++)
+	{
+	    workers[worker].join();
+	}
+	double seconds = chrono::duration<double>(
+	    chrono::steady_clock::now() - start).count();
+	double rate = operations / seconds;
+
+	cout << clients << " clients: " << (long)rate << " operations/s"
+	     << endl;
+	single = (clients == 1) ? rate : single;
+	CHECK(rate >= THROUGHPUT_FLOOR * single);
+    }
+    for(size_t record = 0; record < records; record++)
+    {
+	after += quantity_of(inventory, synthetic_number(record));
+    }
+    CHECK(after == before + adjusted);
+    close_changes(inventory.changes);
+    return;
+}
+
+//*********************************************************************
+// Function:  test_shutdown_during_listing
+// Purpose:   to check that a server shut down while another client's
+//            LIST is under way stops that client before returning
+//
+// Details:   one client asks for a long listing three times over and
+//            reads the replies; another sends SHUTDOWN once the
+//            listing has started. When serve returns, the listing
+//            client must have been cut off and no thread of the
+//            server may be left running, since the inventory is
+//            destroyed straight afterwards.
+//
+//*********************************************************************
+
+void test_shutdown_during_listing ()
+{
+    char path[] = "/tmp/bookWarehouseDB_test.sock";
+    unique_ptr<Inventory> inventory(new Inventory);
+    atomic<bool> cut_off(false);
+    int threads;
+
+    open_test_inventory(*inventory, 300000, 4);
+    threads = running_threads();
+    thread server([&]() { CHECK(serve(*inventory, path)); });
+
+    thread lister([&]()
+    {
+	int client = connect_to(path);
+	char chunk[READ_CHUNK];
+	ssize_t got;
+
+	CHECK(client >= 0);
+	CHECK(write(client, "LIST\nLIST\nLIST\n", 15) == 15);
+	do
+	{
+	    got = read(client, chunk, sizeof(chunk));
+	} while(got > 0);
+	cut_off = true;
+	close(client);
+    });
+    this_thread::sleep_for(chrono::milliseconds(50));
+
+    int client = connect_to(path);
+    char reply[16] = "";
+    CHECK(client >= 0);
+    CHECK(write(client, "SHUTDOWN\n", 9) == 9);
+    CHECK(read(client, reply, sizeof(reply) - 1) > 0);
+    CHECK(strcmp(reply, "OK 0\n") == 0);
+    close(client);
+
+    server.join();
+    CHECK(running_threads() <= threads + 1);  // only the lister, if that
+    lister.join();
+    CHECK(cut_off);
+    close_changes(inventory->changes);
+    inventory.reset();
+    return;
+}
+
+//*********************************************************************
+// Function:  test_command_numbers
+// Purpose:   to check that commands refuse numbers with junk after
+//            them, or out of range, and arguments too long to hold
+//            rather than cutting them short, and change nothing
+//
+//*********************************************************************
+
+void test_command_numbers ()
+{
+    const char *refused[] = { "GET 12x", "GET 99999999999", "GET 5 6",
+			      "REMOVE 1x", "ADJ 5 abc", "ADJ 5 1 2",
+			      "ADJ 5 3000000000", "SET 7x title foo",
+			      "CHANGES -1", "CHANGES 5 junk", "CHANGES 0 -1",
+			      "CHANGES 99999999999999999999",
+			      "CHANGES 0 3000000000", "STATS every 5x f",
+			      "STATS every 99999999999 f", "STATS every 5",
+			      "STATS every 0 f", "STATS every 1 f json x",
+			      "STATS on x", "FIND Abcdefghijklm",
+			      "EXPORT csv /dev/null junk" };
+    Inventory inventory;
+    Session session = { false, Transaction() };
+    int number = synthetic_number(3);
+    int quantity;
+    char line[64];
+
+    open_test_inventory(inventory, 100, 2);
+    quantity = quantity_of(inventory, number);
+    for(size_t command = 0; command < sizeof(refused) / sizeof(refused[0]);
+	command++)
+    {
+	CHECK(run_command(inventory, session, refused[command])
+		  .compare(0, 4, "ERR ") == 0);
+    }
+    snprintf(line, sizeof(line), "ADJ %d 2x", number);
+    CHECK(run_command(inventory, session, line).compare(0, 4, "ERR ") == 0);
+    snprintf(line, sizeof(line), "REMOVE %dx", number);
+    CHECK(run_command(inventory, session, line).compare(0, 4, "ERR ") == 0);
+    CHECK(quantity_of(inventory, number) == quantity);
+
+    snprintf(line, sizeof(line), "ADJ %d -2 ", number);
+    CHECK(run_command(inventory, session, line) == "OK 1\n");
+    CHECK(quantity_of(inventory, number) == quantity - 2);
+    CHECK(run_command(inventory, session, "EXPORT csv /dev/null") ==
+	  "OK 100\n");
+    CHECK(run_command(inventory, session, "CHANGES 0 1")
+	      .find("\nOK 1\n") != string::npos);
+    CHECK(run_command(inventory, session, "CHANGES 18446744073709551615") ==
+	  "OK 0\n");
+    CHECK(run_command(inventory, session,
+		      ("SAVE /tmp/" + string(FILE_LENGTH, 'x')).c_str())
+	      .compare(0, 4, "ERR ") == 0);
+
+    snprintf(line, sizeof(line), "SET %d author Le Guin", number);
+    CHECK(run_command(inventory, session, line) == "OK 1\n");
+    CHECK(run_command(inventory, session, "FIND Le Gu ")
+	      .compare(0, 8, "Le Guin\t") == 0);
+    close_changes(inventory.changes);
+    return;
+}
+
+//*********************************************************************
+// Function:  write_test_file
+// Purpose:   to put text in a temporary file
+//
+// Inputs:    name - "/tmp/...XXXXXX" for a new file, or an existing
+//                   file's name when appending
+//            text - what to write
+//            append - add to the end of the named file
+// Outputs:   name - the file's name
+//
+//*********************************************************************
+
+void write_test_file (char name[], const char text[], bool append)
+{
+    int file = append ? open(name, O_WRONLY | O_APPEND) : mkstemp(name);
+
+    CHECK(file >= 0);
+    CHECK(write(file, text, strlen(text)) == (ssize_t)strlen(text));
+    close(file);
+    return;
+}
+
+//*********************************************************************
+// Function:  test_malformed_inventory
+// Purpose:   to check that a load stops at a malformed entry, in good
+//            time, and leaves the inventory empty rather than half
+//            loaded, and that a file whose last newline is missing or
+//            doubled still loads
+//
+//*********************************************************************
+
+void test_malformed_inventory ()
+{
+    const char *malformed[] =
+    {
+	"Smith\nJ\n12x\nA1\nTitle\nNone\n5\n",
+	"Smith\nJ\n12\nA1\nTitle\nNone\n5\n"
+	    "Jones\nK\n13\nA2\nTitle\nNone\nabc\n",
+	"Smith\nJ\n12\nA1\nTitle\nNone\n5\nJones\nK\n13\nA2\n",
+	"Smithsonian-Institute\nJ\n12\nA1\nTitle\nNone\n5\n"
+    };
+    const char *loadable[] =
+    {
+	"Smith\nJ\n12\nA1\nTitle\nNone\n5",
+	"Smith\nJ\n12\nA1\nTitle\nNone\n5\n\n"
+    };
+    Inventory inventory;
+    Synthetic shape;
+    char name[] = "/tmp/bookWarehouseDB_test.XXXXXX";
+    size_t records = LOAD_BATCH * 3;
+
+    open_test_inventory(inventory, 100, 4);
+    for(size_t file = 0; file < sizeof(malformed) / sizeof(malformed[0]);
+	file++)
+    {
+	strcpy(name, "/tmp/bookWarehouseDB_test.XXXXXX");
+	write_test_file(name, malformed[file]);
+	CHECK(!load_inventory(inventory, name));
+	CHECK(quantity_of(inventory, 12) == INT_MIN);
+	CHECK(quantity_of(inventory, synthetic_number(0)) == INT_MIN);
+	unlink(name);
+    }
+    for(size_t file = 0; file < sizeof(loadable) / sizeof(loadable[0]);
+	file++)
+    {
+	strcpy(name, "/tmp/bookWarehouseDB_test.XXXXXX");
+	write_test_file(name, loadable[file]);
+	CHECK(load_inventory(inventory, name));
+	CHECK(quantity_of(inventory, 12) == 5);
+	unlink(name);
+    }
+
+    // a bad entry after whole batches have been added
+    strcpy(name, "/tmp/bookWarehouseDB_test.XXXXXX");
+    write_test_file(name, "");
+    open_synthetic(shape, records, BENCH_SEED);
+    CHECK(generate_inventory(shape, records, name));
+    write_test_file(name, malformed[0], true);
+    CHECK(!load_inventory(inventory, name));
+    CHECK(quantity_of(inventory, synthetic_number(0)) == INT_MIN);
+    unlink(name);
+    close_changes(inventory.changes);
+    return;
+}
+
+//*********************************************************************
+// Function:  test_malformed_sort
+// Purpose:   to check that an external sort stops at a malformed
+//            entry that comes after runs have been spilled, reports
+//            its line and writes no output
+//
+//*********************************************************************
+
+void test_malformed_sort ()
+{
+    Synthetic shape;
+    ostringstream report;
+    char input[] = "/tmp/bookWarehouseDB_test.XXXXXX";
+    char output[] = "/tmp/bookWarehouseDB_test.XXXXXX";
+    size_t records = 20000;
+    size_t memory = 4000 * sizeof(SortRecord);  // five budgets of input
+
+    write_test_file(input, "");
+    write_test_file(output, "");
+    unlink(output);
+    open_synthetic(shape, records, BENCH_SEED);
+    CHECK(generate_inventory(shape, records, input));
+    CHECK(sort_inventory(input, output, memory, report));
+    CHECK(access(output, F_OK) == 0);
+    unlink(output);
+
+    write_test_file(input, "Smith\nJ\n12\nA1\nTitle\nNone\nabc\n", true);
+    CHECK(!sort_inventory(input, output, memory, report));
+    CHECK(report.str().find(", line " + to_string(records * 7 + 7) +
+			    ": quantity is not a number") != string::npos);
+    CHECK(access(output, F_OK) != 0);
+    unlink(input);
+    return;
+}
+
+//*********************************************************************
+// Function:  test_sort_file_limit
+// Purpose:   to check that an external sort of many more runs than
+//            files may be open still sorts, and keeps every entry
+//
+// Details:   a budget of one record makes a run of every entry, and
+//            the open file limit is set a little above what is open
+//            already, well below two files for each of them.
+//
+//*********************************************************************
+
+void test_sort_file_limit ()
+{
+    Synthetic shape;
+    ostringstream report;
+    char input[] = "/tmp/bookWarehouseDB_test.XXXXXX";
+    char output[] = "/tmp/bookWarehouseDB_test.XXXXXX";
+    size_t records = 2000;
+    rlimit limit;
+    rlimit tight;
+    ifstream sorted;
+    Entry entry;
+    Entry previous;
+    size_t line = 0;
+    size_t count = 0;
+    const char *error = NULL;
+
+    write_test_file(input, "");
+    write_test_file(output, "");
+    open_synthetic(shape, records, BENCH_SEED);
+    CHECK(generate_inventory(shape, records, input));
+
+    CHECK(getrlimit(RLIMIT_NOFILE, &limit) == 0);
+    tight = limit;
+    tight.rlim_cur = highest_descriptor() + 1 + 3 * SORT_MERGE_WAYS;
+    CHECK(setrlimit(RLIMIT_NOFILE, &tight) == 0);
+    CHECK(sort_inventory(input, output, sizeof(SortRecord), report));
+    CHECK(setrlimit(RLIMIT_NOFILE, &limit) == 0);
+
+    sorted.open(output);
+    while(read_entry(sorted, entry, line, error))
+    {
+	CHECK(count == 0 || !key_order(entry, previous));
+	previous = entry;
+	count++;
+    }
+    CHECK(error == NULL);
+    CHECK(count == records);
+    unlink(input);
+    unlink(output);
+    return;
+}
+
+//*********************************************************************
+// Function:  test_bin_ranges
+// Purpose:   to check that a location query with anything after it is
+//            refused, and that the plain forms still read
+//
+//*********************************************************************
+
+void test_bin_ranges ()
+{
+    const char *refused[] = { "g 70 79 junk", "g 70 79 80", "g 70x 79",
+			      "g 79 70", "g 99999999999 1", "h-03 x", "gx" };
+    char shelf;
+    int first, last;
+
+    for(size_t query = 0; query < sizeof(refused) / sizeof(refused[0]);
+	query++)
+    {
+	CHECK(!parse_bin_range(refused[query], shelf, first, last));
+    }
+    CHECK(parse_bin_range(" G 70 79 ", shelf, first, last));
+    CHECK(shelf == 'g' && first == 70 && last == 79);
+    CHECK(parse_bin_range("g", shelf, first, last));
+    CHECK(first == NO_BIN && last == INT_MAX);
+    CHECK(parse_bin_range("h-03", shelf, first, last));
+    CHECK(shelf == 'h' && first == 3 && last == 3);
+    return;
+}
+
+//*********************************************************************
+// Function:  test_change_file_errors
+// Purpose:   to check that changes that could not be appended to the
+//            change file are not counted as appended, are written
+//            once the file can be written again, and do not keep
+//            close_changes from returning
+//
+// Details:   The change file starts as /dev/full, where every write
+//            fails. A real file is then put in its place under the
+//            same descriptor.
+//
+//*********************************************************************
+
+void test_change_file_errors ()
+{
+    const int CHANGES = 50;
+    Inventory inventory;
+    Session session = { false, Transaction() };
+    char name[] = "/tmp/bookWarehouseDB_test.XXXXXX";
+    char line[64];
+    int number = synthetic_number(5);
+    ifstream written;
+    string text;
+    int lines = 0;
+
+    open_test_inventory(inventory, 100, 2);
+    close_changes(inventory.changes);
+    CHECK(open_changes(inventory.changes, "/dev/full"));
+    snprintf(line, sizeof(line), "ADJ %d 1", number);
+    for(int change = 0; change < CHANGES; change++)
+    {
+	CHECK(run_command(inventory, session, line) == "OK 1\n");
+    }
+    this_thread::sleep_for(chrono::milliseconds(3 * CHANGE_RETRY_MS));
+    CHECK(inventory.changes.appended == 0);
+    CHECK(inventory.changes.published == (uint64_t)CHANGES);
+
+    write_test_file(name, "");
+    int file = open(name, O_WRONLY | O_APPEND);
+    CHECK(file >= 0 && dup2(file, inventory.changes.file) >= 0);
+    close(file);
+    while(inventory.changes.appended < (uint64_t)CHANGES)
+    {
+	this_thread::sleep_for(chrono::milliseconds(CHANGE_POLL_MS));
+    }
+    close_changes(inventory.changes);
+    written.open(name);
+    while(getline(written, text))
+    {
+	CHECK(strtoull(text.c_str(), NULL, 10) == (uint64_t)++lines);
+    }
+    CHECK(lines == CHANGES);
+    unlink(name);
+
+    // giving up at close while the writes still fail
+    CHECK(open_changes(inventory.changes, "/dev/full"));
+    CHECK(run_command(inventory, session, line) == "OK 1\n");
+    close_changes(inventory.changes);
+    CHECK(inventory.changes.appended == 0);
+    return;
+}
+
+//*********************************************************************
+// Function:  test_filters_after_renames
+// Purpose:   to check that renaming every author leaves the Bloom
+//            filters right: every record is still found by number and
+//            by its new name, renames count no number as stale, and
+//            the old names have been rebuilt out of the name filters
+//
+// Details:   The records are renamed to a few names, so the old names
+//            make up most of what each name filter held and must have
+//            set off a rebuild.
+//
+//*********************************************************************
+
+void test_filters_after_renames ()
+{
+    const size_t RECORDS = 4000;
+    Inventory inventory;
+    Session session = { false, Transaction() };
+    vector<Entry> before;
+    set<pair<size_t, string> > old_names;  // shard and former author
+    vector<uint64_t> hashes;
+    char line[64];
+    size_t passed = 0;
+    size_t found = 0;
+
+    open_test_inventory(inventory, RECORDS, 4);
+    for(size_t index = 0; index < RECORDS; index++)
+    {
+	Entry entry;
+
+	CHECK(get_entry(inventory, synthetic_number(index), entry));
+	before.push_back(entry);
+    }
+    for(size_t index = 0; index < RECORDS; index++)
+    {
+	snprintf(line, sizeof(line), "SET %d author Renamed%zu",
+		 before[index].inventory_number, index % 8);
+	CHECK(run_command(inventory, session, line) == "OK 1\n");
+    }
+
+    for(size_t shard = 0; shard < inventory.shards.size(); shard++)
+    {
+	const Shard &part = *inventory.shards[shard];
+
+	CHECK(part.number_filter.stale == 0);
+	CHECK(part.name_filter.stale * BLOOM_STALE_SHARE <=
+	      part.name_filter.keys);
+    }
+    for(size_t index = 0; index < RECORDS; index++)
+    {
+	found += quantity_of(inventory, before[index].inventory_number) ==
+		 before[index].quantity;
+	old_names.insert(make_pair(
+	    shard_index(inventory, before[index].inventory_number),
+	    string(before[index].author_name)));
+    }
+    for(set<pair<size_t, string> >::const_iterator name = old_names.begin();
+	name != old_names.end(); name++)
+    {
+	prefix_hashes(name->second.c_str(), hashes);
+	passed += bloom_test(inventory.shards[name->first]->name_filter,
+			     hashes.back());
+    }
+    CHECK(found == RECORDS);
+    CHECK(passed * 10 < old_names.size());
+    CHECK(run_command(inventory, session, "FIND Renamed7")
+	      .find("OK 500\n") != string::npos);
+    snprintf(line, sizeof(line), "FIND %s", before[0].author_name);
+    CHECK(run_command(inventory, session, line) == "OK 0\n");
+    close_changes(inventory.changes);
+    return;
+}
+
+//*********************************************************************
+// Function:  test_string_pool_reuse
+// Purpose:   to check that the string pools hold only the strings
+//            records use: renaming every record's author and comment
+//            again and again must not grow them, and removing every
+//            record must empty them
+//
+//*********************************************************************
+
+void test_string_pool_reuse ()
+{
+    const size_t RECORDS = 200;
+    const int ROUNDS = 20;
+    Inventory inventory;
+    Session session = { false, Transaction() };
+    char line[64];
+    size_t pooled = 0;
+    size_t live = 0;
+    size_t uses = 0;
+    size_t held = 0;
+    Entry entry;
+
+    open_test_inventory(inventory, RECORDS, 2);
+    for(size_t shard = 0; shard < inventory.shards.size(); shard++)
+    {
+	pooled += inventory.shards[shard]->strings.strings.size();
+    }
+    for(int round = 0; round < ROUNDS; round++)
+    {
+	for(size_t index = 0; index < RECORDS; index++)
+	{
+	    snprintf(line, sizeof(line), "SET %d author R%d_%zu",
+		     synthetic_number(index), round, index);
+	    CHECK(run_command(inventory, session, line) == "OK 1\n");
+	    snprintf(line, sizeof(line), "SET %d comment c%d_%zu",
+		     synthetic_number(index), round, index);
+	    CHECK(run_command(inventory, session, line) == "OK 1\n");
+	}
+    }
+
+    CHECK(get_entry(inventory, synthetic_number(7), entry));
+    CHECK(strcmp(entry.author_name, "R19_7") == 0);
+    CHECK(strcmp(entry.comment, "c19_7") == 0);
+    for(size_t shard = 0; shard < inventory.shards.size(); shard++)
+    {
+	const StringPool &pool = inventory.shards[shard]->strings;
+
+	live += pool.ids.size();
+	for(size_t id = 0; id < pool.uses.size(); id++)
+	{
+	    uses += pool.uses[id];
+	}
+	CHECK(pool.strings.size() <= pooled + 2 * RECORDS);
+    }
+    CHECK(live == 2 * RECORDS);
+    CHECK(uses == 2 * RECORDS);
+
+    for(size_t index = 0; index < RECORDS; index++)
+    {
+	snprintf(line, sizeof(line), "REMOVE %d", synthetic_number(index));
+	CHECK(run_command(inventory, session, line) == "OK 1\n");
+    }
+    live = 0;
+    for(size_t shard = 0; shard < inventory.shards.size(); shard++)
+    {
+	const StringPool &pool = inventory.shards[shard]->strings;
+
+	live += pool.ids.size();
+	held += pool.strings.size() - pool.free_ids.size();
+    }
+    CHECK(live == 0);
+    CHECK(held == 0);
+    close_changes(inventory.changes);
+    return;
+}
+
+//*********************************************************************
+// Function:  test_fan_out_pool
+// Purpose:   to check that fan_out does every shard exactly once when
+//            many threads call it at once, and from inside its own
+//            work, and that it starts no threads of its own for it
+//
+//*********************************************************************
+
+void test_fan_out_pool ()
+{
+    const int CALLERS = 8;
+    const int CALLS = 2000;
+    const size_t SHARDS = 8;
+    Inventory inventory;
+    vector<thread> callers;
+    atomic<int> wrong(0);             // shards not done exactly once
+    atomic<int> extra(0);             // times more threads were running
+    int threads;
+
+    open_inventory(inventory, SHARDS);
+    fan_out(inventory, SIZE_MAX, [](size_t) {});  // starts the pool
+    threads = running_threads();
+    for(int caller = 0; caller < CALLERS; caller++)
+    {
+	callers.push_back(thread([&]()
+	{
+	    for(int call = 0; call < CALLS; call++)
+	    {
+		vector<atomic<int> > done(SHARDS);
+		vector<atomic<int> > inner(SHARDS * SHARDS);
+
+		fan_out(inventory, SIZE_MAX, [&](size_t shard)
+		{
+		    done[shard]++;
+		    if(call % 100 == 0)
+		    {
+			extra += running_threads() > threads + CALLERS;
+			fan_out(inventory, SIZE_MAX, [&](size_t part)
+			{
+			    inner[shard * SHARDS + part]++;
+			});
+		    }
+		});
+		for(size_t shard = 0; shard < SHARDS; shard++)
+		{
+		    wrong += done[shard] != 1;
+		}
+		for(size_t part = 0; call % 100 == 0 && part < inner.size();
+		    part++)
+		{
+		    wrong += inner[part] != 1;
+		}
+	    }
+	}));
+    }
+    for(int caller = 0; caller < CALLERS; caller++)
+    {
+	callers[caller].join();
+    }
+    CHECK(wrong == 0);
+    CHECK(extra == 0);
+    CHECK(running_threads() == threads);
+    return;
+}
+
+//*********************************************************************
+// Function:  test_search_ranking
+// Purpose:   to check SEARCH against scoring every record by hand,
+//            after most records have been removed, some added back
+//            into the freed slots and others retitled, so that half
+//            the records share one word, and then some of those added
+//            back removed or retitled again
+//
+//*********************************************************************
+
+void test_search_ranking ()
+{
+    const size_t RECORDS = 3000;
+    Inventory inventory;
+    Session session = { false, Transaction() };
+    vector<Entry> removed;                 // records to add back
+    vector<Entry> entries;                 // every record, in key order
+    vector<string> queries;
+    char line[64];
+    size_t wrong = 0;
+    size_t answered = 0;
+
+    open_test_inventory(inventory, RECORDS, 2);
+    for(size_t index = 0; index < RECORDS; index++)
+    {
+	Entry entry;
+
+	CHECK(get_entry(inventory, synthetic_number(index), entry));
+	if(index % 3 == 0 && index % 2 == 0)
+	{
+	    snprintf(line, sizeof(line), "SET %d title rare%zu word",
+		     entry.inventory_number, index % 89);
+	    CHECK(run_command(inventory, session, line) == "OK 1\n");
+	}
+	if(index % 3 == 0)
+	{
+	    continue;
+	}
+	snprintf(line, sizeof(line), "REMOVE %d", entry.inventory_number);
+	CHECK(run_command(inventory, session, line) == "OK 1\n");
+	if(index % 4 == 2)
+	{
+	    snprintf(entry.title, sizeof(entry.title), "rare%zu word",
+		     index % 97);
+	}
+	if(index % 2 == 0)
+	{
+	    removed.push_back(entry);
+	}
+    }
+    for(size_t index = 0; index < removed.size(); index++)
+    {
+	string add = "ADD ";
+
+	format_entry(add, removed[index], FMT_TAB, 0);
+	add.resize(add.size() - 1);        // the newline
+	CHECK(run_command(inventory, session, add.c_str()) == "OK 1\n");
+    }
+    for(size_t index = 0; index < removed.size(); index += 3)
+    {
+	snprintf(line, sizeof(line), "REMOVE %d",
+		 removed[index].inventory_number);
+	CHECK(run_command(inventory, session, line) == "OK 1\n");
+	if(index + 1 < removed.size())
+	{
+	    snprintf(line, sizeof(line), "SET %d title later%zu",
+		     removed[index + 1].inventory_number, index % 7);
+	    CHECK(run_command(inventory, session, line) == "OK 1\n");
+	}
+    }
+
+    for_each_in_order(inventory, [&](const Entry &entry)
+		      {
+			  entries.push_back(entry);
+		      });
+    for(size_t pick = 0; pick < 60; pick++)
+    {
+	vector<string> words;
+	string query;
+
+	entry_words(entries[pick * 71 % entries.size()], words);
+	query = words[pick % words.size()];
+	if(pick % 4 == 1 && query.size() > 3)
+	{
+	    query[query.size() / 2] = 'q';  // a typo
+	}
+	else if(pick % 4 == 2 && query.size() > 3)
+	{
+	    query.resize(query.size() - 2);
+	}
+	else if(pick % 4 == 3)
+	{
+	    query += " " + words[(pick + 1) % words.size()];
+	}
+	queries.push_back(query);
+    }
+    queries.push_back("word");
+    queries.push_back("rare5 word");
+    queries.push_back("rare");
+    queries.push_back("a rare61");
+
+    for(size_t query = 0; query < queries.size(); query++)
+    {
+	vector<string> terms;
+	vector<pair<int, size_t> > expected;   // (-score, place in order)
+	vector<Entry> results;
+
+	split_words(queries[query].c_str(), terms);
+	for(size_t record = 0; record < entries.size(); record++)
+	{
+	    vector<string> words;
+	    int score = 0;
+
+	    entry_words(entries[record], words);
+	    for(size_t term = 0; term < terms.size(); term++)
+	    {
+		const string &wanted = terms[term];
+		int length = wanted.size();
+		int distance = (length < FUZZY_ONE_LENGTH) ? 0 :
+			       (length < FUZZY_TWO_LENGTH) ? 1 : 2;
+		int best = 0;
+
+		for(size_t word = 0; word < words.size(); word++)
+		{
+		    if(words[word] == wanted)
+		    {
+			best = MATCH_EXACT;
+		    }
+		    else if(length < GRAM_LENGTH - 1)
+		    {
+		    }
+		    else if(words[word].compare(0, length, wanted) == 0)
+		    {
+			best = max(best, MATCH_PREFIX);
+		    }
+		    else if(edit_distance(wanted, words[word], distance) <=
+			    distance)
+		    {
+			best = max(best, MATCH_FUZZY);
+		    }
+		}
+		score += best;
+	    }
+	    if(score > 0)
+	    {
+		expected.push_back(make_pair(-score, record));
+	    }
+	}
+	sort(expected.begin(), expected.end());
+	expected.resize(min(expected.size(), (size_t)MAX_SEARCH_RESULTS));
+
+	query_text(inventory, queries[query].c_str(), MAX_SEARCH_RESULTS,
+		   results);
+	wrong += results.size() != expected.size();
+	for(size_t hit = 0; hit < min(results.size(), expected.size()); hit++)
+	{
+	    wrong += results[hit].inventory_number !=
+		     entries[expected[hit].second].inventory_number;
+	}
+	answered += !results.empty();
+    }
+    CHECK(wrong == 0);
+    CHECK(answered * 4 > queries.size() * 3);
+    close_changes(inventory.changes);
+    return;
+}
+
+//*********************************************************************
+// Function:  test_accept_retries
+// Purpose:   to check that a server out of file descriptors keeps
+//            serving its clients and accepts the waiting ones once
+//            descriptors are free again, and stops only for SHUTDOWN
+//
+//*********************************************************************
+
+void test_accept_retries ()
+{
+    char path[] = "/tmp/bookWarehouseDB_test.sock";
+    Inventory inventory;
+    rlimit limit;
+    rlimit tight;
+    vector<int> filler;                // descriptors taken to use them up
+    bool served = false;
+    char line[64];
+
+    auto answered = [](const string &reply)
+		    {
+			return reply.size() > 5 &&
+			       reply.compare(reply.size() - 5, 5, "OK 1\n") == 0;
+		    };
+
+    open_test_inventory(inventory, 100, 2);
+    snprintf(line, sizeof(line), "GET %d\n", synthetic_number(5));
+    thread server([&]() { served = serve(inventory, path); });
+
+    int client = connect_to(path);
+    int waiting = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address;
+
+    CHECK(client >= 0 && waiting >= 0);
+    CHECK(answered(ask(client, line)));
+
+    CHECK(getrlimit(RLIMIT_NOFILE, &limit) == 0);
+    tight = limit;
+    tight.rlim_cur = highest_descriptor() + 1;
+    CHECK(setrlimit(RLIMIT_NOFILE, &tight) == 0);
+    for(int copy; (copy = dup(0)) >= 0; )
+    {
+	filler.push_back(copy);
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    CHECK(connect(waiting, (sockaddr *)&address, sizeof(address)) == 0);
+    this_thread::sleep_for(chrono::milliseconds(3 * ACCEPT_RETRY_MS));
+    CHECK(answered(ask(client, line)));
+
+    for(size_t copy = 0; copy < filler.size(); copy++)
+    {
+	close(filler[copy]);
+    }
+    CHECK(setrlimit(RLIMIT_NOFILE, &limit) == 0);
+    CHECK(answered(ask(waiting, line)));
+    close(waiting);
+
+    CHECK(ask(client, "SHUTDOWN\n") == "OK 0\n");
+    close(client);
+    server.join();
+    CHECK(served);
+    close_changes(inventory.changes);
+    return;
+}
+
+//*********************************************************************
+// Function:  test_long_lines
+// Purpose:   to check that a server answers lines up to
+//            COMMAND_LINE_MAX, and cuts off a client sending a longer
+//            line, with or without its newline
+//
+//*********************************************************************
+
+void test_long_lines ()
+{
+    char path[] = "/tmp/bookWarehouseDB_test.sock";
+    Inventory inventory;
+    string longest = "SEARCH" + string(COMMAND_LINE_MAX - 6, ' ') + "\n";
+    string endless(2 * COMMAND_LINE_MAX, 'x');  // and no newline
+    char chunk[256];
+    bool served = false;
+
+    open_test_inventory(inventory, 100, 2);
+    thread server([&]() { served = serve(inventory, path); });
+
+    int client = connect_to(path);
+    CHECK(client >= 0);
+    CHECK(ask(client, longest.c_str()) == "OK 0\n");
+    CHECK(ask(client, ("SEARCH " + longest).c_str())
+	      .compare(0, 4, "ERR ") == 0);
+    CHECK(read(client, chunk, sizeof(chunk)) == 0);
+    close(client);
+
+    client = connect_to(path);
+    CHECK(client >= 0);
+    CHECK(ask(client, endless.c_str()).compare(0, 4, "ERR ") == 0);
+    CHECK(read(client, chunk, sizeof(chunk)) == 0);
+    close(client);
+
+    client = connect_to(path);
+    CHECK(ask(client, "SHUTDOWN\n") == "OK 0\n");
+    close(client);
+    server.join();
+    CHECK(served);
+    close_changes(inventory.changes);
+    return;
+}
+
+//*********************************************************************
+// Function:  test_stock_totals
+// Purpose:   to check that the totals kept as records change are the
+//            totals of the records as they stand
+//
+// Details:   Records are adjusted into and out of stock and back
+//            orders, moved between categories and shelves, removed
+//            and added back, and changed in transactions that fail
+//            and are undone. Every grouping of the totals must then
+//            match a count made by listing every record.
+//
+//*********************************************************************
+
+void test_stock_totals ()
+{
+    const size_t records = 3000;
+    const StockView views[] = { VIEW_CATEGORY, VIEW_AUTHOR, VIEW_SHELF,
+				VIEW_ALL };
+    Inventory inventory;
+    Session session = { false, Transaction() };
+    map<int, string> removed;        // fields of records taken out
+    map<string, StockTally> counted[4];
+    map<string, StockTally> kept;
+    uint64_t state = BENCH_SEED;
+    char line[160];
+
+    auto same = [](const StockTally &a, const StockTally &b)
+		{
+		    return a.books == b.books && a.on_hand == b.on_hand &&
+			   a.out_of_stock == b.out_of_stock &&
+			   a.back_orders == b.back_orders &&
+			   a.back_ordered == b.back_ordered;
+		};
+
+    open_test_inventory(inventory, records, 4);
+    for(int step = 0; step < 6000; step++)
+    {
+	int number = synthetic_number(next_random(state) % 300);
+	int amount = next_random(state) % 40;
+
+	switch(next_random(state) % 6)
+	{
+	  case 0:
+	  case 1:
+	    snprintf(line, sizeof(line), "ADJ %d %d", number, amount - 25);
+	    break;
+	  case 2:
+	    snprintf(line, sizeof(line), "SET %d comment Lot %d", number,
+		     amount % 7);
+	    break;
+	  case 3:
+	    snprintf(line, sizeof(line), "SET %d location %c-%02d", number,
+		     'a' + amount % 5, amount);
+	    break;
+	  case 4:
+	    if(removed.count(number) == 0)
+	    {
+		snprintf(line, sizeof(line), "GET %d", number);
+		string reply = run_command(inventory, session, line);
+
+		removed[number] = reply.substr(0, reply.find('\n'));
+		snprintf(line, sizeof(line), "REMOVE %d", number);
+	    }
+	    else
+	    {
+		snprintf(line, sizeof(line), "ADD %s",
+			 removed[number].c_str());
+		removed.erase(number);
+	    }
+	    break;
+	  default:
+	    run_command(inventory, session, "BEGIN");
+	    snprintf(line, sizeof(line), "ADJ %d %d", number, amount);
+	    run_command(inventory, session, line);
+	    snprintf(line, sizeof(line), "SET %d comment Undone", number);
+	    run_command(inventory, session, line);
+	    run_command(inventory, session, "REMOVE -1");
+	    snprintf(line, sizeof(line), "COMMIT");
+	    break;
+	}
+	run_command(inventory, session, line);
+    }
+
+    for_each_in_order(inventory, [&](const Entry &entry)
+    {
+	char shelf = (char)tolower((unsigned char)entry.location[0]);
+	StockTally counts = { 1, 0, 0, 0, 0 };
+
+	if(entry.quantity > 0)
+	{
+	    counts.on_hand = entry.quantity;
+	}
+	else if(entry.quantity == 0)
+	{
+	    counts.out_of_stock = 1;
+	}
+	else
+	{
+	    counts.back_orders = 1;
+	    counts.back_ordered = -(int64_t)entry.quantity;
+	}
+	add_tally(counted[VIEW_CATEGORY][entry.comment], counts);
+	add_tally(counted[VIEW_AUTHOR][entry.author_name], counts);
+	add_tally(counted[VIEW_SHELF][shelf == '\0' ? string("none")
+						     : string(1, shelf)],
+		  counts);
+	add_tally(counted[VIEW_ALL]["all"], counts);
+    });
+    CHECK(counted[VIEW_ALL]["all"].back_orders > 0);
+    CHECK(counted[VIEW_ALL]["all"].books < (int64_t)records);
+    for(size_t view = 0; view < sizeof(views) / sizeof(views[0]); view++)
+    {
+	query_totals(inventory, views[view], NULL, kept);
+	CHECK(kept.size() == counted[views[view]].size());
+	for(map<string, StockTally>::const_iterator group = kept.begin();
+	    group != kept.end(); group++)
+	{
+	    CHECK(counted[views[view]].count(group->first) == 1 &&
+		  same(group->second, counted[views[view]][group->first]));
+	}
+    }
+    query_totals(inventory, VIEW_CATEGORY, "Lot 3", kept);
+    CHECK(kept.size() == 1 &&
+	  same(kept["Lot 3"], counted[VIEW_CATEGORY]["Lot 3"]));
+    CHECK(run_command(inventory, session, "TOTALS category Undone") ==
+	  "OK 0\n");
+    close_changes(inventory.changes);
+    return;
+}
+
+//*********************************************************************
+// Function:  test_paged_matches_memory
+// Purpose:   to check that an inventory kept in page files answers
+//            every command as one kept in memory does
+//
+// Details:   Both are loaded from the same file; the paged one holds
+//            only the fewest pages its shards may, a small part of
+//            the records, so most commands fetch, evict and write
+//            back pages. The same mix of lookups, queries and changes
+//            is run on both and every reply must be the same, as
+//            must a listing of everything at the end.
+//
+//*********************************************************************
+
+void test_paged_matches_memory ()
+{
+    const size_t records = 20000;
+    const size_t shards = 4;
+    const char *words[] = { "river", "storm", "gardn", "the code",
+			    "winter empire" };
+    Inventory memory;
+    Inventory paged;
+    Session in_memory = { false, Transaction() };
+    Session in_pages = { false, Transaction() };
+    Synthetic shape;
+    char name[] = "/tmp/bookWarehouseDB_test.XXXXXX";
+    char line[160];
+    uint64_t state = BENCH_SEED;
+    int differ = 0;
+
+    write_test_file(name, "");
+    open_synthetic(shape, records, BENCH_SEED);
+    CHECK(generate_inventory(shape, records, name));
+    open_inventory(memory, shards);
+    open_inventory(paged, shards);
+    CHECK(page_inventory(paged, shards * PAGE_POOL_MIN_FRAMES * PAGE_SIZE));
+    CHECK(records * sizeof(Record) >
+	  4 * shards * PAGE_POOL_MIN_FRAMES * PAGE_SIZE);
+    open_changes(memory.changes, NULL);
+    open_changes(paged.changes, NULL);
+    CHECK(load_inventory(memory, name));
+    CHECK(load_inventory(paged, name));
+    unlink(name);
+
+    for(int step = 0; step < 4000; step++)
+    {
+	int number = synthetic_number(next_random(state) % (records + 50));
+	int amount = next_random(state) % 100;
+
+	switch(next_random(state) % 9)
+	{
+	  case 0:
+	    snprintf(line, sizeof(line), "GET %d", number);
+	    break;
+	  case 1:
+	    snprintf(line, sizeof(line), "ADJ %d %d", number, amount - 50);
+	    break;
+	  case 2:
+	    snprintf(line, sizeof(line), "SET %d title %s %d", number,
+		     words[amount % 5], amount);
+	    break;
+	  case 3:
+	    snprintf(line, sizeof(line), "SET %d location %c-%02d", number,
+		     'a' + amount % 26, amount);
+	    break;
+	  case 4:
+	    snprintf(line, sizeof(line), "SET %d author Paged%d", number,
+		     amount);
+	    break;
+	  case 5:
+	    snprintf(line, sizeof(line), "REMOVE %d", number);
+	    break;
+	  case 6:
+	    snprintf(line, sizeof(line), "FIND %c", 'A' + amount % 26);
+	    break;
+	  case 7:
+	    snprintf(line, sizeof(line), "LOC %c %d %d", 'a' + amount % 26,
+		     amount / 2, amount);
+	    break;
+	  default:
+	    snprintf(line, sizeof(line), "SEARCH %s", words[amount % 5]);
+	    break;
+	}
+	if(run_command(memory, in_memory, line) !=
+	   run_command(paged, in_pages, line))
+	{
+	    differ++;
+	}
+    }
+    CHECK(differ == 0);
+    CHECK(run_command(memory, in_memory, "LIST") ==
+	  run_command(paged, in_pages, "LIST"));
+    CHECK(run_command(memory, in_memory, "TOTALS author") ==
+	  run_command(paged, in_pages, "TOTALS author"));
+    close_changes(memory.changes);
+    close_changes(paged.changes);
+    return;
+}
+
+//*********************************************************************
+// Function:  test_metrics_add_up
+// Purpose:   to check that STATS counts every operation exactly once,
+//            however many threads make them
+//
+// Details:   Each thread counts into a block of its own, so clients
+//            on threads of their own make lookups at once and STATS
+//            must add up to what they did. Its latencies must be in
+//            order, a failed transaction and the record count must
+//            show, nothing may be counted while metrics are off, and
+//            the JSON form must carry the same values.
+//
+//*********************************************************************
+
+void test_metrics_add_up ()
+{
+    const size_t records = 2000;
+    const int clients = 8;
+    const int lookups = 1000;
+    Inventory inventory;
+    Session session = { false, Transaction() };
+    vector<thread> workers;
+    map<string, double> before;
+    map<string, double> after;
+    char line[64];
+
+    auto stats = [&]()
+		 {
+		     map<string, double> values;
+		     istringstream reply(run_command(inventory, session,
+						     "STATS"));
+		     string text;
+
+		     while(getline(reply, text))
+		     {
+			 size_t tab = text.find(FIELD_SEP);
+
+			 if(tab != string::npos)
+			 {
+			     values[text.substr(0, tab)] =
+				 atof(text.c_str() + tab + 1);
+			 }
+		     }
+		     return values;
+		 };
+
+    open_test_inventory(inventory, records, 4);
+    before = stats();
+    for(int client = 0; client < clients; client++)
+    {
+	workers.push_back(thread([&, client]()
+	{
+	    Session own = { false, Transaction() };
+	    char get[64];
+
+	    for(int lookup = 0; lookup < lookups; lookup++)
+	    {
+		snprintf(get, sizeof(get), "GET %d",
+			 synthetic_number((client * lookups + lookup) %
+					  records));
+		run_command(inventory, own, get);
+	    }
+	}));
+    }
+    for(size_t worker = 0; worker < workers.size(); worker++)
+    {
+	workers[worker].join();
+    }
+    run_command(inventory, session, "BEGIN");
+    run_command(inventory, session, "REMOVE -1");
+    CHECK(run_command(inventory, session, "COMMIT").compare(0, 4, "ERR ")
+	  == 0);
+    after = stats();
+
+    CHECK(after["op.get.count"] - before["op.get.count"] ==
+	  clients * lookups);
+    CHECK(after["index.number.hits"] - before["index.number.hits"] ==
+	  clients * lookups);
+    CHECK(after["commit.failed"] - before["commit.failed"] == 1);
+    CHECK(after["records"] == records);
+    CHECK(after["metrics_enabled"] == 1);
+    CHECK(after["op.get.mean_us"] > 0 &&
+	  after["op.get.mean_us"] <= after["op.get.max_us"]);
+    CHECK(after["op.get.p50_us"] <= after["op.get.p90_us"] &&
+	  after["op.get.p90_us"] <= after["op.get.p99_us"] &&
+	  after["op.get.p99_us"] <= after["op.get.p999_us"] &&
+	  after["op.get.p999_us"] <= after["op.get.max_us"]);
+
+    CHECK(run_command(inventory, session, "STATS off") == "OK 0\n");
+    snprintf(line, sizeof(line), "GET %d", synthetic_number(0));
+    run_command(inventory, session, line);
+    CHECK(run_command(inventory, session, "STATS on") == "OK 0\n");
+    before = stats();
+    CHECK(before["op.get.count"] == after["op.get.count"]);
+    CHECK(before["index.number.hits"] == after["index.number.hits"]);
+
+    string json = run_command(inventory, session, "STATS json");
+    CHECK(json.compare(0, 2, "{\"") == 0);
+    CHECK(json.find("}\nOK 1\n") == json.size() - 7);
+    CHECK(json.find("\"records\": " + to_string(records) + ",") !=
+	  string::npos);
+    close_changes(inventory.changes);
+    return;
+}
+
+//*********************************************************************
+// Function:  test_synthetic_workload
+// Purpose:   to check the synthetic inventories and the benchmark run
+//            over them
+//
+// Details:   A seed must always make the same file, and another seed
+//            another file. Every record must load, with a few authors
+//            holding far more books than most, as the Zipf weights
+//            mean. A benchmark must run every operation asked for,
+//            shared among its clients, and report them as one line of
+//            JSON.
+//
+//*********************************************************************
+
+void test_synthetic_workload ()
+{
+    const size_t records = 5000;
+    const int operations = 2000;
+    char names[3][33] = { "/tmp/bookWarehouseDB_test.XXXXXX",
+			  "/tmp/bookWarehouseDB_test.XXXXXX",
+			  "/tmp/bookWarehouseDB_test.XXXXXX" };
+    string files[3];
+    Synthetic shape;
+    Inventory inventory;
+    Inventory bench;
+    map<string, StockTally> authors;
+    int64_t most = 0;
+    ostringstream report;
+
+    for(int file = 0; file < 3; file++)
+    {
+	write_test_file(names[file], "");
+	open_synthetic(shape, records, BENCH_SEED + (file == 2));
+	CHECK(generate_inventory(shape, records, names[file]));
+
+	ifstream inp(names[file]);
+	ostringstream text;
+	text << inp.rdbuf();
+	files[file] = text.str();
+    }
+    CHECK(files[0] == files[1]);
+    CHECK(files[0] != files[2]);
+
+    open_inventory(inventory, 4);
+    open_changes(inventory.changes, NULL);
+    CHECK(load_inventory(inventory, names[0]));
+    CHECK(total_entries(inventory) == records);
+    query_totals(inventory, VIEW_AUTHOR, NULL, authors);
+    for(map<string, StockTally>::const_iterator author = authors.begin();
+	author != authors.end(); author++)
+    {
+	most = max(most, author->second.books);
+    }
+    CHECK(most >= 10 * (int64_t)(records / authors.size()));
+    close_changes(inventory.changes);
+    for(int file = 0; file < 3; file++)
+    {
+	unlink(names[file]);
+    }
+
+    CHECK(mix_named("nonesuch") == NULL);
+    open_inventory(bench, 4);
+    open_changes(bench.changes, NULL);
+    CHECK(run_benchmark(bench, records, *mix_named("mixed"), operations, 3,
+			report));
+    CHECK(report.str().find('\n') == report.str().size() - 1);
+    CHECK(report.str().find("{\"records\": 5000, ") == 0);
+    CHECK(report.str().find("\"clients\": 3,") != string::npos);
+    CHECK(report.str().find("\"total\": {\"count\": " +
+			    to_string(operations) + ",") != string::npos);
+    CHECK(report.str().find("\"lookup\": {") != string::npos &&
+	  report.str().find("\"prefix\": {") != string::npos &&
+	  report.str().find("\"delete\": {") != string::npos);
+    close_changes(bench.changes);
+    return;
+}
+
+//*********************************************************************
+// Function:  test_buffered_exports
+// Purpose:   to check that an export written a chunk at a time holds
+//            every entry once, whole and in order, in every format
+//
+// Details:   The inventory is several OUTPUT_CHUNKs in every format,
+//            so each export is written in a number of pieces. Each
+//            file must match its entries formatted one by one; the
+//            tab layout must match LIST, the inventory layout must
+//            load back to the same inventory, fixed width lines must
+//            all be one length, and a title with a quote, comma and
+//            backslash must come out quoted for CSV and JSON.
+//
+//*********************************************************************
+
+void test_buffered_exports ()
+{
+    const size_t records = 40000;
+    const char *formats[] = { "report", "inventory", "tab", "csv", "json",
+			      "fixed" };
+    Inventory inventory;
+    Inventory reloaded;
+    Session session = { false, Transaction() };
+    Session again = { false, Transaction() };
+    char name[] = "/tmp/bookWarehouseDB_test.XXXXXX";
+    char line[160];
+    string files[FMT_FIXED + 1];
+    string listing;
+
+    write_test_file(name, "");
+    open_test_inventory(inventory, records, 4);
+    snprintf(line, sizeof(line), "SET %d title Say \"Hi\", Bob\\",
+	     synthetic_number(7));
+    CHECK(run_command(inventory, session, line) == "OK 1\n");
+
+    for(int format = FMT_REPORT; format <= FMT_FIXED; format++)
+    {
+	OutputFormat named;
+	string expected = (format == FMT_CSV) ?
+	    "author_name,author_initial,inventory_number,location,title,"
+	    "comment,quantity\n" : "";
+	int written = 0;
+	int count = 0;
+
+	CHECK(format_named(formats[format], named) && named == format);
+	CHECK(export_inventory(inventory, name, named, &written));
+	CHECK(written == (int)records);
+
+	ifstream inp(name, ios::binary);
+	ostringstream text;
+	text << inp.rdbuf();
+	files[format] = text.str();
+	CHECK(files[format].size() > 2 * (size_t)OUTPUT_CHUNK);
+
+	for_each_in_order(inventory, [&](const Entry &entry)
+	{
+	    format_entry(expected, entry, named, ++count);
+	});
+	CHECK(files[format] == expected);
+    }
+
+    listing = run_command(inventory, session, "LIST");
+    CHECK(listing == files[FMT_TAB] + "OK " + to_string(records) + "\n");
+    CHECK(files[FMT_CSV].find(",\"Say \"\"Hi\"\", Bob\\\",") !=
+	  string::npos);
+    CHECK(files[FMT_JSON].find("\"title\":\"Say \\\"Hi\\\", Bob\\\\\",")
+	  != string::npos);
+    for(size_t start = 0, end; start < files[FMT_FIXED].size();
+	start = end + 1)
+    {
+	end = files[FMT_FIXED].find('\n', start);
+	if(end - start != files[FMT_FIXED].find('\n'))
+	{
+	    CHECK(end - start == files[FMT_FIXED].find('\n'));
+	    break;
+	}
+    }
+
+    CHECK(export_inventory(inventory, name, FMT_FILE));
+    open_inventory(reloaded, 2);
+    open_changes(reloaded.changes, NULL);
+    CHECK(load_inventory(reloaded, name));
+    CHECK(run_command(reloaded, again, "LIST") == listing);
+    CHECK(!export_inventory(inventory, "/nonexistent/export", FMT_CSV));
+    unlink(name);
+    close_changes(reloaded.changes);
+    close_changes(inventory.changes);
+    return;
+}
+
+//*********************************************************************
+// Function:  test_transactions_undo
+// Purpose:   to check that a transaction is made whole or not at all
+//
+// Details:   A transaction over both shards whose last change fails
+//            must leave every record as it was, with nothing
+//            published to the change stream; so must ABORT, and an
+//            adjustment that would overflow. One that succeeds must
+//            make every change and publish each of them.
+//
+//*********************************************************************
+
+void test_transactions_undo ()
+{
+    Inventory inventory;
+    Session session = { false, Transaction() };
+    string before;
+    string record;
+    char line[200];
+    int numbers[3];
+    int quantity;
+    size_t index = 0;
+
+    auto published = [&]()
+		     {
+			 string reply = run_command(inventory, session,
+						    "CHANGES 0 100000");
+			 size_t last = reply.rfind("OK ");
+
+			 return (last == string::npos) ? -1 :
+				atoi(reply.c_str() + last + 3);
+		     };
+
+    open_test_inventory(inventory, 200, 2);
+    for(int number = 0; number < 3; number++)
+    {
+	do
+	{
+	    numbers[number] = synthetic_number(index++);
+	} while(shard_index(inventory, numbers[number]) != (size_t)number % 2);
+    }
+    snprintf(line, sizeof(line), "GET %d", numbers[2]);
+    record = run_command(inventory, session, line);
+    record = record.substr(0, record.find('\n'));
+    record.replace(record.find(to_string(numbers[2])),
+		   to_string(numbers[2]).size(), "999999999");
+    before = run_command(inventory, session, "LIST");
+    int changes = published();
+    quantity = quantity_of(inventory, numbers[0]);
+
+    CHECK(run_command(inventory, session, "BEGIN") == "OK 0\n");
+    snprintf(line, sizeof(line), "ADJ %d 5", numbers[0]);
+    CHECK(run_command(inventory, session, line) == "OK 0\n");
+    snprintf(line, sizeof(line), "SET %d title Undone", numbers[1]);
+    CHECK(run_command(inventory, session, line) == "OK 0\n");
+    snprintf(line, sizeof(line), "REMOVE %d", numbers[2]);
+    CHECK(run_command(inventory, session, line) == "OK 0\n");
+    snprintf(line, sizeof(line), "ADD %s", record.c_str());
+    CHECK(run_command(inventory, session, line) == "OK 0\n");
+    CHECK(run_command(inventory, session, "ADJ -1 1") == "OK 0\n");
+    CHECK(run_command(inventory, session, "COMMIT") ==
+	  "ERR change 5: -1 not found\n");
+    CHECK(run_command(inventory, session, "LIST") == before);
+    CHECK(published() == changes);
+
+    CHECK(run_command(inventory, session, "BEGIN") == "OK 0\n");
+    snprintf(line, sizeof(line), "REMOVE %d", numbers[1]);
+    run_command(inventory, session, line);
+    CHECK(run_command(inventory, session, "ABORT") == "OK 0\n");
+    CHECK(run_command(inventory, session, "COMMIT") ==
+	  "ERR no transaction\n");
+    snprintf(line, sizeof(line), "ADJ %d %d", numbers[0], INT_MAX);
+    CHECK(run_command(inventory, session, line).compare(0, 4, "ERR ") == 0);
+    CHECK(run_command(inventory, session, "LIST") == before);
+    CHECK(published() == changes);
+
+    CHECK(run_command(inventory, session, "BEGIN") == "OK 0\n");
+    snprintf(line, sizeof(line), "ADJ %d 5", numbers[0]);
+    run_command(inventory, session, line);
+    snprintf(line, sizeof(line), "ADJ %d -2", numbers[0]);
+    run_command(inventory, session, line);
+    snprintf(line, sizeof(line), "REMOVE %d", numbers[2]);
+    run_command(inventory, session, line);
+    CHECK(run_command(inventory, session, "COMMIT") == "OK 3\n");
+    CHECK(quantity_of(inventory, numbers[0]) == quantity + 3);
+    CHECK(quantity_of(inventory, numbers[2]) == INT_MIN);
+    CHECK(published() == changes + 3);
+    close_changes(inventory.changes);
+    return;
+}
+
+//*********************************************************************
+// Function:  test_location_ranges
+// Purpose:   to check location queries against looking at every
+//            record
+//
+// Details:   Records are moved between shelves and bins, including
+//            upper case shelves and locations with no bin, and are
+//            removed. Each range asked for must then give exactly the
+//            records in it, in walk order, as a check of every record
+//            finds them.
+//
+//*********************************************************************
+
+void test_location_ranges ()
+{
+    const size_t records = 3000;
+    const char *odd[] = { "G-05", "g", "g-7a", "G-", "q-00" };
+    Inventory inventory;
+    Session session = { false, Transaction() };
+    vector<Entry> every;
+    vector<Entry> found;
+    vector<int> expected;
+    vector<int> got;
+    uint64_t state = BENCH_SEED;
+    char line[64];
+
+    open_test_inventory(inventory, records, 4);
+    for(int step = 0; step < 1500; step++)
+    {
+	int number = synthetic_number(next_random(state) % records);
+	int bin = next_random(state) % 100;
+
+	if(step % 10 == 0)
+	{
+	    snprintf(line, sizeof(line), "REMOVE %d", number);
+	}
+	else if(step % 10 == 1)
+	{
+	    snprintf(line, sizeof(line), "SET %d location %s", number,
+		     odd[bin % 5]);
+	}
+	else
+	{
+	    snprintf(line, sizeof(line), "SET %d location %c-%02d", number,
+		     "gqx"[bin % 3], bin);
+	}
+	run_command(inventory, session, line);
+    }
+    for_each_in_order(inventory, [&](const Entry &entry)
+    {
+	every.push_back(entry);
+    });
+    sort(every.begin(), every.end(), walk_order);
+
+    for(int query = 0; query < 300; query++)
+    {
+	char shelf = "gqxa"[query % 4];
+	int first = (query % 7 == 0) ? NO_BIN : next_random(state) % 100;
+	int last = (query % 5 == 0) ? INT_MAX :
+		   first + (int)(next_random(state) % 20);
+
+	expected.clear();
+	for(size_t entry = 0; entry < every.size(); entry++)
+	{
+	    LOCATION_KEY key = location_key(every[entry]);
+
+	    if(get<0>(key) == shelf && get<1>(key) >= first &&
+	       get<1>(key) <= last)
+	    {
+		expected.push_back(every[entry].inventory_number);
+	    }
+	}
+	query_by_location(inventory, shelf, first, last, found);
+	got.clear();
+	for(size_t entry = 0; entry < found.size(); entry++)
+	{
+	    got.push_back(found[entry].inventory_number);
+	}
+	CHECK(got == expected);
+    }
+    close_changes(inventory.changes);
+    return;
+}